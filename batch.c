@@ -0,0 +1,220 @@
+/// batch - Run a pipeline template on many image files, overlapping I/O.
+///
+/// This module is an extension of imageTool,
+/// a programming project for the course AED, DETI / UA.PT
+///
+/// You may freely use and modify this code, at your own risk,
+/// as long as you give proper credit to the original and subsequent authors.
+
+#include "batch.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include "image8bit.h"
+#include "instrumentation.h"
+
+// The data structure
+//
+// Three threads form a pipeline of their own:
+//   reader --loaded--> caller (PipelineRunOn) --processed--> writer
+// Each queue is a ring buffer of (file index, image) items, and holds at
+// most depth items: a thread that gets ahead waits for the next one.
+// Files are handled in order, so the items in each queue are in order too.
+//
+// A single mutex protects both queues and the error state, and a single
+// condition variable signals any change: there is little contention, as
+// each item costs a whole image load, process or save.
+//
+// When a file fails, its index is recorded in failed (if it is the first
+// failure, in file order), and items of later files are dropped: the
+// reader stops, and the writer still saves the results of earlier files.
+
+typedef struct {
+  int index;      // of the file
+  Image img;
+} Item;
+
+typedef struct {
+  Item* item;     // ring buffer of capacity items
+  int capacity;
+  int head;       // first item
+  int count;      // number of items
+  int closed;     // no more items will be put?
+} Queue;
+
+struct batch {
+  Pipeline p;
+  char* const* in;    // input file names
+  char* const* out;   // output file names
+  pthread_mutex_t lock;
+  pthread_cond_t changed;
+  Queue loaded;       // images loaded, waiting to be processed
+  Queue processed;    // results, waiting to be saved
+  int failed;         // index of the first file that failed (n = none)
+  int err;            // its error code,
+  int errnum;         // errno,
+  const char* cause;  // and error cause
+  int n;              // number of files
+};
+
+// Record the failure of file index, unless an earlier file failed.
+static void fail(struct batch* b, int index, int err, const char* cause) {
+  int errnum = errno;
+  pthread_mutex_lock(&b->lock);
+  if (index < b->failed) {
+    b->failed = index;
+    b->err = err;
+    b->errnum = errnum;
+    b->cause = cause;
+  }
+  pthread_cond_broadcast(&b->changed);
+  pthread_mutex_unlock(&b->lock);
+}
+
+// Put item it in queue q, waiting for room.
+// Returns 0 (and does not put it) if an earlier file failed.
+static int put(struct batch* b, Queue* q, Item it) {
+  pthread_mutex_lock(&b->lock);
+  while (q->count == q->capacity && it.index < b->failed) {
+    pthread_cond_wait(&b->changed, &b->lock);
+  }
+  int ok = it.index < b->failed;
+  if (ok) {
+    q->item[(q->head + q->count) % q->capacity] = it;
+    q->count++;
+    pthread_cond_broadcast(&b->changed);
+  }
+  pthread_mutex_unlock(&b->lock);
+  return ok;
+}
+
+// Get the next item of queue q into *it, waiting for one.
+// Items of files after a failed one are destroyed, not returned.
+// Returns 0 when q is closed and empty.
+static int get(struct batch* b, Queue* q, Item* it) {
+  pthread_mutex_lock(&b->lock);
+  int ok;
+  for (;;) {
+    while (q->count == 0 && !q->closed) {
+      pthread_cond_wait(&b->changed, &b->lock);
+    }
+    ok = q->count > 0;
+    if (!ok) break;
+    *it = q->item[q->head];
+    q->head = (q->head + 1) % q->capacity;
+    q->count--;
+    pthread_cond_broadcast(&b->changed);
+    if (it->index < b->failed) break;
+    ImageDestroy(&it->img);
+  }
+  pthread_mutex_unlock(&b->lock);
+  return ok;
+}
+
+// Close queue q: no more items will be put.
+static void closeQueue(struct batch* b, Queue* q) {
+  pthread_mutex_lock(&b->lock);
+  q->closed = 1;
+  pthread_cond_broadcast(&b->changed);
+  pthread_mutex_unlock(&b->lock);
+}
+
+// Reader thread: load the input files, in order.
+static void* reader(void* arg) {
+  struct batch* b = arg;
+  InstrThreadBegin();
+  for (int i = 0; i < b->n; i++) {
+    fprintf(stderr, "Loading %s\n", b->in[i]);
+    Item it = { i, ImageLoad(b->in[i]) };
+    if (it.img == NULL) {
+      fail(b, i, 4, ImageErrMsg());
+      break;
+    }
+    if (!put(b, &b->loaded, it)) {
+      ImageDestroy(&it.img);
+      break;
+    }
+  }
+  closeQueue(b, &b->loaded);
+  InstrThreadEnd();
+  return NULL;
+}
+
+// Writer thread: save the results, in order.
+static void* writer(void* arg) {
+  struct batch* b = arg;
+  InstrThreadBegin();
+  Item it;
+  while (get(b, &b->processed, &it)) {
+    fprintf(stderr, "Saving %s\n", b->out[it.index]);
+    if (ImageSave(it.img, b->out[it.index]) == 0) fail(b, it.index, 4, ImageErrMsg());
+    ImageDestroy(&it.img);
+  }
+  InstrThreadEnd();
+  return NULL;
+}
+
+/// Apply template p to each of the n images in files in[0..n-1].
+int BatchRun(Pipeline p, int n, char* const in[], char* const out[], int depth,
+             int* failed, const char** cause) { ///
+  assert(p != NULL);
+  assert(n >= 0);
+  assert(depth > 0);
+  assert(failed != NULL && cause != NULL);
+
+  struct batch b = {
+    .p = p, .in = in, .out = out, .n = n, .failed = n,
+    .lock = PTHREAD_MUTEX_INITIALIZER, .changed = PTHREAD_COND_INITIALIZER,
+    .loaded = { .capacity = depth }, .processed = { .capacity = depth },
+  };
+  b.loaded.item = malloc(depth*sizeof(Item));
+  b.processed.item = malloc(depth*sizeof(Item));
+  pthread_t rd, wr;
+  int readerUp = 0, writerUp = 0;   // threads started?
+  if (b.loaded.item == NULL || b.processed.item == NULL) {
+    fail(&b, -1, 4, "Out of memory");
+  } else {
+    int rc = pthread_create(&rd, NULL, reader, &b);
+    readerUp = rc == 0;
+    if (readerUp) rc = pthread_create(&wr, NULL, writer, &b);
+    writerUp = readerUp && rc == 0;
+    // Without both threads, fail before the first file: nothing is processed.
+    if (!writerUp) {
+      errno = rc;
+      fail(&b, -1, 4, "Starting I/O threads failed");
+    }
+  }
+  if (!readerUp) b.loaded.closed = 1;
+
+  // Process the images as they arrive, and pass the results on.
+  Item it;
+  while (get(&b, &b.loaded, &it)) {
+    int err = PipelineRunOn(p, &it.img);
+    if (err != 0) {
+      fail(&b, it.index, err, ImageErrMsg());
+      break;
+    }
+    if (!put(&b, &b.processed, it)) {
+      ImageDestroy(&it.img);
+      break;
+    }
+  }
+  closeQueue(&b, &b.processed);
+  if (readerUp) pthread_join(rd, NULL);
+  if (writerUp) pthread_join(wr, NULL);
+
+  // Drop the images loaded after a failure.
+  b.loaded.closed = 1;
+  while (get(&b, &b.loaded, &it)) ImageDestroy(&it.img);
+  free(b.loaded.item);
+  free(b.processed.item);
+
+  if (b.failed == n) return 0;
+  *failed = b.failed;
+  *cause = b.cause;
+  errno = b.errnum;
+  return b.err;
+}
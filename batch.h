@@ -0,0 +1,34 @@
+/// batch - Run a pipeline template on many image files, overlapping I/O.
+///
+/// Processing a list of files one at a time, load -> process -> save,
+/// leaves the CPU idle while a file is read or written, and the disk idle
+/// while an image is processed.  BatchRun keeps both busy: a reader thread
+/// loads the next input files ahead of the pipeline, and a writer thread
+/// saves the results behind it, while the calling thread runs the pipeline.
+/// Both hand images over through bounded queues, so at most about 2*depth
+/// images (plus the one being processed) are in memory at any time.
+///
+/// This module is an extension of imageTool,
+/// a programming project for the course AED, DETI / UA.PT
+///
+/// You may freely use and modify this code, at your own risk,
+/// as long as you give proper credit to the original and subsequent authors.
+
+#ifndef BATCH_H
+#define BATCH_H
+
+#include "pipeline.h"
+
+/// Apply template p (see PipelineParseTemplate) to each of the n images in
+/// files in[0..n-1], saving the result of in[i] to file out[i].
+///   depth : how many images may wait to be processed, and to be saved.
+/// Requires: p is optimized; depth > 0.
+/// Returns 0 on success.  On failure, stops at the first error, and
+/// returns its code (see PipelineErrMsg), with *failed set to the index of
+/// the file that failed (or -1, if the batch could not start), *cause to
+/// its error cause (see ImageErrMsg), and errno set accordingly.
+/// The results of the files before it are saved.
+int BatchRun(Pipeline p, int n, char* const in[], char* const out[], int depth,
+             int* failed, const char** cause) ;
+
+#endif
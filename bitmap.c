@@ -0,0 +1,376 @@
+/// bitmap - Bit-packed binary images (masks).
+///
+/// You may freely use and modify this code, at your own risk,
+/// as long as you give proper credit to the original and subsequent authors.
+
+#include "bitmap.h"
+
+#include <assert.h>
+#include <ctype.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// The data structure
+//
+// Each row of a bitmap is stored in `words` 64-bit words: pixel (x,y) is
+// bit x%64 (counting from the least significant) of word x/64 of row y.
+// The bits of the last word of a row beyond the width are always 0, so that
+// whole words can be counted and compared without masking.
+
+// Internal structure for storing bitmaps
+struct bitmap {
+  int width;
+  int height;
+  int words;        // words per row
+  uint64_t* bits;   // height rows of words
+};
+
+// This module follows "design-by-contract" principles, and handles errors
+// as image8bit does: see check() there.
+
+// Variable to preserve errno temporarily
+static int errsave = 0;
+
+// Error cause
+// (Per thread, as in image8bit: bitmaps may be used in several threads.)
+static _Thread_local char* errCause = "";
+
+/// Error cause of the last failed bitmap operation (as ImageErrMsg).
+char* BitmapErrMsg(void) { ///
+  return errCause;
+}
+
+// Check a condition and set errCause to failmsg in case of failure.
+// Preserves global errno!
+static int check(int condition, const char* failmsg) {
+  errCause = (char*)(condition ? "" : failmsg);
+  return condition;
+}
+
+// Row y of bmp
+static inline uint64_t* Row(Bitmap bmp, int y) {
+  return bmp->bits + (size_t)y*bmp->words;
+}
+
+// Mask of the valid bits of word k of a row of width bits.
+static inline uint64_t WordMask(int width, int k) {
+  int n = width - 64*k;   // valid bits in word k
+  return n >= 64 ? ~(uint64_t)0 : ((uint64_t)1 << n) - 1;
+}
+
+// The 64 bits of a row (of rowWords words) starting at bit x.
+// Bits past the end of the row read as 0.
+static inline uint64_t GetBits(const uint64_t* row, int rowWords, int x) {
+  int w = x >> 6, s = x & 63;
+  uint64_t v = row[w] >> s;
+  if (s != 0 && w + 1 < rowWords) v |= row[w+1] << (64 - s);
+  return v;
+}
+
+/// Bitmap management functions
+
+/// Create a new bitmap with all bits clear (black).
+Bitmap BitmapCreate(int width, int height) { ///
+  assert(width >= 0);
+  assert(height >= 0);
+  Bitmap bmp = malloc(sizeof(struct bitmap));
+  if (!check(bmp != NULL, "Out of memory")) return NULL;
+  bmp->width = width;
+  bmp->height = height;
+  bmp->words = (width + 63) / 64;
+  bmp->bits = calloc((size_t)bmp->words*height + 1, sizeof(uint64_t));
+  if (!check(bmp->bits != NULL, "Out of memory")) {
+    free(bmp);
+    return NULL;
+  }
+  return bmp;
+}
+
+/// Destroy the bitmap pointed to by (*bmpp).
+void BitmapDestroy(Bitmap* bmpp) { ///
+  assert(bmpp != NULL);
+  if (*bmpp == NULL) return;
+  free((*bmpp)->bits);
+  free(*bmpp);
+  *bmpp = NULL;
+}
+
+/// Create a bitmap from img: bit (x,y) is set if pixel (x,y) >= thr.
+Bitmap BitmapFromImage(Image img, uint8 thr) { ///
+  assert(img != NULL);
+  int width = ImageWidth(img);
+  int height = ImageHeight(img);
+  Bitmap bmp = BitmapCreate(width, height);
+  uint8* levels = malloc(width + 1);
+  if (!check(bmp != NULL && levels != NULL, "Out of memory")) {
+    errsave = errno;
+    BitmapDestroy(&bmp);
+    free(levels);
+    errno = errsave;
+    return NULL;
+  }
+  for (int y = 0; y < height; y++) {
+    ImageGetRow(img, y, levels);
+    uint64_t* row = Row(bmp, y);
+    for (int k = 0; k < bmp->words; k++) {
+      const uint8* p = levels + 64*k;
+      int n = width - 64*k < 64 ? width - 64*k : 64;
+      uint64_t v = 0;
+      for (int b = 0; b < n; b++) v |= (uint64_t)(p[b] >= thr) << b;
+      row[k] = v;
+    }
+  }
+  free(levels);
+  return bmp;
+}
+
+/// Create an image from bmp, with set bits at maxval and clear bits at 0.
+Image BitmapToImage(Bitmap bmp, uint8 maxval) { ///
+  assert(bmp != NULL);
+  assert(maxval > 0);
+  Image img = ImageCreate(bmp->width, bmp->height, maxval);
+  uint8* levels = malloc(bmp->width + 1);
+  if (!check(img != NULL && levels != NULL, "Out of memory")) {
+    errsave = errno;
+    ImageDestroy(&img);
+    free(levels);
+    errno = errsave;
+    return NULL;
+  }
+  for (int y = 0; y < bmp->height; y++) {
+    const uint64_t* row = Row(bmp, y);
+    for (int x = 0; x < bmp->width; x++) {
+      levels[x] = (row[x >> 6] >> (x & 63)) & 1 ? maxval : 0;
+    }
+    ImageSetRow(img, y, levels);
+  }
+  free(levels);
+  return img;
+}
+
+/// PBM file operations
+
+// PBM format specification: http://netpbm.sourceforge.net/doc/pbm.html
+// Rows are packed 8 pixels per byte, leftmost pixel in the most significant
+// bit, and 1 means black.
+
+// Reverse the order of the bits of a byte.
+static inline uint8 Reverse8(uint8 b) {
+  b = (uint8)((b & 0xF0) >> 4 | (b & 0x0F) << 4);
+  b = (uint8)((b & 0xCC) >> 2 | (b & 0x33) << 2);
+  b = (uint8)((b & 0xAA) >> 1 | (b & 0x55) << 1);
+  return b;
+}
+
+// Match and skip 0 or more comment lines in file f (as in image8bit).
+static int skipComments(FILE* f) {
+  char c;
+  int i = 0;
+  while (fscanf(f, "#%*[^\n]%c", &c) == 1 && c == '\n') {
+    i++;
+  }
+  return i;
+}
+
+// Read the packed rows of bmp from f.  Returns 1 on success.
+static int readRows(Bitmap bmp, FILE* f) {
+  int nbytes = (bmp->width + 7) / 8;
+  uint8* bytes = malloc(nbytes + 1);
+  if (!check(bytes != NULL, "Out of memory")) return 0;
+  int ok = 1;
+  for (int y = 0; y < bmp->height && ok; y++) {
+    ok = check(fread(bytes, 1, nbytes, f) == (size_t)nbytes, "Reading pixels");
+    uint64_t* row = Row(bmp, y);
+    for (int i = 0; i < nbytes && ok; i++) {
+      row[i / 8] |= (uint64_t)Reverse8((uint8)~bytes[i]) << (8*(i % 8));
+    }
+    if (ok) row[bmp->words - 1] &= WordMask(bmp->width, bmp->words - 1);
+  }
+  free(bytes);
+  return ok;
+}
+
+/// Load a raw PBM (P4) file.
+Bitmap BitmapLoad(const char* filename) { ///
+  int w, h;
+  char c;
+  FILE* f = NULL;
+  Bitmap bmp = NULL;
+
+  int success =
+  check( (f = fopen(filename, "rb")) != NULL, "Open failed" ) &&
+  // Parse PBM header
+  check( fscanf(f, "P%c ", &c) == 1 && c == '4' , "Invalid file format" ) &&
+  skipComments(f) >= 0 &&
+  check( fscanf(f, "%d ", &w) == 1 && w >= 0 , "Invalid width" ) &&
+  skipComments(f) >= 0 &&
+  check( fscanf(f, "%d", &h) == 1 && h >= 0 , "Invalid height" ) &&
+  check( fscanf(f, "%c", &c) == 1 && isspace(c) , "Whitespace expected" ) &&
+  // Allocate bitmap
+  (bmp = BitmapCreate(w, h)) != NULL &&
+  // Read pixels
+  (w == 0 || readRows(bmp, f));
+
+  // Cleanup
+  if (!success) {
+    errsave = errno;
+    BitmapDestroy(&bmp);
+    errno = errsave;
+  }
+  if (f != NULL) fclose(f);
+  return bmp;
+}
+
+// Write the packed rows of bmp to f.  Returns 1 on success.
+static int writeRows(Bitmap bmp, FILE* f) {
+  int nbytes = (bmp->width + 7) / 8;
+  uint8* bytes = malloc(nbytes + 1);
+  if (!check(bytes != NULL, "Out of memory")) return 0;
+  int ok = 1;
+  for (int y = 0; y < bmp->height && ok; y++) {
+    const uint64_t* row = Row(bmp, y);
+    for (int i = 0; i < nbytes; i++) {
+      bytes[i] = Reverse8((uint8)~(row[i / 8] >> (8*(i % 8))));
+    }
+    if (bmp->width % 8 != 0) {   // clear the padding bits
+      bytes[nbytes - 1] &= (uint8)(0xFF << (8 - bmp->width % 8));
+    }
+    ok = check(fwrite(bytes, 1, nbytes, f) == (size_t)nbytes, "Writing pixels failed");
+  }
+  free(bytes);
+  return ok;
+}
+
+/// Save bitmap to a raw PBM (P4) file, 8 pixels per byte.
+int BitmapSave(Bitmap bmp, const char* filename) { ///
+  assert(bmp != NULL);
+  FILE* f = NULL;
+
+  int success =
+  check( (f = fopen(filename, "wb")) != NULL, "Open failed" ) &&
+  check( fprintf(f, "P4\n%d %d\n", bmp->width, bmp->height) > 0, "Writing header failed" ) &&
+  writeRows(bmp, f);
+
+  // Cleanup
+  if (f != NULL && fclose(f) != 0) success = check(0, "Writing pixels failed");
+  return success;
+}
+
+/// Information queries
+
+/// Get bitmap width
+int BitmapWidth(Bitmap bmp) { ///
+  assert(bmp != NULL);
+  return bmp->width;
+}
+
+/// Get bitmap height
+int BitmapHeight(Bitmap bmp) { ///
+  assert(bmp != NULL);
+  return bmp->height;
+}
+
+/// Number of set (white) bits, by word popcounts.
+long BitmapCount(Bitmap bmp) { ///
+  assert(bmp != NULL);
+  size_t n = (size_t)bmp->words*bmp->height;
+  long count = 0;
+  for (size_t i = 0; i < n; i++) count += __builtin_popcountll(bmp->bits[i]);
+  return count;
+}
+
+/// Bit get & set operations
+
+/// Get bit (x,y): 1 (white) or 0 (black).
+int BitmapGetBit(Bitmap bmp, int x, int y) { ///
+  assert(bmp != NULL);
+  assert(0 <= x && x < bmp->width && 0 <= y && y < bmp->height);
+  return (int)((Row(bmp, y)[x >> 6] >> (x & 63)) & 1);
+}
+
+/// Set bit (x,y) to bit (0 or 1).
+void BitmapSetBit(Bitmap bmp, int x, int y, int bit) { ///
+  assert(bmp != NULL);
+  assert(0 <= x && x < bmp->width && 0 <= y && y < bmp->height);
+  uint64_t m = (uint64_t)1 << (x & 63);
+  uint64_t* word = &Row(bmp, y)[x >> 6];
+  *word = bit ? *word | m : *word & ~m;
+}
+
+/// Operations on two bitmaps
+
+// Combine bits a (within mask m) into word *d.
+static inline void Deposit(uint64_t* d, uint64_t a, uint64_t m, BitOp op) {
+  switch (op) {
+  case BIT_AND: *d &= a | ~m; break;
+  case BIT_OR:  *d |= a; break;
+  case BIT_XOR: *d ^= a; break;
+  }
+}
+
+/// Combine bmp2 into position (x, y) of bmp1.
+void BitmapCombine(Bitmap bmp1, int x, int y, Bitmap bmp2, BitOp op) { ///
+  assert(bmp1 != NULL);
+  assert(bmp2 != NULL);
+  assert(0 <= x && x + bmp2->width <= bmp1->width);
+  assert(0 <= y && y + bmp2->height <= bmp1->height);
+  int s = x & 63;
+  for (int j = 0; j < bmp2->height; j++) {
+    const uint64_t* src = Row(bmp2, j);
+    uint64_t* dst = Row(bmp1, y + j) + (x >> 6);
+    for (int k = 0; k < bmp2->words; k++) {
+      uint64_t a = src[k];
+      uint64_t m = WordMask(bmp2->width, k);
+      // Word k covers bits x+64k .. x+64k+63 of bmp1: it straddles two
+      // words of bmp1, unless x is a multiple of 64.
+      Deposit(&dst[k], a << s, m << s, op);
+      if (s != 0 && (m >> (64 - s)) != 0) Deposit(&dst[k+1], a >> (64 - s), m >> (64 - s), op);
+    }
+  }
+}
+
+/// Compare a bitmap to a subbitmap of a larger bitmap.
+int BitmapMatchSubImage(Bitmap bmp1, int x, int y, Bitmap bmp2) { ///
+  assert(bmp1 != NULL);
+  assert(bmp2 != NULL);
+  assert(0 <= x && x + bmp2->width <= bmp1->width);
+  assert(0 <= y && y + bmp2->height <= bmp1->height);
+  for (int j = 0; j < bmp2->height; j++) {
+    const uint64_t* row1 = Row(bmp1, y + j);
+    const uint64_t* row2 = Row(bmp2, j);
+    for (int k = 0; k < bmp2->words; k++) {
+      uint64_t v = GetBits(row1, bmp1->words, x + 64*k) & WordMask(bmp2->width, k);
+      if (v != row2[k]) return 0;
+    }
+  }
+  return 1;
+}
+
+/// Locate a subbitmap inside another bitmap, as ImageLocateSubImage.
+int BitmapLocateSubImage(Bitmap bmp1, int* px, int* py, Bitmap bmp2) { ///
+  assert(bmp1 != NULL);
+  assert(bmp2 != NULL);
+  if (bmp2->width == 0 || bmp2->height == 0) {   // matches anywhere
+    if (bmp2->width > bmp1->width || bmp2->height > bmp1->height) return 0;
+    *px = 0;
+    *py = 0;
+    return 1;
+  }
+  uint64_t first = Row(bmp2, 0)[0];
+  uint64_t mask = WordMask(bmp2->width, 0);
+  for (int i = 0; i <= bmp1->height - bmp2->height; i++) {
+    const uint64_t* row1 = Row(bmp1, i);
+    for (int j = 0; j <= bmp1->width - bmp2->width; j++) {
+      // Cheap filter: the first word of the first row must match.
+      if ((GetBits(row1, bmp1->words, j) & mask) != first) continue;
+      if (BitmapMatchSubImage(bmp1, j, i, bmp2)) {
+        *px = j;
+        *py = i;
+        return 1;
+      }
+    }
+  }
+  return 0;
+}
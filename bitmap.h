@@ -0,0 +1,105 @@
+/// bitmap - Bit-packed binary images (masks).
+///
+/// A bitmap stores one bit per pixel, 64 pixels per word: a thresholded
+/// image, which only holds 0 and maxval, takes 8 times less memory as a
+/// bitmap, and whole words of pixels are combined, counted and compared
+/// at a time.  Bit (x,y) is 1 (set) where the image was white (maxval),
+/// and 0 where it was black.
+///
+/// This module follows the same conventions as image8bit: design by
+/// contract, and functions that allocate memory or do I/O return NULL or 0
+/// on failure, with errno/errCause set (see BitmapErrMsg).
+///
+/// You may freely use and modify this code, at your own risk,
+/// as long as you give proper credit to the original and subsequent authors.
+
+#ifndef BITMAP_H
+#define BITMAP_H
+
+#include "image8bit.h"
+
+// Type Bitmap is a pointer to bitmap objects
+typedef struct bitmap *Bitmap;
+
+/// Bitwise operations for BitmapCombine
+typedef enum { BIT_AND, BIT_OR, BIT_XOR } BitOp;
+
+/// Error cause of the last failed bitmap operation (as ImageErrMsg).
+char* BitmapErrMsg(void) ;
+
+/// Bitmap management functions
+
+/// Create a new bitmap with all bits clear (black).
+/// Requires: width and height must be non-negative.
+/// On success, a new bitmap is returned.
+/// (The caller is responsible for destroying the returned bitmap!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+Bitmap BitmapCreate(int width, int height) ;
+
+/// Destroy the bitmap pointed to by (*bmpp).
+/// If (*bmpp)==NULL, no operation is performed.
+/// Ensures: (*bmpp)==NULL.
+void BitmapDestroy(Bitmap* bmpp) ;
+
+/// Create a bitmap from img: bit (x,y) is set if pixel (x,y) >= thr,
+/// exactly as ImageThreshold(img, thr) turns it white.
+/// On failure, returns NULL and errno/errCause are set accordingly.
+Bitmap BitmapFromImage(Image img, uint8 thr) ;
+
+/// Create an image from bmp, with set bits at maxval and clear bits at 0.
+/// Requires: maxval > 0.
+/// On failure, returns NULL and errno/errCause are set accordingly.
+Image BitmapToImage(Bitmap bmp, uint8 maxval) ;
+
+/// PBM file operations
+
+/// Load a raw PBM (P4) file.  (In PBM, 1 is black: bits are inverted.)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+Bitmap BitmapLoad(const char* filename) ;
+
+/// Save bitmap to a raw PBM (P4) file, 8 pixels per byte.
+/// On success, returns nonzero.
+/// On failure, returns 0, errno/errCause are set appropriately, and
+/// a partial and invalid file may be left in the system.
+int BitmapSave(Bitmap bmp, const char* filename) ;
+
+/// Information queries
+
+/// Get bitmap width
+int BitmapWidth(Bitmap bmp) ;
+
+/// Get bitmap height
+int BitmapHeight(Bitmap bmp) ;
+
+/// Number of set (white) bits, by word popcounts.
+long BitmapCount(Bitmap bmp) ;
+
+/// Bit get & set operations
+
+/// Get bit (x,y): 1 (white) or 0 (black).
+int BitmapGetBit(Bitmap bmp, int x, int y) ;
+
+/// Set bit (x,y) to bit (0 or 1).
+void BitmapSetBit(Bitmap bmp, int x, int y, int bit) ;
+
+/// Operations on two bitmaps
+
+/// Combine bmp2 into position (x, y) of bmp1: each bit of bmp1 covered by
+/// bmp2 becomes itself AND, OR or XOR the bit of bmp2 over it.
+/// This modifies bmp1 in-place: no allocation involved.
+/// Requires: bmp2 must fit inside bmp1 at position (x, y).
+void BitmapCombine(Bitmap bmp1, int x, int y, Bitmap bmp2, BitOp op) ;
+
+/// Compare a bitmap to a subbitmap of a larger bitmap.
+/// Returns 1 (true) if bmp2 matches the bits of bmp1 at pos (x, y).
+/// Returns 0, otherwise.
+/// Requires: bmp2 must fit inside bmp1 at position (x, y).
+int BitmapMatchSubImage(Bitmap bmp1, int x, int y, Bitmap bmp2) ;
+
+/// Locate a subbitmap inside another bitmap, as ImageLocateSubImage.
+/// Rows are compared 64 bits at a time.
+/// If a match is found, returns 1 and matching position is set in vars (*px, *py).
+/// If no match is found, returns 0 and (*px, *py) are left untouched.
+int BitmapLocateSubImage(Bitmap bmp1, int* px, int* py, Bitmap bmp2) ;
+
+#endif
@@ -23,9 +23,17 @@
 #include <assert.h>
 #include <ctype.h>
 #include <errno.h>
+#include <stdatomic.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 #include "instrumentation.h"
+#include "kernels.h"
 // The data structure
 //
 // An image is stored in a structure containing 3 fields:
@@ -37,6 +45,15 @@
 // For example, in a 100-pixel wide image (img->width == 100),
 //   pixel position (x,y) = (33,0) is stored in img->pixel[33];
 //   pixel position (x,y) = (22,1) is stored in img->pixel[122].
+//
+// Images created with LAYOUT_TILED store the pixels of each TILExTILE
+// square (a tile) together instead, as a small raster scan, and the tiles
+// in raster order.  Tiles on the right and bottom edges are padded to the
+// full size, so the pixel array may be larger than width*height.
+// Only G() and the few helpers below it need to know how pixels are laid
+// out; operations that run along rows use contiguous runs of pixels
+// (see Run), which are whole rows in raster images and rows of one tile in
+// tiled images.
 // 
 // Clients should use images only through variables of type Image,
 // which are pointers to the image structure, and should not access the
@@ -50,9 +67,47 @@ struct image {
   int width;
   int height;
   int maxval;   // maximum gray value (pixels with maxval are pure WHITE)
-  uint8* pixel; // pixel data (a raster scan)
+  uint8* pixel; // pixel data (a raster scan, or tiles of raster scans)
+  Layout layout;
+  int tilesX;   // tiles per row of tiles (for LAYOUT_TILED)
+  void* map;      // the memory mapping holding pixel (NULL if malloc'ed)
+  size_t mapped;  // and its size
+  atomic_int* shares; // number of images sharing pixel (NULL if only this one)
+  int orient;     // how the pixel array is shown (see Orientations)
+  Integral integral;  // cached integral image (NULL if none, or img changed)
+  int dirtyX0;    // rectangle changed since ImageClearDirty: [x0, x1)x[y0, y1)
+  int dirtyY0;    // (empty if x0 >= x1)
+  int dirtyX1;
+  int dirtyY1;
+};
+
+struct integral {
+  int width;      // of the image
+  int height;
+  uint64_t* sum;  // (width+1) x (height+1) sums of the pixels above and left
+  uint64_t* sum2; // the same, of the squares of the pixels (or NULL)
 };
 
+// Tiles are TILE x TILE pixels
+#define TILE_BITS 6
+#define TILE (1 << TILE_BITS)
+
+// Orientations
+//
+// An image may show its pixel array through any of the 8 rotations and
+// mirrors of a rectangle, so that ImageRotate and ImageMirror just share
+// the array (see ImageClone) with another orientation.  Pixel (x, y) of an
+// image with orientation o is pixel (x', y') of the array (a width x
+// height array, or height x width, if transposed), where:
+//   x' = W-1-x, if o & FLIP_X;  y' = H-1-y, if o & FLIP_Y;
+//   then (x', y') are swapped, if o & TRANSPOSE.
+// G() and Run() honor it, and so does every function that accesses pixels
+// through them; the kernels that read whole rows of the array directly
+// first materialize the image (see flatten), as do those of tiled images.
+#define FLIP_X 1
+#define FLIP_Y 2
+#define TRANSPOSE 4
+
 
 // This module follows "design-by-contract" principles.
 // Read `Design-by-Contract.md` for more details.
@@ -74,10 +129,12 @@ struct image {
 // Additional information:  man 3 errno;  man 3 error;
 
 // Variable to preserve errno temporarily
-static int errsave = 0;
+// (Like errno, these are per thread, so that images may be loaded and saved
+// in other threads, while this one processes another image.)
+static _Thread_local int errsave = 0;
 
 // Error cause
-static char* errCause;
+static _Thread_local char* errCause = "";
 
 /// Error cause.
 /// After some other module function fails (and returns an error code),
@@ -129,8 +186,6 @@ char* ImageErrMsg() { ///
 //
 // (You are not required to use this in your code!)
  
-int compLocateSubImage;  // variable to keep track of the comparisons made when LocateSubImage is called.
-
 // Check a condition and set errCause to failmsg in case of failure.
 // This may be used to chain a sequence of operations and verify its success.
 // Propagates the condition.
@@ -142,27 +197,151 @@ static int check(int condition, const char* failmsg) {
 
 
 /// Init Image library.  (Call once!)
-/// Currently, simply calibrate instrumentation and set names of counters.
+/// Currently, simply set names of counters.
+/// (Instrumentation is calibrated lazily, when a calibrated time is first
+/// printed, and the result is cached across runs: see InstrGetCTU.)
 void ImageInit(void) { ///
-  InstrCalibrate();
   InstrName[0] = "pixmem";  // InstrCount[0] will count pixel array acesses
+  InstrName[1] = "pixcmp";  // InstrCount[1] will count pixel comparisons (ImageMatchSubImage)
   // Name other counters here...
   
+  // The best kernels for this CPU, unless forced (see kernels.h).
+  const char* name = getenv("IMAGE8BIT_KERNELS");
+  if (!KernelsSelect(name)) {
+    fprintf(stderr, "image8bit: IMAGE8BIT_KERNELS=%s is not supported, using %s\n",
+            name, kernels.name);
+  }
+}
+
+/// Name of the instruction set of the kernels in use.
+const char* ImageKernels(void) { ///
+  return kernels.name;
 }
 
-// Macros to simplify accessing instrumentation counters:
-#define PIXMEM InstrCount[0]
-#define INSTR1 InstrCount[1]
+// Macros to simplify updating instrumentation counters.
+// Each operation adds its total once, after (or before) its loops, rather
+// than once per pixel: updating a global counter inside a loop would block
+// its vectorization.  With INSTR=0, these compile to nothing.
+#define PIXMEM(n) InstrAdd(0, n)
+#define PIXCMP(n) InstrAdd(1, n)
 // Macro intended for rounding a double to the nearest integer (useful for some operations)
 #define ROUND 0.5
 // Add more macros here...
 
-// TIP: Search for PIXMEM or InstrCount to see where it is incremented!
+// TIP: Search for PIXMEM or InstrAdd to see where it is incremented!
+
+// Map (x, y) of a W x H image with orientation o to the pixel array.
+// (Also outside the image: see compose.)
+static inline void orientXY(int o, int W, int H, int* x, int* y) {
+  if (o & FLIP_X) *x = W - 1 - *x;
+  if (o & FLIP_Y) *y = H - 1 - *y;
+  if (o & TRANSPOSE) {
+    int t = *x;
+    *x = *y;
+    *y = t;
+  }
+}
+
+// Transform (x, y) coords into linear pixel index.
+// This internal function is used in ImageGetPixel / ImageSetPixel. 
+// The returned index must satisfy (0 <= index < pixels allocated)
+static inline int G(Image img, int x, int y) {
+  // Asserts to guarantee that the image pointer is not NULL and that the position is valid.
+  assert(img != NULL);
+  assert(0 <= x && x < img->width);
+  assert(0 <= y && y < img->height);
+
+  int width = img->width;   // of the pixel array
+  if (img->orient != 0) {
+    orientXY(img->orient, img->width, img->height, &x, &y);
+    if (img->orient & TRANSPOSE) width = img->height;
+  }
+
+  // In tiled images: the index of the tile, times the pixels per tile,
+  // plus the index of the pixel in the tile.
+  if (img->layout == LAYOUT_TILED) {
+    int tile = (y >> TILE_BITS)*img->tilesX + (x >> TILE_BITS);
+    return (tile << (2*TILE_BITS)) + ((y & (TILE - 1)) << TILE_BITS) + (x & (TILE - 1));
+  }
+
+  // Calculate the linear index based on (x, y) coordinates, counting from left to right, top to bottom. 
+  return y * width + x;
+}
+
+// Number of pixels from column x to the right that are contiguous in the
+// pixel array (in any row): up to the end of the row, or of the tile.
+// (Just one, in images shown mirrored left-right or transposed.)
+static inline int Run(Image img, int x) {
+  if (img->orient & (FLIP_X | TRANSPOSE)) return 1;
+  int n = img->width - x;
+  if (img->layout == LAYOUT_TILED && n > TILE - (x & (TILE - 1))) n = TILE - (x & (TILE - 1));
+  return n;
+}
+
+// Distance in the pixel array from (x, y) to (x+1, y), in raster images.
+static inline ptrdiff_t Step(Image img) {
+  ptrdiff_t step = img->orient & TRANSPOSE ? img->height : 1;
+  return img->orient & FLIP_X ? -step : step;
+}
+
+// Copy the w pixels of row y of img from column x to buf[0..w-1], run by run.
+// (Rows of oriented raster images are gathered at their step.)
+static void readSpan(Image img, int x, int y, int w, uint8* buf) {
+  if ((img->orient & (FLIP_X | TRANSPOSE)) && img->layout == LAYOUT_RASTER) {
+    const uint8* p = img->pixel + G(img, x, y);
+    ptrdiff_t step = Step(img);
+    for (int k = 0; k < w; k++) buf[k] = p[k*step];
+    return;
+  }
+  for (int k = 0, n; k < w; k += n) {
+    n = Run(img, x + k);
+    if (n > w - k) n = w - k;
+    memcpy(buf + k, img->pixel + G(img, x + k, y), n);
+  }
+}
+
+// Copy buf[0..w-1] to row y of img from column x, run by run.
+static void writeSpan(Image img, int x, int y, int w, const uint8* buf) {
+  if ((img->orient & (FLIP_X | TRANSPOSE)) && img->layout == LAYOUT_RASTER) {
+    uint8* p = img->pixel + G(img, x, y);
+    ptrdiff_t step = Step(img);
+    for (int k = 0; k < w; k++) p[k*step] = buf[k];
+    return;
+  }
+  for (int k = 0, n; k < w; k += n) {
+    n = Run(img, x + k);
+    if (n > w - k) n = w - k;
+    memcpy(img->pixel + G(img, x + k, y), buf + k, n);
+  }
+}
+
+// Copy row y of img to row[0..width-1].
+static void readRow(Image img, int y, uint8* row) {
+  readSpan(img, 0, y, img->width, row);
+}
+
+// Copy row[0..width-1] to row y of img.
+static void writeRow(Image img, int y, const uint8* row) {
+  writeSpan(img, 0, y, img->width, row);
+}
+
+// Copy the w x h rectangle at (sx, sy) of src to (dx, dy) of dst, by runs
+// contiguous in both images.  (Does not count pixel accesses.)
+static void copyRect(Image dst, int dx, int dy, Image src, int sx, int sy, int w, int h) {
+  for (int i = 0; i < h; i++) {
+    for (int k = 0, n; k < w; k += n) {
+      n = w - k;
+      if (n > Run(src, sx + k)) n = Run(src, sx + k);
+      if (n > Run(dst, dx + k)) n = Run(dst, dx + k);
+      memcpy(dst->pixel + G(dst, dx + k, dy + i), src->pixel + G(src, sx + k, sy + i), n);
+    }
+  }
+}
 
 
 /// Image management functions
 
-// Create a new image with the specified width, height, and maximum gray value.
+// Create a new (raster) image with the specified width, height, and maximum gray value.
 // Parameters:
 //   width: The width of the new image.
 //   height: The height of the new image.
@@ -171,6 +350,80 @@ void ImageInit(void) { ///
 //   On success, a pointer to the newly created image is returned.
 //   On failure (due to memory allocation errors), returns NULL.
 Image ImageCreate(int width, int height, uint8 maxval) { ///
+  return ImageCreateLayout(width, height, maxval, LAYOUT_RASTER);
+}
+
+// Number of pixels in the pixel array of an image with this layout
+// (including the padding of tiles).
+static size_t Allocated(int width, int height, Layout layout) {
+  if (layout == LAYOUT_TILED) {
+    size_t tiles = (size_t)((width + TILE - 1) >> TILE_BITS) * ((height + TILE - 1) >> TILE_BITS);
+    return tiles << (2*TILE_BITS);
+  }
+  return (size_t)width*height;
+}
+
+// Huge pages
+//
+// Pixel arrays of hugeThreshold bytes or more are mapped on 2 MB
+// boundaries, and the kernel is advised to back them with transparent huge
+// pages, so that a single TLB entry covers 2 MB of pixels, instead of 4 KB.
+// Column-wise access (ImageRotate, the vertical pass of ImageBlur) touches a
+// new 4 KB page at every row of wide images, and misses the TLB almost every
+// time.  With hugeTLB, reserved huge pages (MAP_HUGETLB) are tried first.
+
+#define HUGE_PAGE ((size_t)2 << 20)
+
+static size_t hugeThreshold = 16 << 20;
+static int hugeTLB = 0;
+
+/// Back pixel arrays of threshold bytes or more with huge pages.
+void ImageHugePages(size_t threshold, int hugetlb) { ///
+  hugeThreshold = threshold;
+  hugeTLB = hugetlb;
+}
+
+// Map size bytes of zeroed memory, aligned on a huge page, into *map.
+// Returns its size (rounded up to a whole number of huge pages), or 0.
+static size_t mapHuge(size_t size, void** map) {
+  size_t len = (size + HUGE_PAGE - 1) & ~(HUGE_PAGE - 1);
+  int prot = PROT_READ | PROT_WRITE;
+  int flags = MAP_PRIVATE | MAP_ANONYMOUS;
+  uint8* p = MAP_FAILED;
+#ifdef MAP_HUGETLB
+  if (hugeTLB) p = mmap(NULL, len, prot, flags | MAP_HUGETLB, -1, 0);
+  if (p != MAP_FAILED) {
+    *map = p;
+    return len;
+  }
+#endif
+  // Map a huge page more than needed, and trim it to an aligned range.
+  p = mmap(NULL, len + HUGE_PAGE, prot, flags, -1, 0);
+  if (p == MAP_FAILED) return 0;
+  uint8* start = (uint8*)(((uintptr_t)p + HUGE_PAGE - 1) & ~(uintptr_t)(HUGE_PAGE - 1));
+  if (start > p) munmap(p, start - p);
+  munmap(start + len, p + HUGE_PAGE - start);
+#ifdef MADV_HUGEPAGE
+  madvise(start, len, MADV_HUGEPAGE);   // only advice: the kernel may not follow it
+#endif
+  *map = start;
+  return len;
+}
+
+// Allocate a pixel array of size bytes for img (cleared, if zero).
+// Returns NULL on failure.
+static uint8* allocPixels(Image img, size_t size, int zero) {
+  img->map = NULL;
+  img->mapped = 0;
+  if (hugeThreshold > 0 && size >= hugeThreshold) {
+    img->mapped = mapHuge(size, &img->map);
+    if (img->mapped > 0) return img->map;
+  }
+  return zero ? calloc(size, 1) : malloc(size);
+}
+
+/// Create a new black image with the given memory layout.
+Image ImageCreateLayout(int width, int height, uint8 maxval, Layout layout) { ///
   // Preconditions: Ensure that width and height are non-negative, and maxval is within the allowed range.
   assert(width >= 0);
   assert(height >= 0);
@@ -187,9 +440,16 @@ Image ImageCreate(int width, int height, uint8 maxval) { ///
   imag->width = width;
   imag->height = height;
   imag->maxval = maxval;
+  imag->layout = layout;
+  imag->tilesX = (width + TILE - 1) >> TILE_BITS;
+  imag->integral = NULL;
+  imag->shares = NULL;
+  imag->orient = 0;
+  ImageClearDirty(imag);
 
   // Allocate memory for the pixel data.
-  imag->pixel = (uint8*)malloc(width * height * sizeof(uint8));
+  // (Tiles are cleared, so that their padding is never uninitialized.)
+  imag->pixel = allocPixels(imag, Allocated(width, height, layout), layout == LAYOUT_TILED);
   if (imag->pixel == NULL) {
     // If memory allocation failed for pixel data,
     // free the previously allocated image structure memory.
@@ -202,6 +462,136 @@ Image ImageCreate(int width, int height, uint8 maxval) { ///
 }
 
 
+// Sum of the pixels in [x0, x1)x[y0, y1), from table s with W columns.
+static inline uint64_t rectSum(const uint64_t* s, size_t W, int x0, int y0, int x1, int y1) {
+  return s[y1*W + x1] - s[y1*W + x0] - s[y0*W + x1] + s[y0*W + x0];
+}
+
+// Release integral image *tp, if any.
+static void freeIntegral(Integral* tp) {
+  if (*tp == NULL) return;
+  free((*tp)->sum);
+  free((*tp)->sum2);
+  free(*tp);
+  *tp = NULL;
+}
+
+// Note that the pixels of img in the w x h rectangle at (x, y) change:
+// add it to the dirty rectangle; the cached integral image is no longer valid.
+static inline void changed(Image img, int x, int y, int w, int h) {
+  if (img->integral != NULL) freeIntegral(&img->integral);
+  if (w <= 0 || h <= 0) return;
+  if (img->dirtyX0 >= img->dirtyX1) {
+    img->dirtyX0 = x;
+    img->dirtyY0 = y;
+    img->dirtyX1 = x + w;
+    img->dirtyY1 = y + h;
+    return;
+  }
+  if (x < img->dirtyX0) img->dirtyX0 = x;
+  if (y < img->dirtyY0) img->dirtyY0 = y;
+  if (x + w > img->dirtyX1) img->dirtyX1 = x + w;
+  if (y + h > img->dirtyY1) img->dirtyY1 = y + h;
+}
+
+// Shared images keep their pixels (a raster scan) in a shared memory
+// object, after a header.  The header is padded to SHARED_HEADER bytes, so
+// that the pixels are aligned as well as malloc'ed ones.
+typedef struct {
+  char magic[8];    // SHARED_MAGIC
+  int32_t width;
+  int32_t height;
+  int32_t maxval;
+} SharedHeader;
+
+#define SHARED_HEADER 64
+
+static const char SHARED_MAGIC[8] = "IMAGE8B";
+
+// Release the pixel array of img: free it, or unmap it, if mapped, unless
+// other images share it.
+// Preserves errno.
+static void freePixels(Image img) {
+  if (img->shares != NULL) {
+    // The last image sharing the array releases it.
+    if (atomic_fetch_sub_explicit(img->shares, 1, memory_order_acq_rel) > 1) img->pixel = NULL;
+    else free(img->shares);
+  }
+  if (img->pixel != NULL && img->map != NULL) {
+    errsave = errno;
+    munmap(img->map, img->mapped);
+    errno = errsave;
+  } else {
+    free(img->pixel);
+  }
+  img->pixel = NULL;  // Set the pixel pointer to NULL to avoid dangling pointers.
+  img->map = NULL;
+  img->mapped = 0;
+  img->shares = NULL;
+}
+
+// Copy on write
+//
+// ImageClone shares the pixel array of an image, counting the images that
+// share it in shares.  Functions that change pixels in place first give
+// the image a private copy (unless it is the last one left), and functions
+// that replace the pixel array just release the shared one.
+
+/// Create a copy of img that shares its pixels, until either changes them.
+Image ImageClone(Image img) { ///
+  assert(img != NULL);
+  Image clone = malloc(sizeof(struct image));
+  if (!check(clone != NULL, "Out of memory")) return NULL;
+  if (img->shares == NULL) {
+    img->shares = malloc(sizeof(atomic_int));
+    if (!check(img->shares != NULL, "Out of memory")) {
+      free(clone);
+      return NULL;
+    }
+    atomic_init(img->shares, 1);
+  }
+  atomic_fetch_add_explicit(img->shares, 1, memory_order_relaxed);
+  *clone = *img;
+  clone->integral = NULL;
+  ImageClearDirty(clone);
+  return clone;
+}
+
+/// Give img a pixel array of its own, if it shares one.
+int ImageUnshare(Image img) { ///
+  assert(img != NULL);
+  if (img->shares == NULL) return 1;
+  if (atomic_load_explicit(img->shares, memory_order_acquire) == 1) {
+    // The others are gone: the array is already private.
+    free(img->shares);
+    img->shares = NULL;
+    return 1;
+  }
+  struct image old = *img;
+  size_t size = Allocated(img->width, img->height, img->layout);
+  uint8* pixel = allocPixels(img, size, 0);
+  if (!check(pixel != NULL, "Out of memory")) {
+    img->map = old.map;
+    img->mapped = old.mapped;
+    return 0;
+  }
+  memcpy(pixel, old.pixel, size);
+  PIXMEM(2L*img->width*img->height); // One read and one write per pixel.
+  img->pixel = pixel;
+  img->shares = NULL;
+  freePixels(&old);
+  return 1;
+}
+
+// Give img a pixel array of its own, before a function that never fails
+// changes it.
+static void own(Image img) {
+  if (img->shares != NULL && !ImageUnshare(img)) {
+    fprintf(stderr, "image8bit: %s copying shared pixels\n", errCause);
+    abort();
+  }
+}
+
 /// Destroy the image pointed to by (*imgp).
 ///   imgp : address of an Image variable.
 /// If (*imgp)==NULL, no operation is performed.
@@ -209,12 +599,188 @@ Image ImageCreate(int width, int height, uint8 maxval) { ///
 /// Should never fail, and should preserve global errno/errCause.
 void ImageDestroy(Image* imgp) { ///
   assert(imgp != NULL);   // Preconditions: ensure that the pointr is not NULL.
-  free((*imgp)->pixel);   // Free the memory occupied by the pixel data.
-  (*imgp)->pixel = NULL;  // Set the pixel pointer to NULL to avoid dangling pointers.
+  if (*imgp == NULL) return;  // Nothing to destroy.
+  freePixels(*imgp);      // Free the memory occupied by the pixel data.
+  freeIntegral(&(*imgp)->integral);
   free(*imgp);            // Free the memory occupied by the image structure.
   *imgp = NULL;           // Set the image pointer to NULL to avoid dangling pointers.
 }
 
+/// Get the memory layout of img.
+Layout ImageLayout(Image img) { ///
+  assert (img != NULL);
+  return img->layout;
+}
+
+// Replace the pixel array of img with that of *tmpp (an image of the same
+// size, in orientation 0), and destroy *tmpp with the old array.
+static void takePixels(Image img, Image* tmpp) {
+  Image tmp = *tmpp;
+  uint8* pixel = img->pixel;
+  img->pixel = tmp->pixel;
+  tmp->pixel = pixel;
+  void* map = img->map;
+  size_t mapped = img->mapped;
+  img->map = tmp->map;
+  img->mapped = tmp->mapped;
+  tmp->map = map;
+  tmp->mapped = mapped;
+  tmp->shares = img->shares;    // (the new array is not shared)
+  img->shares = NULL;
+  img->layout = tmp->layout;
+  img->tilesX = tmp->tilesX;
+  img->orient = 0;
+  ImageDestroy(tmpp);
+}
+
+/// Change the memory layout of img, converting its pixel array.
+int ImageSetLayout(Image img, Layout layout) { ///
+  assert (img != NULL);
+  if (img->layout == layout) return 1;
+  // Build the converted pixels in a temporary image, then take them over.
+  Image tmp = ImageCreateLayout(img->width, img->height, (uint8)img->maxval, layout);
+  if (!check(tmp != NULL, "Out of memory")) return 0;
+  copyRect(tmp, 0, 0, img, 0, 0, img->width, img->height);
+  PIXMEM(2*img->width*img->height); // One read and one write per pixel.
+  takePixels(img, &tmp);
+  return 1;
+}
+
+// A copy of img with a pixel array in its own orientation (see
+// Orientations), and the same layout.
+// Returns NULL if memory is exhausted.
+static Image flatCopy(Image img) {
+  Image tmp = ImageCreateLayout(img->width, img->height, (uint8)img->maxval, img->layout);
+  if (!check(tmp != NULL, "Out of memory")) return NULL;
+  // Strips of TILE columns, so that the rows of the array read for a
+  // transposed image stay in cache from one row of the strip to the next
+  // (and each row of a strip is contiguous in tmp, even if tiled).
+  for (int bx = 0; bx < img->width; bx += TILE) {
+    int bw = img->width - bx < TILE ? img->width - bx : TILE;
+    for (int y = 0; y < img->height; y++) {
+      readSpan(img, bx, y, bw, tmp->pixel + G(tmp, bx, y));
+    }
+  }
+  PIXMEM(2L*img->width*img->height); // One read and one write per pixel.
+  return tmp;
+}
+
+// Materialize img: give it a pixel array in its own orientation, if it
+// has another one.
+// Returns 1 on success, or 0 if memory is exhausted.
+static int flatten(Image img) {
+  if (img->orient == 0) return 1;
+  Image tmp = flatCopy(img);
+  if (tmp == NULL) return 0;
+  takePixels(img, &tmp);
+  return 1;
+}
+
+/// Create a new black image in shared memory object name.
+Image ImageCreateShared(const char* name, int width, int height, uint8 maxval) { ///
+  assert(name != NULL);
+  assert(width >= 0);
+  assert(height >= 0);
+  assert(0 < maxval && maxval <= PixMax);
+  size_t size = SHARED_HEADER + (size_t)width*height;
+  int fd = -1;
+  uint8* base = MAP_FAILED;
+  Image img = NULL;
+
+  // Replace any previous object (images attached to it keep it alive).
+  shm_unlink(name);
+  int success =
+  check( (img = malloc(sizeof(struct image))) != NULL, "Out of memory" ) &&
+  check( (fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600)) >= 0, "Creating shared memory failed" ) &&
+  // The new object is filled with zeros: a black image.
+  check( ftruncate(fd, size) == 0, "Sizing shared memory failed" ) &&
+  check( (base = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)) != MAP_FAILED,
+         "Mapping shared memory failed" );
+
+  if (success) {
+    SharedHeader* hdr = (SharedHeader*)base;
+    memcpy(hdr->magic, SHARED_MAGIC, sizeof(hdr->magic));
+    hdr->width = width;
+    hdr->height = height;
+    hdr->maxval = maxval;
+    img->width = width;
+    img->height = height;
+    img->maxval = maxval;
+    img->pixel = base + SHARED_HEADER;
+    img->layout = LAYOUT_RASTER;
+    img->tilesX = (width + TILE - 1) >> TILE_BITS;
+    img->integral = NULL;
+    img->shares = NULL;
+    img->orient = 0;
+    ImageClearDirty(img);
+    img->map = base;
+    img->mapped = size;
+  } else {
+    errsave = errno;
+    if (fd >= 0) shm_unlink(name);
+    free(img);
+    img = NULL;
+    errno = errsave;
+  }
+  // The mapping stays valid after the descriptor is closed.
+  if (fd >= 0) close(fd);
+  return img;
+}
+
+/// Attach to the image in shared memory object name.
+Image ImageAttachShared(const char* name) { ///
+  assert(name != NULL);
+  struct stat st;
+  int fd = -1;
+  uint8* base = MAP_FAILED;
+  Image img = NULL;
+  const SharedHeader* hdr;
+
+  int success =
+  check( (img = malloc(sizeof(struct image))) != NULL, "Out of memory" ) &&
+  check( (fd = shm_open(name, O_RDONLY, 0)) >= 0, "Opening shared memory failed" ) &&
+  check( fstat(fd, &st) == 0, "Opening shared memory failed" ) &&
+  check( st.st_size >= SHARED_HEADER, "Invalid shared image" ) &&
+  // A private mapping: pages are copied only if this image modifies them.
+  check( (base = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0)) != MAP_FAILED,
+         "Mapping shared memory failed" ) &&
+  (hdr = (const SharedHeader*)base,
+  check( memcmp(hdr->magic, SHARED_MAGIC, sizeof(hdr->magic)) == 0 &&
+         hdr->width >= 0 && hdr->height >= 0 &&
+         0 < hdr->maxval && hdr->maxval <= (int)PixMax &&
+         SHARED_HEADER + (size_t)hdr->width*hdr->height <= (size_t)st.st_size,
+         "Invalid shared image" ));
+
+  if (success) {
+    img->width = hdr->width;
+    img->height = hdr->height;
+    img->maxval = hdr->maxval;
+    img->pixel = base + SHARED_HEADER;
+    img->layout = LAYOUT_RASTER;
+    img->tilesX = (img->width + TILE - 1) >> TILE_BITS;
+    img->integral = NULL;
+    img->shares = NULL;
+    img->orient = 0;
+    ImageClearDirty(img);
+    img->map = base;
+    img->mapped = st.st_size;
+  } else {
+    errsave = errno;
+    if (base != MAP_FAILED) munmap(base, st.st_size);
+    free(img);
+    img = NULL;
+    errno = errsave;
+  }
+  if (fd >= 0) close(fd);
+  return img;
+}
+
+/// Remove shared memory object name.
+int ImageUnlinkShared(const char* name) { ///
+  assert(name != NULL);
+  return check( shm_unlink(name) == 0, "Removing shared memory failed" );
+}
+
 
 
 /// PGM file operations
@@ -234,6 +800,22 @@ static int skipComments(FILE* f) {
   return i;
 }
 
+// Parse a PGM header from f, into *w, *h and *maxval.
+// The single whitespace after maxval is consumed: the pixels follow.
+// On failure, returns 0 and errno/errCause are set accordingly.
+static int readHeader(FILE* f, int* w, int* h, int* maxval) {
+  char c;
+  return
+  check( fscanf(f, "P%c ", &c) == 1 && c == '5' , "Invalid file format" ) &&
+  skipComments(f) >= 0 &&
+  check( fscanf(f, "%d ", w) == 1 && *w >= 0 , "Invalid width" ) &&
+  skipComments(f) >= 0 &&
+  check( fscanf(f, "%d ", h) == 1 && *h >= 0 , "Invalid height" ) &&
+  skipComments(f) >= 0 &&
+  check( fscanf(f, "%d", maxval) == 1 && 0 < *maxval && *maxval <= (int)PixMax , "Invalid maxval" ) &&
+  check( fscanf(f, "%c", &c) == 1 && isspace(c) , "Whitespace expected" );
+}
+
 /// Load a raw PGM file.
 /// Only 8 bit PGM files are accepted.
 /// On success, a new image is returned.
@@ -242,26 +824,18 @@ static int skipComments(FILE* f) {
 Image ImageLoad(const char* filename) { ///
   int w, h;
   int maxval;
-  char c;
   FILE* f = NULL;
   Image img = NULL;
 
   int success = 
   check( (f = fopen(filename, "rb")) != NULL, "Open failed" ) &&
   // Parse PGM header
-  check( fscanf(f, "P%c ", &c) == 1 && c == '5' , "Invalid file format" ) &&
-  skipComments(f) >= 0 &&
-  check( fscanf(f, "%d ", &w) == 1 && w >= 0 , "Invalid width" ) &&
-  skipComments(f) >= 0 &&
-  check( fscanf(f, "%d ", &h) == 1 && h >= 0 , "Invalid height" ) &&
-  skipComments(f) >= 0 &&
-  check( fscanf(f, "%d", &maxval) == 1 && 0 < maxval && maxval <= (int)PixMax , "Invalid maxval" ) &&
-  check( fscanf(f, "%c", &c) == 1 && isspace(c) , "Whitespace expected" ) &&
+  readHeader(f, &w, &h, &maxval) &&
   // Allocate image
   (img = ImageCreate(w, h, (uint8)maxval)) != NULL &&
   // Read pixels
   check( fread(img->pixel, sizeof(uint8), w*h, f) == w*h , "Reading pixels" );
-  PIXMEM += (unsigned long)(w*h);  // count pixel memory accesses
+  if (img != NULL) PIXMEM(w*h);  // count pixel memory accesses (w, h are unset if the header failed)
 
   // Cleanup
   if (!success) {
@@ -273,22 +847,84 @@ Image ImageLoad(const char* filename) { ///
   return img;
 }
 
+/// Read the next raw PGM image (frame) from stream f into *imgp.
+int ImageReadStream(FILE* f, Image* imgp) { ///
+  assert (f != NULL);
+  assert (imgp != NULL);
+  // Frames may be separated by whitespace: skip it, to detect the end.
+  int c;
+  while ((c = getc(f)) != EOF && isspace(c)) { }
+  if (c == EOF) {
+    return check( !ferror(f), "Reading frame failed" ) ? 0 : -1;
+  }
+  ungetc(c, f);
+
+  int w, h;
+  int maxval;
+  if (!readHeader(f, &w, &h, &maxval)) return -1;
+  Image img = *imgp;
+  if (img != NULL && img->layout == LAYOUT_RASTER && img->width*img->height == w*h &&
+      img->shares == NULL) {
+    // Reuse the pixel array: only the shape may change.
+    img->width = w;
+    img->height = h;
+    img->maxval = (uint8)maxval;
+    img->tilesX = (w + TILE - 1) >> TILE_BITS;
+    img->orient = 0;
+    ImageClearDirty(img);
+    changed(img, 0, 0, w, h);
+  } else {
+    img = ImageCreate(w, h, (uint8)maxval);
+    if (!check( img != NULL, "Out of memory" )) return -1;
+    ImageDestroy(imgp);
+    *imgp = img;
+  }
+  int success = check( fread(img->pixel, sizeof(uint8), w*h, f) == w*h , "Reading pixels" );
+  PIXMEM(w*h);  // count pixel memory accesses
+  return success ? 1 : -1;
+}
+
+// Write the pixels of a tiled or oriented image to f, in raster order, row
+// by row.
+static int writeRows(Image img, FILE* f) {
+  uint8* row = malloc(img->width + 1);
+  if (!check(row != NULL, "Out of memory")) return 0;
+  int ok = 1;
+  for (int y = 0; y < img->height && ok; y++) {
+    readRow(img, y, row);
+    ok = check( fwrite(row, sizeof(uint8), img->width, f) == img->width, "Writing pixels failed" );
+  }
+  free(row);
+  return ok;
+}
+
+/// Write image img to stream f, as a raw PGM image (frame).
+int ImageWriteStream(FILE* f, Image img) { ///
+  assert (f != NULL);
+  assert (img != NULL);
+  int w = img->width;
+  int h = img->height;
+  uint8 maxval = img->maxval;
+
+  int success =
+  check( fprintf(f, "P5\n%d %d\n%u\n", w, h, maxval) > 0, "Writing header failed" ) &&
+  (img->layout == LAYOUT_TILED || img->orient != 0 ? writeRows(img, f) :
+  check( fwrite(img->pixel, sizeof(uint8), w*h, f) == w*h, "Writing pixels failed" ) ); 
+  PIXMEM(w*h);  // count pixel memory accesses
+  return success;
+}
+
 /// Save image to PGM file.
 /// On success, returns nonzero.
 /// On failure, returns 0, errno/errCause are set appropriately, and
 /// a partial and invalid file may be left in the system.
 int ImageSave(Image img, const char* filename) { ///
   assert (img != NULL);
-  int w = img->width;
-  int h = img->height;
-  uint8 maxval = img->maxval;
   FILE* f = NULL;
 
   int success =
   check( (f = fopen(filename, "wb")) != NULL, "Open failed" ) &&
-  check( fprintf(f, "P5\n%d %d\n%u\n", w, h, maxval) > 0, "Writing header failed" ) &&
-  check( fwrite(img->pixel, sizeof(uint8), w*h, f) == w*h, "Writing pixels failed" ); 
-  PIXMEM += (unsigned long)(w*h);  // count pixel memory accesses
+  ImageWriteStream(f, img);
 
   // Cleanup
   if (f != NULL) fclose(f);
@@ -331,25 +967,34 @@ int ImageMaxval(Image img) { ///
 /// *max is set to the maximum.
 void ImageStats(Image img, uint8* min, uint8* max) { ///
   assert(img != NULL); // Ensure that the image pointer is not NULL
-  *min = 0; // Initialize the minimum value to 0.
-  *max = 0; // Initialize the maximum value to 0.
-  
   int count = ImageGetSize(img); // Get the total number of pixels in the image.
+  // The levels do not depend on the orientation: scan the array as it is.
+  struct image array = *img;
+  if (img->orient & TRANSPOSE) {
+    array.width = img->height;
+    array.height = img->width;
+  }
+  array.orient = 0;
+  img = &array;
+  uint8 lo = count > 0 ? PixMax : 0; // Running minimum (0 for an empty image).
+  uint8 hi = 0;                      // Running maximum.
   
-  // Iterate through each pixel in the image.
-  for (size_t i = 0; i < count; i++) {
-    // Check if the current pixel value is greater than the curent minimum.
-    if ((img->pixel)[i] > *min) {
-      *min = img->pixel[i]; // Update the minimum value.
-    }
-    
-    // Check if the current pixel value is greater than the current maximum.
-    if ((img->pixel)[i] > *max) {
-      *max = img->pixel[i]; // Update the maximum value.
+  // Iterate through each pixel in the image: all at once in raster
+  // images, run by run in tiled images (to skip the padding of tiles).
+  if (img->layout == LAYOUT_TILED) {
+    for (int y = 0; y < img->height; y++) {
+      for (int x = 0, n; x < img->width; x += n) {
+        n = Run(img, x);
+        kernels.minMax(img->pixel + G(img, x, y), n, &lo, &hi);
+      }
     }
+  } else {
+    kernels.minMax(img->pixel, count, &lo, &hi);
   }
+  PIXMEM(count); // One read per pixel.
   
-  return; // Exit the function
+  *min = lo;
+  *max = hi;
 }
 
 
@@ -372,6 +1017,26 @@ int ImageValidRect(Image img, int x, int y, int w, int h) { ///
   
 }
 
+/// Dirty rectangle
+
+/// Get the dirty rectangle of img.
+int ImageDirtyRect(Image img, int* x, int* y, int* w, int* h) { ///
+  assert(img != NULL);
+  if (img->dirtyX0 >= img->dirtyX1) return 0;
+  *x = img->dirtyX0;
+  *y = img->dirtyY0;
+  *w = img->dirtyX1 - img->dirtyX0;
+  *h = img->dirtyY1 - img->dirtyY0;
+  return 1;
+}
+
+/// Mark all pixels of img as unchanged.
+void ImageClearDirty(Image img) { ///
+  assert(img != NULL);
+  img->dirtyX0 = img->dirtyY0 = 0;
+  img->dirtyX1 = img->dirtyY1 = 0;
+}
+
 /// Pixel get & set operations
 
 /// These are the primitive operations to access and modify a single pixel
@@ -379,24 +1044,11 @@ int ImageValidRect(Image img, int x, int y, int w, int h) { ///
 /// These are very simple, but fundamental operations, which may be used to 
 /// implement more complex operations.
 
-// Transform (x, y) coords into linear pixel index.
-// This internal function is used in ImageGetPixel / ImageSetPixel. 
-// The returned index must satisfy (0 <= index < img->width*img->height)
-static inline int G(Image img, int x, int y) {
-  // Asserts to guarantee that the image pointer is not NULL and that the position is valid.
-  assert(img != NULL);
-  assert(0 <= x && x < img->width);
-  assert(0 <= y && y < img->height);
-
-  // Calculate the linear index based on (x, y) coordinates, counting from left to right, top to bottom. 
-  return y * img->width + x;
-}
-
 /// Get the pixel (level) at position (x,y).
 uint8 ImageGetPixel(Image img, int x, int y) { ///
   assert (img != NULL);
   assert (ImageValidPos(img, x, y));
-  PIXMEM += 1;  // count one pixel access (read)
+  PIXMEM(1);  // count one pixel access (read)
   return img->pixel[G(img, x, y)];
 } 
 
@@ -404,10 +1056,30 @@ uint8 ImageGetPixel(Image img, int x, int y) { ///
 void ImageSetPixel(Image img, int x, int y, uint8 level) { ///
   assert (img != NULL);
   assert (ImageValidPos(img, x, y));
-  PIXMEM += 1;  // count one pixel access (store)
+  own(img);
+  changed(img, x, y, 1, 1);
+  PIXMEM(1);  // count one pixel access (store)
   img->pixel[G(img, x, y)] = level;
 } 
 
+/// Copy the levels of row y into row[0..width-1].
+void ImageGetRow(Image img, int y, uint8 row[]) { ///
+  assert (img != NULL);
+  assert (0 <= y && y < img->height);
+  readRow(img, y, row);
+  PIXMEM(img->width);  // one read per pixel
+}
+
+/// Set the levels of row y to row[0..width-1].
+void ImageSetRow(Image img, int y, const uint8 row[]) { ///
+  assert (img != NULL);
+  assert (0 <= y && y < img->height);
+  own(img);
+  changed(img, 0, y, img->width, 1);
+  writeRow(img, y, row);
+  PIXMEM(img->width);  // one write per pixel
+}
+
 /// Pixel transformations
 
 /// These functions modify the pixel levels in an image, but do not change
@@ -415,6 +1087,9 @@ void ImageSetPixel(Image img, int x, int y, uint8 level) { ///
 /// All of these functions modify the image in-place: no allocation involved.
 /// They never fail.
 
+// They transform the whole pixel array, whatever its layout: transforming
+// the padding of tiles too is harmless.
+
 
 /// Transform image to negative image.
 /// This transforms dark pixels to light pixels and vice-versa,
@@ -422,15 +1097,15 @@ void ImageSetPixel(Image img, int x, int y, uint8 level) { ///
 void ImageNegative(Image img) {
   // Assert that the image is not NULL.
   assert(img != NULL);
+  own(img);
+  changed(img, 0, 0, img->width, img->height);
 
-  // Get the total number of pixels in the image.
-  int count = ImageGetSize(img);
+  size_t size = Allocated(img->width, img->height, img->layout);
 
   // Iterate through each pixel in the image.
-  for (size_t i = 0; i < count; i++) {
-    // Transform the pixel level to its negative value by subtracting it from the maximum pixel value.
-    img->pixel[i] = img->maxval - img->pixel[i];
-  }
+  // Transform each pixel level to its negative value by subtracting it from the maximum pixel value.
+  kernels.negate(img->pixel, size, img->maxval);
+  PIXMEM(2L*img->width*img->height); // One read and one write per pixel.
 }
 
 
@@ -440,21 +1115,15 @@ void ImageNegative(Image img) {
 void ImageThreshold(Image img, uint8 thr) {
   // Ensure that the image is not NULL
   assert(img != NULL);
+  own(img);
+  changed(img, 0, 0, img->width, img->height);
 
-  // Get the total number of pixels in the image.
-  int count = ImageGetSize(img);
+  size_t size = Allocated(img->width, img->height, img->layout);
 
   // Iterate through each pixel in the image
-  for (size_t i = 0; i < count; i++) {
-    // Check if the current pixel value is greater than or equal to the threshold.
-    if (img->pixel[i] >= thr) {
-      // If the pixel is above (or in) the threshold, set the pixel value to the maximum pixel value.
-      img->pixel[i] = img->maxval;
-    } else {
-      // if the pixel is below the threshold, set the pixel value to 0.
-      img->pixel[i] = 0;
-    }
-  }
+  // Pixels above (or in) the threshold become maxval, and those below it 0.
+  kernels.threshold(img->pixel, size, thr, img->maxval);
+  PIXMEM(2L*img->width*img->height); // One read and one write per pixel.
 }
 
 
@@ -469,20 +1138,36 @@ void ImageBrighten(Image img, double factor) {
   assert(img != NULL);
   assert(factor >= 0.0);
 
-  // Get the total number of pixels in the image.
-  int count = ImageGetSize(img);
-
-  // Iterate through each pixel in the image.
-  for (size_t i = 0; i < count; i++) {
-    // Multiply the pixel value by the specified brightness factor and round to the nearest integer.
+  // One product per level, not per pixel: the brightened levels, in a table.
+  uint8 lut[PixMax + 1];
+  for (int v = 0; v <= PixMax; v++) {
+    // Multiply the level by the brightness factor and round to the nearest integer,
     // adding ROUND (0.5) for fidelity to the original image.
-    img->pixel[i] = (uint8)(img->pixel[i] * factor + ROUND);
+    double level = v * factor + ROUND;
+    // Cap the level at the maximum value if it exceeds the maximum.
+    lut[v] = level < img->maxval ? (uint8)level : img->maxval;
+  }
+  ImageMapLevels(img, lut);
+}
 
-    // Cap the pixel value at the maximum value if it exceeds the maximum.
-    if (img->pixel[i] > img->maxval) {
-      img->pixel[i] = img->maxval;
-    }
+
+/// Map each pixel level through a lookup table.
+/// Every pixel with level v is replaced by lut[v].
+/// Requires: lut has PixMax+1 entries.
+void ImageMapLevels(Image img, const uint8 lut[]) { ///
+  assert(img != NULL);
+  assert(lut != NULL);
+  own(img);
+  changed(img, 0, 0, img->width, img->height);
+
+  size_t size = Allocated(img->width, img->height, img->layout);
+
+  // One table lookup per pixel, whatever the number of transformations
+  // that were folded into the table.
+  for (size_t i = 0; i < size; i++) {
+    img->pixel[i] = lut[img->pixel[i]];
   }
+  PIXMEM(2L*img->width*img->height); // One read and one write per pixel.
 }
 
 
@@ -499,6 +1184,43 @@ void ImageBrighten(Image img, double factor) {
 // Implementation hint: 
 // Call ImageCreate whenever you need a new image!
 
+// Orientation of a W x H image with orientation o, shown (as a Wn x Hn
+// image) through orientation t.
+// Orientations are affine maps, and so are their compositions: the one
+// that maps 3 points as the composition does is the composition.
+static int compose(int o, int W, int H, int t, int Wn, int Hn) {
+  static const int px[3] = { 0, 1, 0 };
+  static const int py[3] = { 0, 0, 1 };
+  int c;
+  for (c = 0; c < 8; c++) {
+    int k;
+    for (k = 0; k < 3; k++) {
+      int x = px[k], y = py[k];
+      orientXY(t, Wn, Hn, &x, &y);
+      orientXY(o, W, H, &x, &y);
+      int xc = px[k], yc = py[k];
+      orientXY(c, Wn, Hn, &xc, &yc);
+      if (x != xc || y != yc) break;
+    }
+    if (k == 3) break;
+  }
+  assert(c < 8);
+  return c;
+}
+
+// A clone of img (see ImageClone), shown through orientation t.
+static Image oriented(Image img, int t) {
+  Image newImg = ImageClone(img);
+  if (newImg == NULL) return NULL;
+  if (t & TRANSPOSE) {
+    newImg->width = img->height;
+    newImg->height = img->width;
+  }
+  newImg->orient = compose(img->orient, img->width, img->height,
+                           t, newImg->width, newImg->height);
+  return newImg;
+}
+
 /// Rotate an image.
 /// Returns a rotated version of the image.
 /// The rotation is 90 degrees anti-clockwise.
@@ -510,22 +1232,11 @@ void ImageBrighten(Image img, double factor) {
 Image ImageRotate(Image img) { ///
   // Assert that the image is not NULL.
   assert (img != NULL);
-  // Create an image with the height and width of the original image swapped.
-  Image newImg = ImageCreate(img->height, img->width, img->maxval);
-  // Check if the image was created successfully.
-  if (newImg == NULL){
-    return NULL;
-  }
-  // Iterate through each pixel in the original image
- for (int y = 0; y < ImageHeight(img); y++){
-  for (int x = 0; x < ImageWidth(img); x++){
-    // In order to rotate the image 90 degrees anti-clockwise, we must set the corresponding pixel (x,y) in img to
-    // the corresponding pixel in the new image is the pixel (xRot,yRot) where xRot = y  and 
-    // yRot = ImageWidth(img) - x - 1 because the height and width are swapped
-    // (-1 in the yRot because indexing starts at 0).
-    ImageSetPixel(newImg, y, ImageWidth(img)-x-1, ImageGetPixel(img,x,y));
- }}
-  return newImg;
+  // Pixel (x,y) of img goes to pixel (xRot,yRot) of the new image, where
+  // xRot = y and yRot = width - x - 1: the new image shows pixel
+  // (xRot, yRot) of its own as (width - 1 - yRot, xRot) of img, that is,
+  // flipped top-bottom and transposed.  The pixels are not copied.
+  return oriented(img, FLIP_Y | TRANSPOSE);
 }
 
 /// Mirror an image = flip left-right.
@@ -538,26 +1249,9 @@ Image ImageRotate(Image img) { ///
 Image ImageMirror(Image img) {
   // Ensure that the input image is not NULL.
   assert(img != NULL);
-
-  // Create a new image with the same width and height.
-  Image newImg = ImageCreate(img->height, img->width, img->maxval);
-
-  // Check if the image was created successfully.
-  if (newImg == NULL) {
-    return NULL;
-  }
-
-  // Iterate through each pixel in the original image
-  for (int y = 0; y < ImageHeight(img); y++) {
-    for (int x = 0; x < ImageWidth(img); x++) {
-      // Using auxiliary functions, set the pixel value in the new image by swapping x and y coordinates 
-      // (creating a mirroing effect).
-      ImageSetPixel(newImg, ImageWidth(img) - x - 1, y, ImageGetPixel(img, x, y));
-    }
-  }
-
-  // Return the mirrored image.
-  return newImg;
+  // Pixel (x, y) of the new image is pixel (width - x - 1, y) of img.
+  // The pixels are not copied.
+  return oriented(img, FLIP_X);
 }
 
 
@@ -580,24 +1274,248 @@ Image ImageCrop(Image img, int x, int y, int w, int h) {
   // Ensure that the to-crop rectangle is valid.
   assert(ImageValidRect(img, x, y, w, h));
 
+  // The whole image: share its pixels, until either changes them.
+  if (w == img->width && h == img->height) return ImageClone(img);
+
   // Create a new image with the specified width, height, and maximum pixel value of the original image.
-  Image newImg = ImageCreate(h, w, img->maxval);
+  // (In the same layout.)
+  Image newImg = ImageCreateLayout(w, h, img->maxval, img->layout);
 
   // Check if the image was created successfully.
   if (newImg == NULL) {
     return NULL;
   }
 
-  // Iterate through each pixel in the cropping rectangle.
-  for (int i = 0; i < h; i++) {
-    for (int j = 0; j < w; j++) {
-      // Using auxiliary functions, set the pixel value in the new image by copying 
-      // from the corresponding position in the original image.
-      ImageSetPixel(newImg, j, i, ImageGetPixel(img, j + x, i + y));
+  // Copy each row of the cropping rectangle from the corresponding position in the original image.
+  copyRect(newImg, 0, 0, img, x, y, w, h);
+  PIXMEM(2*w*h); // One read and one write per pixel.
+
+  // Return the cropped image.
+  return newImg;
+}
+
+
+// Resampling kernels of ImageResize.
+// Every kernel is separable: source rows are first resampled horizontally,
+// through tables of source positions and weights computed once per call,
+// then combined vertically.  Each inner loop runs over contiguous rows, and
+// the vertical ones have no data-dependent indexing, so they vectorize.
+
+// Shrink img to half its width and height, averaging each 2x2 block.
+static void resizeHalf(Image img, Image newImg) {
+  int W = img->width;
+  int w = newImg->width;
+  for (int y = 0; y < newImg->height; y++) {
+    const uint8* r0 = img->pixel + (size_t)2*y*W;
+    const uint8* r1 = r0 + W;
+    uint8* dst = newImg->pixel + (size_t)y*w;
+    for (int x = 0; x < w; x++) {
+      dst[x] = (uint8)((r0[2*x] + r0[2*x+1] + r1[2*x] + r1[2*x+1] + 2) >> 2);
     }
   }
+  PIXMEM(5*w*newImg->height);  // Four reads and one write per pixel.
+}
 
-  // Return the cropped image.
+// Nearest neighbour: destination x samples source column xs[x].
+static int resizeNearest(Image img, Image newImg) {
+  int W = img->width, H = img->height;
+  int w = newImg->width, h = newImg->height;
+  int* xs = malloc(w*sizeof(int));
+  if (!check(xs != NULL, "Out of memory")) return 0;
+  for (int x = 0; x < w; x++) xs[x] = (int)((2L*x + 1)*W / (2L*w));
+  int prev = -1;
+  for (int y = 0; y < h; y++) {
+    int sy = (int)((2L*y + 1)*H / (2L*h));
+    uint8* dst = newImg->pixel + (size_t)y*w;
+    if (sy == prev) {
+      memcpy(dst, dst - w, w);  // Enlarging: same source row as before.
+    } else {
+      const uint8* src = img->pixel + (size_t)sy*W;
+      for (int x = 0; x < w; x++) dst[x] = src[xs[x]];
+    }
+    prev = sy;
+  }
+  PIXMEM(2*w*h);  // One read and one write per pixel.
+  free(xs);
+  return 1;
+}
+
+// Bilinear sampling positions for a destination of size D along an axis
+// of source size S: position d lies between source pixels i0[d] and i1[d],
+// at fraction f[d]/256 from i0[d].
+static void bilinearTable(int S, int D, int* i0, int* i1, int* f) {
+  for (int d = 0; d < D; d++) {
+    long s = (((2L*d + 1)*S - D)*256 + D) / (2L*D);  // center, in 1/256 pixels
+    if (s < 0) s = 0;
+    i0[d] = (int)(s >> 8);
+    f[d] = (int)(s & 255);
+    if (i0[d] >= S - 1) { i0[d] = S - 1; f[d] = 0; }
+    i1[d] = f[d] ? i0[d] + 1 : i0[d];
+  }
+}
+
+// Bilinear: source rows are interpolated horizontally into 8.8 fixed-point
+// rows, two of which are kept, since consecutive destination rows mostly
+// share their source rows.
+static int resizeBilinear(Image img, Image newImg) {
+  int W = img->width, H = img->height;
+  int w = newImg->width, h = newImg->height;
+  int* tab = malloc((3L*w + 3L*h)*sizeof(int));
+  uint16_t* rows = malloc(2L*w*sizeof(uint16_t));
+  if (!check(tab != NULL && rows != NULL, "Out of memory")) {
+    free(tab);
+    free(rows);
+    return 0;
+  }
+  int *x0 = tab, *x1 = x0 + w, *fx = x1 + w;
+  int *y0 = fx + w, *y1 = y0 + h, *fy = y1 + h;
+  bilinearTable(W, w, x0, x1, fx);
+  bilinearTable(H, h, y0, y1, fy);
+
+  uint16_t* row[2] = { rows, rows + w };
+  int tag[2] = { -1, -1 };   // source row held in each buffer
+  long reads = 0;
+  for (int y = 0; y < h; y++) {
+    int need[2] = { y0[y], y1[y] };
+    for (int k = 0; k < 2; k++) {
+      if (k == 0 && tag[1] == need[0]) {   // moving down: swap buffers
+        uint16_t* t = row[0]; row[0] = row[1]; row[1] = t;
+        int tt = tag[0]; tag[0] = tag[1]; tag[1] = tt;
+      }
+      if (tag[k] == need[k]) continue;
+      const uint8* src = img->pixel + (size_t)need[k]*W;
+      uint16_t* r = row[k];
+      for (int x = 0; x < w; x++) {
+        r[x] = (uint16_t)(src[x0[x]]*(256 - fx[x]) + src[x1[x]]*fx[x]);
+      }
+      tag[k] = need[k];
+      reads += 2*w;
+    }
+    const uint16_t* r0 = row[0];
+    const uint16_t* r1 = row[1];
+    uint32_t a = 256 - fy[y], b = fy[y];
+    uint8* dst = newImg->pixel + (size_t)y*w;
+    for (int x = 0; x < w; x++) {
+      dst[x] = (uint8)((r0[x]*a + r1[x]*b + 32768) >> 16);
+    }
+  }
+  PIXMEM(reads + (long)w*h);
+  free(tab);
+  free(rows);
+  return 1;
+}
+
+// Area weights for a destination of size D along an axis of source size S.
+// In units where source pixels are D long and destination pixels S long,
+// destination d covers source pixels first[d] .. first[d]+count[d]-1, the
+// k-th of them by weight[off[d]+k]; the weights of each d add up to S.
+// Returns the table (first, count, off, weight) in one block, or NULL.
+static int* areaTable(int S, int D) {
+  int* tab = malloc((3L*D + S + D)*sizeof(int));
+  if (tab == NULL) return NULL;
+  int *first = tab, *count = first + D, *off = count + D, *weight = off + D;
+  int n = 0;
+  for (int d = 0; d < D; d++) {
+    long lo = (long)d*S, hi = (long)(d + 1)*S;   // destination extent
+    first[d] = (int)(lo / D);
+    count[d] = (int)((hi - 1) / D) - first[d] + 1;
+    off[d] = n;
+    for (int i = first[d]; i < first[d] + count[d]; i++) {
+      long a = (long)i*D > lo ? (long)i*D : lo;
+      long b = (long)(i + 1)*D < hi ? (long)(i + 1)*D : hi;
+      weight[n++] = (int)(b - a);
+    }
+  }
+  return tab;
+}
+
+// Area average: source rows are summed horizontally with their weights,
+// and those sums accumulated with the vertical weights; each total is
+// divided once, by the sum of all weights (W*H).
+static int resizeArea(Image img, Image newImg) {
+  int W = img->width, H = img->height;
+  int w = newImg->width, h = newImg->height;
+  int* xt = areaTable(W, w);
+  int* yt = areaTable(H, h);
+  uint32_t* row = malloc(w*sizeof(uint32_t));
+  uint64_t* acc = malloc(w*sizeof(uint64_t));
+  if (!check(xt != NULL && yt != NULL && row != NULL && acc != NULL, "Out of memory")) {
+    free(xt); free(yt); free(row); free(acc);
+    return 0;
+  }
+  int *xfirst = xt, *xcount = xfirst + w, *xoff = xcount + w, *xweight = xoff + w;
+  int *yfirst = yt, *ycount = yfirst + h, *yoff = ycount + h, *yweight = yoff + h;
+
+  int tag = -1;   // source row held in row
+  long reads = 0;
+  for (int y = 0; y < h; y++) {
+    memset(acc, 0, w*sizeof(uint64_t));
+    for (int k = 0; k < ycount[y]; k++) {
+      int sy = yfirst[y] + k;
+      if (sy != tag) {
+        const uint8* src = img->pixel + (size_t)sy*W;
+        for (int x = 0; x < w; x++) {
+          const uint8* s = src + xfirst[x];
+          const int* wt = xweight + xoff[x];
+          uint32_t sum = 0;
+          for (int i = 0; i < xcount[x]; i++) sum += s[i]*(uint32_t)wt[i];
+          row[x] = sum;
+        }
+        tag = sy;
+        reads += W;
+      }
+      uint64_t wy = (uint64_t)yweight[yoff[y] + k];
+      for (int x = 0; x < w; x++) acc[x] += row[x]*wy;
+    }
+    uint8* dst = newImg->pixel + (size_t)y*w;
+    uint64_t den = (uint64_t)W*H;
+    for (int x = 0; x < w; x++) dst[x] = (uint8)((acc[x] + den/2) / den);
+  }
+  PIXMEM(reads + (long)w*h);
+  free(xt); free(yt); free(row); free(acc);
+  return 1;
+}
+
+/// Resize an image to width w and height h.
+/// Pixel centers are aligned, so the image is scaled by w/width and
+/// h/height about its center.
+/// Requires: w > 0 and h > 0.
+/// Ensures:
+///   The original img is not modified.
+///   The returned image has width w and height h, and the same maxval.
+/// 
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+Image ImageResize(Image img, int w, int h, ResizeMode mode) { ///
+  assert(img != NULL);
+  assert(img->layout == LAYOUT_RASTER);   // see ImageSetLayout
+  assert(w > 0 && h > 0);
+  assert(mode == RESIZE_NEAREST || mode == RESIZE_BILINEAR || mode == RESIZE_AREA);
+
+  // Same size: every mode is the identity.
+  if (w == img->width && h == img->height) return ImageCrop(img, 0, 0, w, h);
+  // The kernels read rows of the array: read a view from a flat copy
+  // (img itself, which may share its array, is not changed).
+  Image src = img->orient == 0 ? img : flatCopy(img);
+  if (src == NULL) return NULL;
+
+  Image newImg = ImageCreate(w, h, img->maxval);
+  if (newImg != NULL) {
+    int ok = 1;
+    if (mode != RESIZE_NEAREST && 2*w == img->width && 2*h == img->height) {
+      // Exact halving: bilinear and area sampling both reduce to a 2x2 mean.
+      resizeHalf(src, newImg);
+    } else if (mode == RESIZE_NEAREST) {
+      ok = resizeNearest(src, newImg);
+    } else if (mode == RESIZE_BILINEAR) {
+      ok = resizeBilinear(src, newImg);
+    } else {
+      ok = resizeArea(src, newImg);
+    }
+    if (!ok) ImageDestroy(&newImg);
+  }
+  if (src != img) ImageDestroy(&src);
   return newImg;
 }
 
@@ -619,14 +1537,13 @@ void ImagePaste(Image img1, int x, int y, Image img2) {
   // Assert that the pasting position and size are within the size limits of the first image.
   assert(ImageValidRect(img1, x, y, img2->width, img2->height));
 
-  // Iterate through each pixel in the second image.
-  for (int i = 0; i < img2->height; i++) {
-    for (int j = 0; j < img2->width; j++) {
-      // Set the pixel value in the first image by copying from the corresponding position in the second image
-      // (Similarly to how ImageCrop was developed).
-      ImageSetPixel(img1, j + x, i + y, ImageGetPixel(img2, j, i));
-    }
-  }
+  // Copy each row of the second image to the corresponding position in the first image
+  // (Similarly to how ImageCrop was developed).
+  own(img1);
+  changed(img1, x, y, img2->width, img2->height);
+  int w = img2->width;
+  copyRect(img1, x, y, img2, 0, 0, w, img2->height);
+  PIXMEM(2*w*img2->height); // One read and one write per pixel.
 }
 
 /// Blend an image into a larger image.
@@ -645,18 +1562,24 @@ void ImageBlend(Image img1, int x, int y, Image img2, double alpha) {
   // Assert that the blending position and size are within the size limits of the first image.
   assert(ImageValidRect(img1, x, y, img2->width, img2->height));
 
-  // Iterate through each pixel in the blended region.
+  own(img1);
+  changed(img1, x, y, img2->width, img2->height);
+  int w = img2->width;
+  // Iterate through each row in the blended region, by runs contiguous in
+  // both images (whole rows, unless an image is tiled).
   for (int i = 0; i < img2->height; i++) {
-    for (int j = 0; j < img2->width; j++) {
-      // Calculate the blended pixel value using the specified alpha value:
+    for (int k = 0, n; k < w; k += n) {
+      n = w - k;
+      if (n > Run(img1, x + k)) n = Run(img1, x + k);
+      if (n > Run(img2, k)) n = Run(img2, k);
+      const uint8* src = img2->pixel + G(img2, k, i);      // Row i of the second image.
+      uint8* dst = img1->pixel + G(img1, x + k, i + y);    // Where it goes in the first image.
+      // Calculate the blended pixel values using the specified alpha value:
       // blendedPixel = pixel2 * alpha + pixel1 * (1 - alpha) + ROUND (adding ROUND for pixel value fidelity).
-      uint8 valPixel = (uint8)(ImageGetPixel(img2, j, i) * alpha +
-                               ImageGetPixel(img1, j + x, i + y) * (1 - alpha) + ROUND); 
-
-      // Set the pixel value in the first image at the blended position.
-      ImageSetPixel(img1, j + x, i + y, valPixel);
+      kernels.blend(dst, src, n, alpha);
     }
   }
+  PIXMEM(3*w*img2->height); // Two reads and one write per pixel.
 }
 
 
@@ -666,22 +1589,35 @@ void ImageBlend(Image img1, int x, int y, Image img2, double alpha) {
 int ImageMatchSubImage(Image img1, int x, int y, Image img2) {
   assert(img1 != NULL);  // Assert img1 is not NULL.
   assert(img2 != NULL);  // Assert img2 is not NULL.
+  assert(img1->layout == LAYOUT_RASTER && img2->layout == LAYOUT_RASTER);  // See ImageSetLayout.
   assert(ImageValidPos(img1, x, y));  // Assert the specified position (x, y) is valid in img1.
   assert(ImageValidRect(img1, x, y, img2->width, img2->height));  // Assert the region specified by img2 fits within img1.
 
-  // Loop through each pixel in img2.
-  for (int i = 0; i < img2->height; i++) {
-    for (int j = 0; j < img2->width; j++) {
-      compLocateSubImage++; // Increment the variable after each pixel comparison.
-
-      // Compare corresponding pixels in img1 and img2
-      if (ImageGetPixel(img2, j, i) != ImageGetPixel(img1, j + x, i + y)) {
-        return 0;  // If any pixel doesn't match, return 0 (false).
-      }
+  int w = img2->width;
+  size_t comps = 0;  // Pixel comparisons made (added to the counters once, on return).
+  int match = 1;
+  // Rows of oriented images are read at their step (see Orientations).
+  ptrdiff_t step1 = Step(img1);
+  ptrdiff_t step2 = Step(img2);
+
+  // Loop through each row in img2.
+  for (int i = 0; i < img2->height && match; i++) {
+    const uint8* row2 = img2->pixel + G(img2, 0, i);
+    const uint8* row1 = img1->pixel + G(img1, x, i + y);
+    // Compare corresponding pixels in img1 and img2, up to the first mismatch.
+    int j = 0;
+    if (step1 == 1 && step2 == 1) {
+      j = (int)kernels.compare(row2, row1, w);
+    } else {
+      while (j < w && row2[j*step2] == row1[j*step1]) j++;
     }
+    comps += j < w ? j + 1 : w;
+    match = j == w;  // If any pixel doesn't match, the result is 0 (false).
   }
+  PIXCMP(comps);
+  PIXMEM(2*comps);  // Two reads per comparison.
 
-  return 1;  // If the function hasn't exited with a return value by now, it means all pixels matched, return 1 (true).
+  return match;  // 1 (true) if all pixels matched.
 }
 
 // Locate a subimage inside another image.
@@ -691,28 +1627,224 @@ int ImageMatchSubImage(Image img1, int x, int y, Image img2) {
 int ImageLocateSubImage(Image img1, int* px, int* py, Image img2) {
   assert(img1 != NULL);  // Assert img1 is not NULL.
   assert(img2 != NULL);  // Assert img2 is not NULL.
-  compLocateSubImage = 0; // Global variable set to 0 (before calling ImageMatchSubImage, where the comparisons will be made).
+
+  // With the integral image of img1 at hand, only the positions where the
+  // sum of the pixels is the sum of img2 can match: compare only those.
+  const Integral t = img1->integral;
+  size_t W = (size_t)img1->width + 1;
+  int w = img2->width;
+  int h = img2->height;
+  uint64_t sum2 = 0;
+  if (t != NULL) {
+    assert(img2->layout == LAYOUT_RASTER);  // See ImageSetLayout.
+    for (size_t k = 0; k < (size_t)w*h; k++) sum2 += img2->pixel[k];
+    PIXMEM((long)w*h);  // One read per pixel.
+  }
 
   // Iterate over possible positions for img2 within img1 (ie: unnecessary to keep checking for a 3x3 img inside a 5x5 if no match has been made
   // until (2,2) (including  pixel (2,2)), since no 3x3 img can fit inside the remaining pixels (2,3) onwards).
   for (int i = 0; i < ImageHeight(img1) - img2->height + 1; i++) {
     for (int j = 0; j < ImageWidth(img1) - img2->width + 1; j++) {
+      if (t != NULL && rectSum(t->sum, W, j, i, j + w, i + h) != sum2) continue;
       // Call ImageMatchSubImage to check if img2 matches the subimage of img1 at position (j, i).
       if (ImageMatchSubImage(img1, j, i, img2) == 1) {
         // if there's a match:
         *px = j;  // Set the matching position in the variable pointed to by px.
         *py = i;  // Set the matching position in the variable pointed to by py.
-        //printf("%-10d\n",compLocateSubImage);
 
         return 1;  // Return 1 (true) to indicate a match.
       }
     }
   }
-  //printf("%-10d\n",compLocateSubImage);
   // If no match is found, leave (*px, *py) untouched and return 0 (false).
   return 0;
 }
 
+/// Integral images
+
+// Compute the integral image of img (with squares, if squares).
+// Returns NULL on failure.
+static Integral buildIntegral(Image img, int squares) {
+  int width = img->width;
+  int height = img->height;
+  size_t W = (size_t)width + 1;
+  size_t n = W*(height + 1);
+  Integral t = malloc(sizeof(struct integral));
+  uint8* row = malloc(width + 1);
+  if (t != NULL) {
+    t->width = width;
+    t->height = height;
+    t->sum = malloc(n*sizeof(uint64_t));
+    t->sum2 = squares ? malloc(n*sizeof(uint64_t)) : NULL;
+  }
+  if (!check(t != NULL && row != NULL && t->sum != NULL && (!squares || t->sum2 != NULL),
+             "Out of memory")) {
+    if (t != NULL) freeIntegral(&t);
+    free(row);
+    return NULL;
+  }
+  // Row 0 and column 0 are 0: sums of no pixels.
+  memset(t->sum, 0, W*sizeof(uint64_t));
+  if (squares) memset(t->sum2, 0, W*sizeof(uint64_t));
+  for (int y = 0; y < height; y++) {
+    readRow(img, y, row);
+    const uint64_t* above = t->sum + y*W;
+    uint64_t* s = t->sum + (y + 1)*W;
+    uint64_t acc = 0;   // sum of this row, up to x
+    s[0] = 0;
+    for (int x = 0; x < width; x++) {
+      acc += row[x];
+      s[x + 1] = above[x + 1] + acc;
+    }
+    if (squares) {
+      above = t->sum2 + y*W;
+      s = t->sum2 + (y + 1)*W;
+      acc = 0;
+      s[0] = 0;
+      for (int x = 0; x < width; x++) {
+        acc += (uint32_t)row[x]*row[x];
+        s[x + 1] = above[x + 1] + acc;
+      }
+    }
+  }
+  PIXMEM((long)width*height);  // One read per pixel.
+  free(row);
+  return t;
+}
+
+/// Get the integral image of img, computing it if needed.
+Integral ImageIntegral(Image img, int squares) { ///
+  assert(img != NULL);
+  Integral t = img->integral;
+  if (t != NULL && (!squares || t->sum2 != NULL)) return t;
+  t = buildIntegral(img, squares);
+  if (t == NULL) return NULL;
+  freeIntegral(&img->integral);
+  img->integral = t;
+  return t;
+}
+
+/// Sum of the pixels in the rectangle at (x, y), with width w and height h.
+uint64_t IntegralSum(Integral t, int x, int y, int w, int h) { ///
+  assert(t != NULL);
+  assert(0 <= x && 0 <= w && x + w <= t->width);
+  assert(0 <= y && 0 <= h && y + h <= t->height);
+  return rectSum(t->sum, (size_t)t->width + 1, x, y, x + w, y + h);
+}
+
+/// Mean of the pixels in a rectangle.
+double IntegralMean(Integral t, int x, int y, int w, int h) { ///
+  assert(w > 0 && h > 0);
+  return (double)IntegralSum(t, x, y, w, h) / ((double)w*h);
+}
+
+/// Variance of the pixels in a rectangle.
+double IntegralVariance(Integral t, int x, int y, int w, int h) { ///
+  assert(t != NULL && t->sum2 != NULL);
+  double mean = IntegralMean(t, x, y, w, h);
+  double sum2 = (double)rectSum(t->sum2, (size_t)t->width + 1, x, y, x + w, y + h);
+  double var = sum2 / ((double)w*h) - mean*mean;
+  return var > 0.0 ? var : 0.0;   // (not below 0, by rounding)
+}
+
+
+/// Histograms
+
+// The counts of each TILE x TILE block (the tiles of the tiled layout,
+// in any layout), and their sums.  Blocks have at most 4096 pixels, so
+// their counts fit in 16 bits.
+struct histogram {
+  int width, height;    // of the image
+  int blocksX, blocksY;
+  uint32_t total[256];
+  uint16_t* block;      // 256 counts per block, row by row of blocks
+};
+
+// Count the pixels of block (bx, by) of img in k[0..255].
+static void countBlock(Image img, int bx, int by, uint16_t* k) {
+  int x0 = bx*TILE, y0 = by*TILE;
+  int w = img->width - x0 < TILE ? img->width - x0 : TILE;
+  int h = img->height - y0 < TILE ? img->height - y0 : TILE;
+  memset(k, 0, 256*sizeof(uint16_t));
+  for (int y = y0; y < y0 + h; y++) {
+    for (int k0 = 0, n; k0 < w; k0 += n) {
+      n = Run(img, x0 + k0);
+      if (n > w - k0) n = w - k0;
+      const uint8* p = img->pixel + G(img, x0 + k0, y);
+      for (int i = 0; i < n; i++) k[p[i]]++;
+    }
+  }
+  PIXMEM((long)w*h);  // One read per pixel.
+}
+
+/// Count the pixels of img at each gray level.
+Histogram ImageHistogram(Image img) { ///
+  assert(img != NULL);
+  Histogram h = malloc(sizeof(struct histogram));
+  if (!check(h != NULL, "Out of memory")) return NULL;
+  h->width = img->width;
+  h->height = img->height;
+  h->blocksX = (img->width + TILE - 1) >> TILE_BITS;
+  h->blocksY = (img->height + TILE - 1) >> TILE_BITS;
+  size_t n = (size_t)h->blocksX*h->blocksY;
+  h->block = malloc(256*n*sizeof(uint16_t) + 1);
+  if (!check(h->block != NULL, "Out of memory")) {
+    free(h);
+    return NULL;
+  }
+  memset(h->total, 0, sizeof(h->total));
+  for (size_t b = 0; b < n; b++) {
+    uint16_t* k = h->block + 256*b;
+    countBlock(img, b % h->blocksX, b / h->blocksX, k);
+    for (int v = 0; v < 256; v++) h->total[v] += k[v];
+  }
+  return h;
+}
+
+/// Update the histogram of img over its dirty rectangle.
+void ImageHistogramUpdate(Image img, Histogram h) { ///
+  assert(img != NULL && h != NULL);
+  assert(img->width == h->width && img->height == h->height);
+  int x, y, w, hd;
+  if (!ImageDirtyRect(img, &x, &y, &w, &hd)) return;
+  // Recount the blocks that overlap the rectangle.
+  for (int by = y >> TILE_BITS; by <= (y + hd - 1) >> TILE_BITS; by++) {
+    for (int bx = x >> TILE_BITS; bx <= (x + w - 1) >> TILE_BITS; bx++) {
+      uint16_t* k = h->block + 256*((size_t)by*h->blocksX + bx);
+      for (int v = 0; v < 256; v++) h->total[v] -= k[v];
+      countBlock(img, bx, by, k);
+      for (int v = 0; v < 256; v++) h->total[v] += k[v];
+    }
+  }
+}
+
+/// The counts of h.
+const uint32_t* HistogramCounts(Histogram h) { ///
+  assert(h != NULL);
+  return h->total;
+}
+
+/// The minimum and maximum gray levels counted in h.
+void HistogramStats(Histogram h, uint8* min, uint8* max) { ///
+  assert(h != NULL);
+  int lo = 0, hi = 255;
+  while (lo < 256 && h->total[lo] == 0) lo++;
+  while (hi >= 0 && h->total[hi] == 0) hi--;
+  // No pixels: as ImageStats.
+  *min = lo < 256 ? (uint8)lo : 0;
+  *max = hi >= 0 ? (uint8)hi : 0;
+}
+
+/// Destroy the histogram pointed to by (*hp).
+void HistogramDestroy(Histogram* hp) { ///
+  assert(hp != NULL);
+  if (*hp == NULL) return;
+  free((*hp)->block);
+  free(*hp);
+  *hp = NULL;
+}
+
+
 /// Filtering
 
 /// Blur an image by a applying a (2dx+1)x(2dy+1) mean filter.
@@ -721,49 +1853,814 @@ int ImageLocateSubImage(Image img1, int* px, int* py, Image img2) {
 /// The image is changed in-place.
 /// This implementation is a two-pass algorithm that uses computes cumulative sums to apply the blur. 
 /// We consider this to be the most efficient implementation we could come up with. 
+// The cumulative sums are the integral image of the source, which
+// ImageBlurred keeps (and ImageBlur drops, as the image changes).
+// The 3x3 and 5x5 filters, the most used, take another path (blurSmall).
+
+// Write the blur of the image with integral image t into dst.
+static void blurInto(Integral t, Image dst, int dx, int dy, uint8* row) {
+  int width = t->width;
+  int height = t->height;
+  size_t W = (size_t)width + 1;
+  for (int i = 0; i < height; i++) {
+    // The rectangle, clipped to the image: [x0, x1)x[y0, y1)
+    int y0 = i - dy > 0 ? i - dy : 0;
+    int y1 = i + dy < height ? i + dy + 1 : height;
+    for (int j = 0; j < width; j++) {
+      int x0 = j - dx > 0 ? j - dx : 0;
+      int x1 = j + dx < width ? j + dx + 1 : width;
+      uint64_t sum = rectSum(t->sum, W, x0, y0, x1, y1);
+      int area = (x1 - x0) * (y1 - y0); // Compute the area of pixels in the region
+      row[j] = (uint8)((double)sum / area + ROUND); // Compute the weighted average and round it
+    }
+    writeRow(dst, i, row);
+  }
+  PIXMEM((long)width*height); // One write per pixel.
+}
+
+// Small mean filters: 3x3 and 5x5 (radius r = dx = dy = 1 or 2).
+// These need no summed-area table: the 2r+1 source rows around each output
+// row are kept in a rolling buffer, with their column sums, which take one
+// row in and one out per output row; each output pixel then adds 2r+1
+// column sums.  Sums fit 16 bits.
+// The mean is rounded as in blurInto: for integer sums, (double)sum/area +
+// ROUND truncates to floor((2 sum + area) / (2 area)) exactly (a quotient
+// of integers is never within rounding error of a half, unless it is one).
+// The division is a multiplication by RECIP(2 area) and a shift, which is
+// exact for the dividends below 2^14 and divisors below 64 used here.
+#define RECIP_SHIFT 20
+#define RECIP(d) (((1u << RECIP_SHIFT) + (d) - 1) / (d))
+
+// Blurred row: out[x] is the rounded mean of col[x-r..x+r] (clipped to
+// [0, width)), each the sum of ny pixels.
+static void blurSmallRow(const uint16_t* restrict col, uint8* restrict out, int width, int r, int ny) {
+  // Inside: 2r+1 column sums, divided by a constant.
+  uint32_t a = (2*r + 1)*ny;
+  uint32_t m = RECIP(2*a);
+  if (width > 2*r) kernels.meanRow(col + r, out + r, width - 2*r, r, a, m, RECIP_SHIFT);
+  // The borders (and all of rows narrower than the window): clipped.
+  for (int x = 0; x < width; x++) {
+    if (x == r && width - r > r) x = width - r;
+    int x0 = x - r > 0 ? x - r : 0;
+    int x1 = x + r < width ? x + r + 1 : width;
+    uint32_t s = 0;
+    for (int k = x0; k < x1; k++) s += col[k];
+    uint32_t area = (x1 - x0)*ny;
+    out[x] = (uint8)((2*s + area) / (2*area));
+  }
+}
+
+// Write the (2r+1)x(2r+1) blur of src into dst (which may be src), for
+// r = 1 or 2.  Returns 0 if memory is exhausted (and dst is not changed).
+static int blurSmall(Image src, Image dst, int r) {
+  int width = src->width;
+  int height = src->height;
+  int k = 2*r + 1;            // rows in the buffer: row y is in slot y % k
+  uint8* ring = malloc((size_t)k*width + 1);
+  uint16_t* col = calloc((size_t)width + 1, sizeof(uint16_t));
+  uint8* out = malloc((size_t)width + 1);
+  if (!check(ring != NULL && col != NULL && out != NULL, "Out of memory")) {
+    free(ring); free(col); free(out);
+    return 0;
+  }
+  // The rows of the window of output row 0.
+  for (int y = 0; y <= r && y < height; y++) {
+    uint8* row = ring + (size_t)(y % k)*width;
+    readRow(src, y, row);
+    kernels.addRow(col, row, width);
+  }
+  for (int i = 0; i < height; i++) {
+    int y0 = i - r > 0 ? i - r : 0;
+    int y1 = i + r < height ? i + r + 1 : height;
+    blurSmallRow(col, out, width, r, y1 - y0);
+    writeRow(dst, i, out);
+    // Slide the window down: row i-r out, row i+r+1 in (into its slot).
+    // (Source rows are read before the output rows over them are written.)
+    if (i - r >= 0) {
+      const uint8* row = ring + (size_t)((i - r) % k)*width;
+      kernels.subRow(col, row, width);
+    }
+    if (i + r + 1 < height) {
+      uint8* row = ring + (size_t)((i + r + 1) % k)*width;
+      readRow(src, i + r + 1, row);
+      kernels.addRow(col, row, width);
+    }
+  }
+  PIXMEM(2L*width*height); // One read and one write per pixel.
+  free(ring); free(col); free(out);
+  return 1;
+}
+
 void ImageBlur(Image img, int dx, int dy) {
   assert(dx >= 0);      // Assert dx is non-negative
   assert(dy >= 0);      // Assert dy is non-negative
 
-  int i, j;             // Loop variables
-  int x, y;             // Pixel position
-  int valPixel;         // Pixel value
-  int height = ImageHeight(img);  // Image height
-  int width = ImageWidth(img);    // Image width
-  int *matrixValPixelSUM= (int*)malloc(sizeof(int)*height * width); // Create an array to store the cumulative sums of the pixel values
-  int area; // Area of the blur
+  if (dx == dy && (dx == 1 || dx == 2)) {
+    // Out of memory: the image is left unchanged.
+    if (flatten(img) && ImageUnshare(img) && blurSmall(img, img, dx)) {
+      changed(img, 0, 0, img->width, img->height);
+    }
+    return;
+  }
 
-  // First pass: Compute the cumulative sums
-  for (i = 0; i < height; i++) {
-    for (j = 0; j < width; j++) {
-      valPixel = ImageGetPixel(img, j, i);
-      //Add the cumsum stored in the previous column (j -1, i) and in the previous row (j, i - 1), if they exist 
-      valPixel += j > 0 ? matrixValPixelSUM[G(img, j - 1, i)] : 0;    // Cumulative sum over the previous row
-      valPixel += i > 0 ? matrixValPixelSUM[G(img, j, i - 1)] : 0;    // Cumulative sum over the previous column
-      //If both values where added together, there was an area of pixels added twice, so we must subtract it once
-      valPixel -= i > 0 && j > 0 ? matrixValPixelSUM[G(img, j - 1, i - 1)] : 0; // Remove the overlap to avoid double counting
-      matrixValPixelSUM[G(img, j, i)] = valPixel; // Store the cumulative sum at the current position
+  // (Materialized first, so that the sums are taken along rows of the array.)
+  Integral t = flatten(img) ? ImageIntegral(img, 0) : NULL;
+  uint8* row = malloc(img->width + 1);
+  // Out of memory: the image is left unchanged.
+  if (t != NULL && row != NULL && ImageUnshare(img)) {
+    blurInto(t, img, dx, dy, row);
+    changed(img, 0, 0, img->width, img->height);
+  }
+  free(row);
+}
+
+/// Blur img into a new image, with a (2dx+1)x(2dy+1) mean filter.
+Image ImageBlurred(Image img, int dx, int dy) { ///
+  assert(img != NULL);
+  assert(dx >= 0);
+  assert(dy >= 0);
+  if (dx == dy && (dx == 1 || dx == 2)) {
+    Image newImg = ImageCreateLayout(img->width, img->height, (uint8)img->maxval, img->layout);
+    if (!check(newImg != NULL, "Out of memory")) return NULL;
+    if (!blurSmall(img, newImg, dx)) ImageDestroy(&newImg);
+    return newImg;
+  }
+  Integral t = ImageIntegral(img, 0);
+  if (t == NULL) return NULL;
+  Image newImg = ImageCreateLayout(img->width, img->height, (uint8)img->maxval, img->layout);
+  uint8* row = malloc(img->width + 1);
+  if (!check(newImg != NULL && row != NULL, "Out of memory")) {
+    ImageDestroy(&newImg);
+    free(row);
+    return NULL;
+  }
+  blurInto(t, newImg, dx, dy, row);
+  free(row);
+  return newImg;
+}
+
+/// Update dst, the blur of src, over the dirty rectangle of src.
+int ImageBlurUpdate(Image src, Image dst, int dx, int dy) { ///
+  assert(src != NULL && dst != NULL && src != dst);
+  assert(src->width == dst->width && src->height == dst->height);
+  assert(dx >= 0);
+  assert(dy >= 0);
+  int width = src->width;
+  int height = src->height;
+  int x, y, w, h;
+  if (!ImageDirtyRect(src, &x, &y, &w, &h)) return 1;
+  // The pixels of dst to recompute: [ox0, ox1)x[oy0, oy1),
+  // and the pixels of src they read: [ix0, ix1)x[iy0, iy1).
+  int ox0 = x - dx > 0 ? x - dx : 0;
+  int oy0 = y - dy > 0 ? y - dy : 0;
+  int ox1 = x + w + dx < width ? x + w + dx : width;
+  int oy1 = y + h + dy < height ? y + h + dy : height;
+  int ix0 = ox0 - dx > 0 ? ox0 - dx : 0;
+  int iy0 = oy0 - dy > 0 ? oy0 - dy : 0;
+  int ix1 = ox1 + dx < width ? ox1 + dx : width;
+  int iy1 = oy1 + dy < height ? oy1 + dy : height;
+
+  // The integral image of the input rectangle, as in buildIntegral.
+  int iw = ix1 - ix0;
+  size_t W = (size_t)iw + 1;
+  uint64_t* sum = malloc(W*(iy1 - iy0 + 1)*sizeof(uint64_t));
+  uint8* row = malloc(iw);
+  if (!check(sum != NULL && row != NULL, "Out of memory") || !ImageUnshare(dst)) {
+    free(sum);
+    free(row);
+    return 0;
+  }
+  memset(sum, 0, W*sizeof(uint64_t));
+  for (int i = iy0; i < iy1; i++) {
+    readSpan(src, ix0, i, iw, row);
+    const uint64_t* above = sum + (i - iy0)*W;
+    uint64_t* s = sum + (i - iy0 + 1)*W;
+    uint64_t acc = 0;
+    s[0] = 0;
+    for (int j = 0; j < iw; j++) {
+      acc += row[j];
+      s[j + 1] = above[j + 1] + acc;
     }
   }
 
-  // Second pass: Compute the weighted average over the specified region
-  for (i = 0; i < height; i++) {
-    for (j = 0; j < width; j++) {
-      x = j + dx < width ? j + dx : width - 1;    // Compute the x-coordinate for the weighted average region
-      y = i + dy < height ? i + dy : height - 1;  // Compute the y-coordinate for the weighted average region
-      valPixel = matrixValPixelSUM[G(img, x, y)]; // Get the cumulative sum at the target position
-      valPixel += j - dx > 0 && i - dy > 0 ? matrixValPixelSUM[G(img, j - dx - 1, i - dy - 1)] : 0; // Remove the overlap from the previous region
-      valPixel -= i - dy > 0 ? matrixValPixelSUM[G(img, x, i - dy - 1)] : 0;  // Remove the overlap from the previous row     
-      valPixel -= j - dx > 0 ? matrixValPixelSUM[G(img, j - dx - 1, y)] : 0;  // Remove the overlap from the previous column 
-      int h = i - dy > 0 ? i - dy : 0, w = j - dx > 0 ? j - dx : 0;           // Compute the height and width of the region 
-      area = (x - w + 1) * (y - h + 1); // Compute the area of pixels in the region
-      valPixel = (uint8)((double)valPixel / (area) + ROUND); // Compute the weighted average and round it
-      ImageSetPixel(img, j, i, valPixel); // Set the pixel value in the output image
+  // As blurInto, over the output rectangle only: the same rectangles,
+  // clipped to the whole image, give the same results.
+  for (int i = oy0; i < oy1; i++) {
+    int y0 = i - dy > 0 ? i - dy : 0;
+    int y1 = i + dy < height ? i + dy + 1 : height;
+    for (int j = ox0; j < ox1; j++) {
+      int x0 = j - dx > 0 ? j - dx : 0;
+      int x1 = j + dx < width ? j + dx + 1 : width;
+      uint64_t s = rectSum(sum, W, x0 - ix0, y0 - iy0, x1 - ix0, y1 - iy0);
+      int area = (x1 - x0) * (y1 - y0);
+      row[j - ox0] = (uint8)((double)s / area + ROUND);
+    }
+    writeSpan(dst, ox0, i, ox1 - ox0, row);
+  }
+  PIXMEM((long)iw*(iy1 - iy0) + (long)(ox1 - ox0)*(oy1 - oy0));  // Reads and writes.
+  changed(dst, ox0, oy0, ox1 - ox0, oy1 - oy0);
+  free(sum);
+  free(row);
+  return 1;
+}
+
+
+// Median filter histograms.
+// Levels are counted in 16 coarse bins (of 16 levels each) and in 256 fine
+// bins, so that the median is found by scanning at most 16 + 16 bins.
+#define COARSE(v) ((v) >> 4)
+
+// Add / remove the n counts of a column to / from the window histogram.
+// Plain loops over short fixed-size arrays: these vectorize well.
+static inline void histAdd(uint32_t* k, const uint16_t* col, int n) {
+  for (int i = 0; i < n; i++) k[i] += col[i];
+}
+
+static inline void histSub(uint32_t* k, const uint16_t* col, int n) {
+  for (int i = 0; i < n; i++) k[i] -= col[i];
+}
+
+/// Denoise an image by applying a (2dx+1)x(2dy+1) median filter.
+/// Each pixel is substituted by the median of the pixels in the rectangle
+/// [x-dx, x+dx]x[y-dy, y+dy] that lie inside the image (the lower median,
+/// if their number is even).
+/// The image is changed in-place.
+/// This is the constant-time algorithm of Perreault and Hébert: each column
+/// keeps the histogram of the 2dy+1 pixels around the current row, which is
+/// updated by one pixel out and one in per row; the window histogram is then
+/// updated by one column histogram out and one in per pixel.  Only the
+/// coarse bins are updated for every pixel; the fine bins of a coarse bin
+/// are caught up when the median falls in it, which neighbouring pixels
+/// mostly share.
+/// Returns 1 on success, or 0 if memory is exhausted.
+int ImageMedian(Image img, int dx, int dy) { ///
+  assert(img != NULL);
+  assert(img->layout == LAYOUT_RASTER);   // see ImageSetLayout
+  assert(dx >= 0);
+  assert(0 <= dy && dy < 32768);   // so column counts fit 16 bits
+
+  int width = img->width;
+  int height = img->height;
+  if (width == 0 || height == 0) return 1;
+  if (!flatten(img)) return 0;
+  if (dx > width - 1) dx = width - 1;     // A larger window adds no pixels.
+  if (dy > height - 1) dy = height - 1;
+
+  // The result goes to a new array (allocated as any other, see
+  // allocPixels), which replaces the array of img at the end.
+  Image tmp = ImageCreate(width, height, (uint8)img->maxval);
+  uint16_t* colCoarse = calloc((size_t)width*16, sizeof(uint16_t));
+  uint16_t* colFine = calloc((size_t)width*256, sizeof(uint16_t));
+  if (!check(tmp != NULL && colCoarse != NULL && colFine != NULL, "Out of memory")) {
+    ImageDestroy(&tmp); free(colCoarse); free(colFine);
+    return 0;
+  }
+  uint8* out = tmp->pixel;
+
+  // Column histograms of rows [0, dy], the window of row 0.
+  for (int y = 0; y <= dy; y++) {
+    const uint8* row = img->pixel + (size_t)y*width;
+    for (int x = 0; x < width; x++) {
+      colCoarse[16*x + COARSE(row[x])]++;
+      colFine[256*x + row[x]]++;
+    }
+  }
+
+  uint32_t kc[16], kf[256];   // window histogram (coarse, fine)
+  int last[16];               // column the fine bins of each coarse bin are for
+  for (int y = 0; y < height; y++) {
+    if (y > 0) {
+      // Slide the column histograms down: rows y-dy-1 out, y+dy in.
+      if (y - dy - 1 >= 0) {
+        const uint8* row = img->pixel + (size_t)(y - dy - 1)*width;
+        for (int x = 0; x < width; x++) {
+          colCoarse[16*x + COARSE(row[x])]--;
+          colFine[256*x + row[x]]--;
+        }
+      }
+      if (y + dy < height) {
+        const uint8* row = img->pixel + (size_t)(y + dy)*width;
+        for (int x = 0; x < width; x++) {
+          colCoarse[16*x + COARSE(row[x])]++;
+          colFine[256*x + row[x]]++;
+        }
+      }
+    }
+    int rows = (y + dy < height ? y + dy : height - 1) - (y - dy > 0 ? y - dy : 0) + 1;
+
+    // Coarse window histogram of columns [0, dx], the window of pixel (0, y).
+    // The fine window histogram is kept per coarse bin, and only brought up
+    // to date (to the column of last[c]) when the median falls in bin c.
+    memset(kc, 0, sizeof(kc));
+    for (int x = 0; x <= dx; x++) histAdd(kc, colCoarse + 16*x, 16);
+    for (int c = 0; c < 16; c++) last[c] = -1;
+
+    uint8* dst = out + (size_t)y*width;
+    for (int x = 0; x < width; x++) {
+      if (x > 0) {
+        // Slide the window right: columns x-dx-1 out, x+dx in.
+        if (x - dx - 1 >= 0) histSub(kc, colCoarse + 16*(x - dx - 1), 16);
+        if (x + dx < width) histAdd(kc, colCoarse + 16*(x + dx), 16);
+      }
+      int cols = (x + dx < width ? x + dx : width - 1) - (x - dx > 0 ? x - dx : 0) + 1;
+      uint32_t rank = ((uint32_t)rows*cols - 1) / 2;   // of the lower median
+
+      // Find the coarse bin holding the median.
+      uint32_t below = 0;
+      int c = 0;
+      while (below + kc[c] <= rank) below += kc[c++];
+
+      // Update its fine bins: slide them from column last[c], if that is
+      // cheaper than summing the window columns again.
+      uint32_t* fine = kf + 16*c;
+      if (last[c] < 0 || x - last[c] > 2*dx + 1) {
+        memset(fine, 0, 16*sizeof(uint32_t));
+        int x1 = x + dx < width ? x + dx : width - 1;
+        for (int i = x - dx > 0 ? x - dx : 0; i <= x1; i++)
+          histAdd(fine, colFine + 256*i + 16*c, 16);
+      } else {
+        for (int j = last[c] + 1; j <= x; j++) {
+          if (j - dx - 1 >= 0) histSub(fine, colFine + 256*(j - dx - 1) + 16*c, 16);
+          if (j + dx < width) histAdd(fine, colFine + 256*(j + dx) + 16*c, 16);
+        }
+      }
+      last[c] = x;
+
+      // Find the level within the coarse bin.
+      int v = 0;
+      while (below + fine[v] <= rank) below += fine[v++];
+      dst[x] = (uint8)(16*c + v);
+    }
+  }
+  PIXMEM(3L*width*height);  // Each pixel read in and out of a column, and written.
+
+  changed(img, 0, 0, img->width, img->height);
+  takePixels(img, &tmp);
+  free(colCoarse);
+  free(colFine);
+  return 1;
+}
+
+
+/// Convolution
+
+// ImageConvolve works on a copy of the image padded by the kernel radius
+// on every side, filled in according to the border policy, so that the
+// kernels read any tap through row pointers, without bound checks.  Each
+// output row is first accumulated as int sums, then normalized.  All inner
+// loops run along rows, in chunks of CHUNK pixels with a fixed trip count,
+// which -O2 vectorizes (see minRow).
+#define CHUNK 16
+
+// Index of coordinate i (possibly outside [0, n)) under a border policy,
+// or -1 for a black pixel.
+static int borderIndex(int i, int n, BorderMode border) {
+  if (0 <= i && i < n) return i;
+  switch (border) {
+  case BORDER_REPLICATE:
+    return i < 0 ? 0 : n - 1;
+  case BORDER_REFLECT:
+    i %= 2*n;
+    if (i < 0) i += 2*n;
+    return i < n ? i : 2*n - 1 - i;
+  default:
+    return -1;
+  }
+}
+
+// Copy of img with px columns and py rows of border on each side.
+// Returns NULL if memory is exhausted.
+static uint8* padImage(Image img, int px, int py, BorderMode border) {
+  int width = img->width;
+  int height = img->height;
+  int pw = width + 2*px;
+  uint8* pad = malloc((size_t)pw*(height + 2*py));
+  if (pad == NULL) return NULL;
+  for (int y = 0; y < height + 2*py; y++) {
+    uint8* dst = pad + (size_t)y*pw;
+    int sy = borderIndex(y - py, height, border);
+    if (sy < 0) {
+      memset(dst, 0, pw);
+      continue;
+    }
+    const uint8* src = img->pixel + (size_t)sy*width;
+    memcpy(dst + px, src, width);
+    for (int x = 0; x < px; x++) {
+      int l = borderIndex(x - px, width, border);
+      int r = borderIndex(width + x, width, border);
+      dst[x] = l < 0 ? 0 : src[l];
+      dst[px + width + x] = r < 0 ? 0 : src[r];
+    }
+  }
+  return pad;
+}
+
+// acc[x] += k * src[x], over n pixels.
+static inline void addScaledRow(int* restrict acc, const uint8* restrict src, int k, int n) {
+  int x = 0;
+  for (; x + CHUNK <= n; x += CHUNK)
+    for (int i = 0; i < CHUNK; i++) acc[x+i] += k*src[x+i];
+  for (; x < n; x++) acc[x] += k*src[x];
+}
+
+// acc[x] += k * src[x], over n sums.
+static inline void addScaledSums(int* restrict acc, const int* restrict src, int k, int n) {
+  int x = 0;
+  for (; x + CHUNK <= n; x += CHUNK)
+    for (int i = 0; i < CHUNK; i++) acc[x+i] += k*src[x+i];
+  for (; x < n; x++) acc[x] += k*src[x];
+}
+
+// Saturate v to [0, maxval].
+static inline uint8 clampLevel(int v, int maxval) {
+  return (uint8)(v < 0 ? 0 : v > maxval ? maxval : v);
+}
+
+// dst[x] = sum[x] / div (rounding halves up) + bias, saturated to [0, maxval].
+static void normalizeRow(const int* restrict sum, uint8* restrict dst, int n,
+                         int div, int bias, int maxval) {
+  int shift = 0;
+  while (shift < 30 && (1 << shift) < div) shift++;
+  if ((1 << shift) == div) {
+    // Power of two: an arithmetic shift is a floor division, and vectorizes.
+    int x = 0;
+    for (; x + CHUNK <= n; x += CHUNK)
+      for (int i = 0; i < CHUNK; i++)
+        dst[x+i] = clampLevel(((sum[x+i] + div/2) >> shift) + bias, maxval);
+    for (; x < n; x++) dst[x] = clampLevel(((sum[x] + div/2) >> shift) + bias, maxval);
+  } else {
+    for (int x = 0; x < n; x++) {
+      int s = sum[x] + div/2;
+      dst[x] = clampLevel((s >= 0 ? s / div : -((div - 1 - s) / div)) + bias, maxval);
+    }
+  }
+}
+
+// 3x3 kernel: all 9 taps unrolled, weights held in locals.
+static void convolve3x3(const uint8* pad, int pw, Image img, const int k[9],
+                        int div, int bias, int* sum) {
+  int width = img->width;
+  const int k0 = k[0], k1 = k[1], k2 = k[2], k3 = k[3], k4 = k[4],
+            k5 = k[5], k6 = k[6], k7 = k[7], k8 = k[8];
+  for (int y = 0; y < img->height; y++) {
+    const uint8* r0 = pad + (size_t)y*pw;
+    const uint8* r1 = r0 + pw;
+    const uint8* r2 = r1 + pw;
+    int x = 0;
+#define TAPS3(x) (k0*r0[x] + k1*r0[x+1] + k2*r0[x+2] + \
+                  k3*r1[x] + k4*r1[x+1] + k5*r1[x+2] + \
+                  k6*r2[x] + k7*r2[x+1] + k8*r2[x+2])
+    for (; x + CHUNK <= width; x += CHUNK)
+      for (int i = 0; i < CHUNK; i++) sum[x+i] = TAPS3(x+i);
+    for (; x < width; x++) sum[x] = TAPS3(x);
+#undef TAPS3
+    normalizeRow(sum, img->pixel + (size_t)y*width, width, div, bias, img->maxval);
+  }
+}
+
+// 5x5 kernel: the 5 taps of each kernel row unrolled, one row at a time.
+static void convolve5x5(const uint8* pad, int pw, Image img, const int k[25],
+                        int div, int bias, int* restrict sum) {
+  int width = img->width;
+  for (int y = 0; y < img->height; y++) {
+    memset(sum, 0, width*sizeof(int));
+    for (int j = 0; j < 5; j++) {
+      const uint8* restrict r = pad + (size_t)(y + j)*pw;
+      const int a = k[5*j], b = k[5*j+1], c = k[5*j+2], d = k[5*j+3], e = k[5*j+4];
+      int x = 0;
+#define TAPS5(x) (a*r[x] + b*r[x+1] + c*r[x+2] + d*r[x+3] + e*r[x+4])
+      for (; x + CHUNK <= width; x += CHUNK)
+        for (int i = 0; i < CHUNK; i++) sum[x+i] += TAPS5(x+i);
+      for (; x < width; x++) sum[x] += TAPS5(x);
+#undef TAPS5
     }
+    normalizeRow(sum, img->pixel + (size_t)y*width, width, div, bias, img->maxval);
   }
-  free(matrixValPixelSUM);
 }
 
+// Any kernel: every nonzero tap adds a scaled padded row.
+static void convolveFull(const uint8* pad, int pw, Image img, int kw, int kh,
+                         const int k[], int div, int bias, int* sum) {
+  int width = img->width;
+  for (int y = 0; y < img->height; y++) {
+    memset(sum, 0, width*sizeof(int));
+    for (int j = 0; j < kh; j++) {
+      const uint8* r = pad + (size_t)(y + j)*pw;
+      for (int i = 0; i < kw; i++) {
+        if (k[j*kw + i] != 0) addScaledRow(sum, r + i, k[j*kw + i], width);
+      }
+    }
+    normalizeRow(sum, img->pixel + (size_t)y*width, width, div, bias, img->maxval);
+  }
+}
+
+// Separable kernel: padded rows are filtered by kx into a ring of kh rows
+// of sums, which are combined by ky.  rows holds kh*width ints.
+static void convolveSeparable(const uint8* pad, int pw, Image img, int kw, const int kx[],
+                              int kh, const int ky[], int div, int bias, int* sum, int* rows) {
+  int width = img->width;
+  for (int y = 0; y < img->height; y++) {
+    // Filter the padded rows not filtered yet: y+kh-1 only, after row 0.
+    for (int j = y == 0 ? 0 : kh - 1; j < kh; j++) {
+      int* h = rows + (size_t)((y + j) % kh)*width;
+      const uint8* r = pad + (size_t)(y + j)*pw;
+      memset(h, 0, width*sizeof(int));
+      for (int i = 0; i < kw; i++) {
+        if (kx[i] != 0) addScaledRow(h, r + i, kx[i], width);
+      }
+    }
+    memset(sum, 0, width*sizeof(int));
+    for (int j = 0; j < kh; j++) {
+      if (ky[j] != 0) addScaledSums(sum, rows + (size_t)((y + j) % kh)*width, ky[j], width);
+    }
+    normalizeRow(sum, img->pixel + (size_t)y*width, width, div, bias, img->maxval);
+  }
+}
+
+static int gcd(int a, int b) {
+  a = abs(a);
+  b = abs(b);
+  while (b != 0) { int t = a % b; a = b; b = t; }
+  return a;
+}
+
+// Split kernel k into the outer product of integer vectors kx and ky, if
+// it is one.  Returns 1 if so, 0 otherwise.
+static int splitKernel(int kw, int kh, const int k[], int kx[], int ky[]) {
+  int r0 = 0;   // first nonzero row
+  while (r0 < kh) {
+    int i = 0;
+    while (i < kw && k[r0*kw + i] == 0) i++;
+    if (i < kw) break;
+    r0++;
+  }
+  if (r0 == kh) return 0;
+  int g = 0;
+  for (int i = 0; i < kw; i++) g = gcd(g, k[r0*kw + i]);
+  int i0 = 0;
+  for (int i = 0; i < kw; i++) {
+    kx[i] = k[r0*kw + i] / g;
+    if (kx[i] != 0 && kx[i0] == 0) i0 = i;
+  }
+  for (int j = 0; j < kh; j++) {
+    if (k[j*kw + i0] % kx[i0] != 0) return 0;
+    ky[j] = k[j*kw + i0] / kx[i0];
+    for (int i = 0; i < kw; i++) {
+      if (k[j*kw + i] != ky[j]*kx[i]) return 0;
+    }
+  }
+  return 1;
+}
+
+// Apply a full kernel (kx == NULL) or a separable one, as documented in
+// ImageConvolve.
+static int convolve(Image img, int kw, int kh, const int kernel[], const int kx[],
+                    const int ky[], int div, int bias, BorderMode border) {
+  assert(img != NULL);
+  assert(img->layout == LAYOUT_RASTER);   // see ImageSetLayout
+  assert(kw > 0 && kw % 2 == 1);
+  assert(kh > 0 && kh % 2 == 1);
+  assert(div > 0);
+  assert(border == BORDER_REPLICATE || border == BORDER_REFLECT || border == BORDER_ZERO);
+  int width = img->width;
+  int height = img->height;
+  if (width == 0 || height == 0) return 1;
+  if (!flatten(img)) return 0;
+
+  int* split = NULL;   // kx and ky of a full kernel found to be separable
+  // (3x3 kernels are cheaper in one unrolled pass, separable or not.)
+  if (kx == NULL && !(kw == 3 && kh == 3) && kw > 1 && kh > 1) {
+    split = malloc((kw + kh)*sizeof(int));
+    if (!check(split != NULL, "Out of memory")) return 0;
+    if (splitKernel(kw, kh, kernel, split, split + kw)) {
+      kx = split;
+      ky = split + kw;
+    }
+  }
+  int pw = width + 2*(kw/2);
+  uint8* pad = padImage(img, kw/2, kh/2, border);
+  int* sum = malloc(width*sizeof(int));
+  int* rows = kx != NULL ? malloc((size_t)kh*width*sizeof(int)) : NULL;
+  if (!check(pad != NULL && sum != NULL && (kx == NULL || rows != NULL), "Out of memory") ||
+      !ImageUnshare(img)) {
+    free(split); free(pad); free(sum); free(rows);
+    return 0;
+  }
+
+  changed(img, 0, 0, img->width, img->height);
+  if (kx != NULL) {
+    convolveSeparable(pad, pw, img, kw, kx, kh, ky, div, bias, sum, rows);
+  } else if (kw == 3 && kh == 3) {
+    convolve3x3(pad, pw, img, kernel, div, bias, sum);
+  } else if (kw == 5 && kh == 5) {
+    convolve5x5(pad, pw, img, kernel, div, bias, sum);
+  } else {
+    convolveFull(pad, pw, img, kw, kh, kernel, div, bias, sum);
+  }
+  // Taps read (kw + kh, if separable) and one write per pixel.
+  PIXMEM(((kx != NULL ? kw + kh : (long)kw*kh) + 1)*width*height);
+  free(split); free(pad); free(sum); free(rows);
+  return 1;
+}
+
+/// Convolve an image with a kw x kh integer kernel (kw, kh odd).
+/// Each pixel (x, y) is substituted by
+///   sum k[j*kw + i] * pixel(x + i - kw/2, y + j - kh/2),  0<=i<kw, 0<=j<kh
+/// divided by div (rounding halves up), plus bias, saturated to
+/// [0, maxval].
+/// The image is changed in-place.
+/// Returns 1 on success, or 0 if memory is exhausted.
+int ImageConvolve(Image img, int kw, int kh, const int kernel[], int div,
+                  int bias, BorderMode border) { ///
+  assert(kernel != NULL);
+  return convolve(img, kw, kh, kernel, NULL, NULL, div, bias, border);
+}
+
+/// Convolve an image with the separable kernel k[j*kw + i] = kx[i]*ky[j].
+/// Otherwise, as ImageConvolve.
+int ImageConvolveSeparable(Image img, int kw, const int kx[], int kh, const int ky[],
+                           int div, int bias, BorderMode border) { ///
+  assert(kx != NULL && ky != NULL);
+  return convolve(img, kw, kh, NULL, kx, ky, div, bias, border);
+}
+
+
+/// Morphology
+
+// Erosion and dilation use the van Herk / Gil-Werman algorithm, separably:
+// first along rows, then along columns.  A line padded with r neutral
+// elements at each end is cut into blocks of k = 2r+1 elements; g holds the
+// running minimum from the start of each block, and h the running minimum
+// to its end.  The window [p, p+2r] (padded coordinates) spans at most two
+// blocks, so its minimum is min(h[p], g[p+2r]): three comparisons per
+// element, whatever the size of the window.
+// Dilation is erosion of the negated levels (v ^ 0xFF), negated back:
+// the same code serves both.
+
+static inline uint8 min8(uint8 a, uint8 b) { return a < b ? a : b; }
+
+// dst[x] = min(a[x], b[x] ^ flip) over n pixels.
+// The rows never overlap (restrict), and are combined in chunks of 16
+// pixels: with a fixed trip count and no aliasing, -O2 vectorizes the inner
+// loop without runtime checks or epilogues.
+static inline void minRow(uint8* restrict dst, const uint8* restrict a,
+                          const uint8* restrict b, uint8 flip, int n) {
+  int x = 0;
+  for (; x + 16 <= n; x += 16)
+    for (int i = 0; i < 16; i++) dst[x+i] = min8(a[x+i], b[x+i] ^ flip);
+  for (; x < n; x++) dst[x] = min8(a[x], b[x] ^ flip);
+}
+
+// dst[x] = min(a[x], b[x]) ^ flip over n pixels.
+static inline void minRowOut(uint8* restrict dst, const uint8* restrict a,
+                             const uint8* restrict b, uint8 flip, int n) {
+  int x = 0;
+  for (; x + 16 <= n; x += 16)
+    for (int i = 0; i < 16; i++) dst[x+i] = min8(a[x+i], b[x+i]) ^ flip;
+  for (; x < n; x++) dst[x] = min8(a[x], b[x]) ^ flip;
+}
+
+// Rows are eroded in strips of STRIP rows, stored interleaved (pixel x of
+// the STRIP rows at [x*STRIP, x*STRIP+STRIP)), so that the recurrences of
+// g and h run on whole vectors of STRIP pixels, as in erodeCols.
+#define STRIP 16
+
+// Erode each row of img by a window of 2r+1 pixels, with levels XORed by
+// flip on the way in and out.  line is scratch space for 3*STRIP*L bytes,
+// with L the padded row length, a multiple of 2r+1.
+static void erodeRows(Image img, int r, uint8 flip, uint8* line, int L) {
+  int k = 2*r + 1;
+  int width = img->width;
+  int height = img->height;
+  uint8* g = line + STRIP*L;
+  uint8* h = g + STRIP*L;
+  memset(line, 0xFF, STRIP*r);
+  memset(line + STRIP*(r + width), 0xFF, STRIP*(L - r - width));
+  for (int y0 = 0; y0 < height; y0 += STRIP) {
+    int n = height - y0 < STRIP ? height - y0 : STRIP;   // rows in this strip
+    if (n < STRIP) memset(line + STRIP*r, 0xFF, STRIP*width);
+    for (int i = 0; i < n; i++) {
+      const uint8* row = img->pixel + (size_t)(y0 + i)*width;
+      uint8* col = line + STRIP*r + i;
+      for (int x = 0; x < width; x++) col[STRIP*x] = row[x] ^ flip;
+    }
+    for (int p = 0; p < L; p += k) {
+      uint8* gp = g + STRIP*p;
+      uint8* hp = h + STRIP*p;
+      const uint8* lp = line + STRIP*p;
+      memcpy(gp, lp, STRIP);
+      for (int i = 1; i < k; i++)
+        minRow(gp + STRIP*i, gp + STRIP*(i-1), lp + STRIP*i, 0x00, STRIP);
+      memcpy(hp + STRIP*(k-1), lp + STRIP*(k-1), STRIP);
+      for (int i = k - 2; i >= 0; i--)
+        minRow(hp + STRIP*i, hp + STRIP*(i+1), lp + STRIP*i, 0x00, STRIP);
+    }
+    // The strip is done with line: hold the result there.
+    minRowOut(line, h, g + STRIP*2*r, flip, STRIP*width);
+    for (int i = 0; i < n; i++) {
+      uint8* row = img->pixel + (size_t)(y0 + i)*width;
+      const uint8* col = line + i;
+      for (int x = 0; x < width; x++) row[x] = col[STRIP*x];
+    }
+    memset(line, 0xFF, STRIP*r);   // restore the padding
+  }
+}
+
+// Erode the columns of img by a window of 2r+1 pixels, with levels XORed
+// by flip on the way in and out.  Whole rows are combined at a time, so the
+// inner loops run along contiguous rows.  Only the h rows of the previous
+// block are needed, so scratch holds 3 blocks of k rows, plus two neutral
+// rows: one as read from the image, and one as flipped.
+// Output row i is written once padded row i+2r is read, that is, once
+// image row i+r is read: rows are never overwritten before being used.
+static void erodeCols(Image img, int r, uint8 flip, uint8* scratch) {
+  int k = 2*r + 1;
+  int width = img->width;
+  int height = img->height;
+  size_t rowLen = (size_t)width;
+  uint8* g = scratch;                      // g rows of the current block
+  uint8* hPrev = g + k*rowLen;             // h rows of the previous block
+  uint8* hCur = hPrev + k*rowLen;          // h rows of the current block
+  uint8* neutral = hCur + k*rowLen;       // padding rows
+  uint8* neutralIn = neutral + rowLen;     // padding rows, flipped
+  memset(neutral, 0xFF ^ flip, rowLen);
+  memset(neutralIn, 0xFF, rowLen);
+
+  int lastBlock = (height - 1 + 2*r) / k;  // holds the end of the last window
+  for (int b = 0; b <= lastBlock; b++) {
+    int p0 = b*k;
+    // Padded row p is image row p-r, or neutral.
+    for (int j = 0; j < k; j++) {
+      int y = p0 + j - r;
+      const uint8* src = 0 <= y && y < height ? img->pixel + (size_t)y*width : neutral;
+      uint8* gj = g + j*rowLen;
+      minRow(gj, j == 0 ? neutralIn : gj - rowLen, src, flip, width);
+    }
+    for (int j = k - 1; j >= 0; j--) {
+      int y = p0 + j - r;
+      const uint8* src = 0 <= y && y < height ? img->pixel + (size_t)y*width : neutral;
+      uint8* hj = hCur + j*rowLen;
+      minRow(hj, j == k - 1 ? neutralIn : hj + rowLen, src, flip, width);
+    }
+    // Output rows i with i+2r in this block: i in [p0-2r, p0+k-1-2r].
+    for (int i = p0 - 2*r; i <= p0 + k - 1 - 2*r; i++) {
+      if (i < 0 || i >= height) continue;
+      const uint8* hi = i < p0 ? hPrev + (i - (p0 - k))*rowLen : hCur + (i - p0)*rowLen;
+      const uint8* gi = g + (i + 2*r - p0)*rowLen;
+      uint8* dst = img->pixel + (size_t)i*width;
+      minRowOut(dst, hi, gi, flip, width);
+    }
+    uint8* t = hPrev; hPrev = hCur; hCur = t;
+  }
+}
+
+// Erode img (flip = 0) or dilate it (flip = 0xFF).
+static int morph(Image img, int dx, int dy, uint8 flip) {
+  assert(img != NULL);
+  assert(img->layout == LAYOUT_RASTER);   // see ImageSetLayout
+  assert(dx >= 0);
+  assert(dy >= 0);
+  int width = img->width;
+  int height = img->height;
+  if (width == 0 || height == 0) return 1;
+  if (!flatten(img)) return 0;
+  if (dx > width - 1) dx = width - 1;     // A larger window adds no pixels.
+  if (dy > height - 1) dy = height - 1;
+
+  int kx = 2*dx + 1, ky = 2*dy + 1;
+  int L = (width + 2*dx + kx - 1) / kx * kx;   // padded row length
+  size_t size = (size_t)3*STRIP*L;
+  if ((size_t)(3*ky + 2)*width > size) size = (size_t)(3*ky + 2)*width;
+  uint8* scratch = malloc(size);
+  if (!check(scratch != NULL, "Out of memory")) return 0;
+  if (!ImageUnshare(img)) {
+    free(scratch);
+    return 0;
+  }
+
+  changed(img, 0, 0, img->width, img->height);
+  if (dx > 0) erodeRows(img, dx, flip, scratch, L);
+  if (dy > 0) erodeCols(img, dy, flip, scratch);
+  PIXMEM(2L*width*height*((dx > 0) + (dy > 0)));  // One read and one write per pixel and pass.
+  free(scratch);
+  return 1;
+}
+
+/// Erode an image: each pixel is substituted by the minimum of the pixels
+/// in the rectangle [x-dx, x+dx]x[y-dy, y+dy].
+/// The image is changed in-place.
+/// Returns 1 on success, or 0 if memory is exhausted.
+int ImageErode(Image img, int dx, int dy) { ///
+  return morph(img, dx, dy, 0x00);
+}
+
+/// Dilate an image: each pixel is substituted by the maximum of the pixels
+/// in the rectangle [x-dx, x+dx]x[y-dy, y+dy].
+/// The image is changed in-place.
+/// Returns 1 on success, or 0 if memory is exhausted.
+int ImageDilate(Image img, int dx, int dy) { ///
+  return morph(img, dx, dy, 0xFF);
+}
 
 
 /* LEAST EFFICIENT BLUR EXECUTION 
@@ -13,6 +13,7 @@
 #define IMAGE8BIT_H
 
 #include <inttypes.h>
+#include <stdio.h>
 
 // Type for pixel levels
 typedef uint8_t uint8;
@@ -23,6 +24,12 @@ extern const uint8 PixMax;
 // Type Image is a pointer to image objects
 typedef struct image *Image;
 
+// Type Integral is a pointer to integral image objects (see ImageIntegral)
+typedef struct integral *Integral;
+
+// Type Histogram is a pointer to histogram objects (see ImageHistogram)
+typedef struct histogram *Histogram;
+
 /// Error handling functions
 
 /// Error cause.
@@ -33,12 +40,27 @@ typedef struct image *Image;
 ///
 /// After a successful operation, the result is not garanteed (it might be
 /// the previous error cause).  It is not meant to be used in that situation!
+/// Like errno, the error cause is kept per thread.
 char* ImageErrMsg() ;
 
 /// Init Image library.  (Call once!)
-/// Currently, simply calibrate instrumentation and set names of counters.
+/// Set names of counters, and select the pixel loops (kernels) for the
+/// best instruction set this CPU supports.  Environment variable
+/// IMAGE8BIT_KERNELS=scalar|sse2|avx2|avx512bw (on x86, and generic on
+/// 32-bit x86; scalar|generic elsewhere) forces a set instead (if the CPU
+/// supports it).  All sets give the same results.
+/// (Instrumentation is calibrated lazily, on first use: see InstrGetCTU.)
 void ImageInit(void) ;
 
+/// Name of the instruction set of the kernels in use (see ImageInit).
+const char* ImageKernels(void) ;
+
+/// Memory layouts of the pixel array
+typedef enum {
+  LAYOUT_RASTER,   // row after row, as in PGM files
+  LAYOUT_TILED,    // 64x64 tiles, each stored row after row
+} Layout;
+
 /// Image management functions
 
 /// Create a new black image.
@@ -51,6 +73,18 @@ void ImageInit(void) ;
 /// On failure, returns NULL and errno/errCause are set accordingly.
 Image ImageCreate(int width, int height, uint8 maxval) ;
 
+/// Create a new black image with the given memory layout.
+/// ImageCreate creates LAYOUT_RASTER images.  In LAYOUT_TILED images,
+/// pixels that are close vertically are close in memory too, which helps
+/// column-wise operations (ImageRotate) on wide images.
+/// These operations accept tiled images: the pixel accessors, ImageSave,
+/// ImageStats, the pixel transformations, ImageRotate, ImageMirror and
+/// ImageCrop (which keep the layout), ImagePaste, ImageBlend and ImageBlur.
+/// All others require raster images: convert first, with ImageSetLayout.
+/// (ImageLoad and ImageReadStream create raster images.)
+/// Success and failure as in ImageCreate.
+Image ImageCreateLayout(int width, int height, uint8 maxval, Layout layout) ;
+
 /// Destroy the image pointed to by (*imgp).
 ///   imgp : address of an Image variable.
 /// If (*imgp)==NULL, no operation is performed.
@@ -58,6 +92,71 @@ Image ImageCreate(int width, int height, uint8 maxval) ;
 /// Should never fail, and should preserve global errno/errCause.
 void ImageDestroy(Image* imgp) ;
 
+/// Get the memory layout of img.
+Layout ImageLayout(Image img) ;
+
+/// Change the memory layout of img, converting its pixel array.
+/// The pixels keep their levels.
+/// Returns 1 on success, or 0 if memory is exhausted, in which case img is
+/// not changed and errno/errCause are set accordingly.
+int ImageSetLayout(Image img, Layout layout) ;
+
+/// Create a copy of img in O(1) time: the copy shares the pixel array of
+/// img (copy on write).  The first function to change the pixels of either
+/// image in place gives it a private copy of the array, so that copies that
+/// are only read never cost memory.
+/// The copy has the layout of img, no dirty rectangle, and no integral image.
+/// (Cloning changes img: do not clone an image used by another thread
+/// meanwhile.  The clones themselves may be used by different threads.)
+/// Success and failure as in ImageCreate.
+Image ImageClone(Image img) ;
+
+/// Give img a private copy of its pixel array, if it shares one (see
+/// ImageClone).  The functions that never fail do this themselves, and
+/// abort if memory runs out: call this first, to handle that instead.
+/// Returns 1 on success, or 0 if memory is exhausted, in which case img is
+/// not changed and errno/errCause are set accordingly.
+int ImageUnshare(Image img) ;
+
+/// Back the pixel arrays of images created from now on with huge (2 MB)
+/// pages, if they take threshold bytes or more (16 MB, by default), so
+/// that column-wise access to large images misses the TLB much less often.
+/// Transparent huge pages are requested (see madvise, MADV_HUGEPAGE);
+/// if hugetlb, pages reserved by the system (MAP_HUGETLB) are tried first.
+/// Pass threshold 0 to use malloc for all pixel arrays.
+/// (Call before other threads create images.)
+void ImageHugePages(size_t threshold, int hugetlb) ;
+
+/// Shared images
+
+/// Processes on the same machine may hand images over through POSIX shared
+/// memory objects, named as for shm_open ("/NAME"), without copying them
+/// to a file and back.  A shared image is a raster image, and is released
+/// with ImageDestroy, as any other: that detaches it, but the object stays
+/// until it is removed with ImageUnlinkShared.
+/// Handing over is up to the processes: a consumer should attach only after
+/// the producer has finished writing the pixels.
+
+/// Create a new black image in shared memory object name, replacing any
+/// previous object with that name.  The pixels of the image are the object:
+/// whatever is written to them is seen by the images attached later.
+/// (The caller is responsible for destroying the returned image!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+Image ImageCreateShared(const char* name, int width, int height, uint8 maxval) ;
+
+/// Attach to the image in shared memory object name (see ImageCreateShared).
+/// The pixels are mapped, not copied.  They are private to the new image:
+/// changes to them are copied on write, page by page, and are not seen by
+/// other processes.
+/// (The caller is responsible for destroying the returned image!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+Image ImageAttachShared(const char* name) ;
+
+/// Remove shared memory object name.  Images attached to it remain valid.
+/// On success, returns nonzero.
+/// On failure, returns 0, and errno/errCause are set appropriately.
+int ImageUnlinkShared(const char* name) ;
+
 /// PGM file operations
 
 /// Load a raw PGM file.
@@ -73,6 +172,24 @@ Image ImageLoad(const char* filename) ;
 /// a partial and invalid file may be left in the system.
 int ImageSave(Image img, const char* filename) ;
 
+/// Read the next raw PGM image from stream f into *imgp.
+/// A stream may hold any number of images (frames), one after the other,
+/// as in concatenated PGM files.  (For a file descriptor, use fdopen.)
+/// If *imgp is a raster image with as many pixels as the frame, its
+/// pixel array is reused; otherwise, *imgp is destroyed and replaced by a
+/// new image.  *imgp may be NULL, for the first frame.
+/// (The caller is responsible for destroying *imgp, in the end!)
+/// Returns 1 if a frame was read, 0 at the end of the stream, or -1 on
+/// failure, with errno/errCause set accordingly (*imgp must still be
+/// destroyed, but its pixels are unspecified).
+int ImageReadStream(FILE* f, Image* imgp) ;
+
+/// Write image img to stream f, as a raw PGM image (frame).
+/// The stream is not flushed.
+/// On success, returns nonzero.
+/// On failure, returns 0, and errno/errCause are set appropriately.
+int ImageWriteStream(FILE* f, Image img) ;
+
 /// Information queries
 
 /// These functions do not modify the image and never fail.
@@ -99,6 +216,24 @@ int ImageValidPos(Image img, int x, int y) ;
 /// Check if rectangular area (x,y,w,h) is completely inside img.
 int ImageValidRect(Image img, int x, int y, int w, int h) ;
 
+/// Dirty rectangle
+
+/// Each image keeps the bounding rectangle of the pixels changed (by any
+/// function) since it was created or ImageClearDirty was last called.
+/// The incremental functions (ImageHistogramUpdate, ImageBlurUpdate)
+/// recompute a previous result only over that rectangle, so that small
+/// edits cost time proportional to the edit, not to the image.
+/// They leave it unchanged, so that several results may be brought up to
+/// date: clear it after updating all of them.
+
+/// Get the dirty rectangle of img: its position in (*x, *y) and its size
+/// in (*w, *h).
+/// Returns 1, or 0 if no pixels changed (and then *x..*h are untouched).
+int ImageDirtyRect(Image img, int* x, int* y, int* w, int* h) ;
+
+/// Mark all pixels of img as unchanged.
+void ImageClearDirty(Image img) ;
+
 /// Pixel get & set operations
 
 /// These are the primitive operations to access and modify a single pixel
@@ -112,6 +247,13 @@ uint8 ImageGetPixel(Image img, int x, int y) ;
 /// Set the pixel at position (x,y) to new level.
 void ImageSetPixel(Image img, int x, int y, uint8 level) ;
 
+/// Copy the levels of row y into row[0..width-1].
+/// A cheaper way for other modules to scan a whole image.
+void ImageGetRow(Image img, int y, uint8 row[]) ;
+
+/// Set the levels of row y to row[0..width-1].
+void ImageSetRow(Image img, int y, const uint8 row[]) ;
+
 /// Pixel transformations
 
 /// These functions modify the pixel levels in an image, but do not change
@@ -135,6 +277,13 @@ void ImageThreshold(Image img, uint8 thr) ;
 /// darken the image if factor<1.0.
 void ImageBrighten(Image img, double factor) ;
 
+/// Map each pixel level through a lookup table.
+/// Every pixel with level v is replaced by lut[v].
+/// Any sequence of the transformations above is a function of the level
+/// alone, so it may be collapsed into one table and applied in one pass.
+/// Requires: lut has PixMax+1 entries.
+void ImageMapLevels(Image img, const uint8 lut[]) ;
+
 /// Geometric transformations
 
 /// These functions apply geometric transformations to an image,
@@ -150,6 +299,11 @@ void ImageBrighten(Image img, double factor) ;
 /// The rotation is 90 degrees clockwise.
 /// The rotation is 90 degrees anti-clockwise.
 /// Ensures: The original img is not modified.
+/// Takes O(1) time: the new image is a clone of img (see ImageClone) that
+/// shows its pixels rotated.  Functions that need the rows of the pixel
+/// array (ImageResize, ImageBlur, the filters) copy them in the new order
+/// first; the others read through the rotation.  Chains of rotations and
+/// mirrors compose into a single transformation.
 /// 
 /// On success, a new image is returned.
 /// (The caller is responsible for destroying the returned image!)
@@ -159,6 +313,7 @@ Image ImageRotate(Image img) ;
 /// Mirror an image = flip left-right.
 /// Returns a mirrored version of the image.
 /// Ensures: The original img is not modified.
+/// Takes O(1) time, as ImageRotate.
 /// 
 /// On success, a new image is returned.
 /// (The caller is responsible for destroying the returned image!)
@@ -173,12 +328,36 @@ Image ImageMirror(Image img) ;
 /// Ensures:
 ///   The original img is not modified.
 ///   The returned image has width w and height h.
+/// Cropping the whole image returns a clone (see ImageClone).
 /// 
 /// On success, a new image is returned.
 /// (The caller is responsible for destroying the returned image!)
 /// On failure, returns NULL and errno/errCause are set accordingly.
 Image ImageCrop(Image img, int x, int y, int w, int h) ;
 
+/// Resampling modes for ImageResize
+typedef enum {
+  RESIZE_NEAREST,   // level of the source pixel under the center
+  RESIZE_BILINEAR,  // interpolation of the 2x2 source pixels around the center
+  RESIZE_AREA,      // mean of the source pixels covered, weighted by coverage
+} ResizeMode;
+
+/// Resize an image to width w and height h.
+/// Pixel centers are aligned, so the image is scaled by w/width and
+/// h/height about its center.  RESIZE_AREA is the best choice to shrink
+/// images (thumbnails); RESIZE_BILINEAR to enlarge them.
+/// Shrinking to exactly half the width and height with RESIZE_BILINEAR or
+/// RESIZE_AREA takes a faster path: both average each 2x2 block.
+/// Requires: w > 0 and h > 0.
+/// Ensures:
+///   The original img is not modified.
+///   The returned image has width w and height h, and the same maxval.
+/// 
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+Image ImageResize(Image img, int w, int h, ResizeMode mode) ;
+
 /// Operations on two images
 
 /// Paste an image into a larger image.
@@ -204,14 +383,149 @@ int ImageMatchSubImage(Image img1, int x, int y, Image img2) ;
 /// Searches for img2 inside img1.
 /// If a match is found, returns 1 and matching position is set in vars (*px, *py).
 /// If no match is found, returns 0 and (*px, *py) are left untouched.
+/// If img1 has an integral image (see ImageIntegral), only the positions
+/// where the sum of the pixels equals that of img2 are compared.
 int ImageLocateSubImage(Image img1, int* px, int* py, Image img2) ;
 
+/// Integral images
+
+/// The integral image (summed-area table) of an image holds the sums of
+/// the pixels above and left of each position, so that the sum of the
+/// pixels in any rectangle takes O(1) time.  Optionally, it also holds the
+/// sums of their squares, for variances.
+/// An image keeps its integral image, once computed, until its pixels are
+/// changed (by any function) or it is destroyed: it costs 8 bytes per
+/// pixel (16 with squares), and saves computing it again, in ImageBlur,
+/// ImageBlurred and ImageLocateSubImage, and in the queries below.
+
+/// Get the integral image of img (with the sums of squares, if squares),
+/// computing it if needed.
+/// The result belongs to img: it is valid until img is changed or destroyed.
+/// On failure, returns NULL and errno/errCause are set accordingly.
+Integral ImageIntegral(Image img, int squares) ;
+
+/// Sum of the pixels in the rectangle at (x, y), with width w and height h.
+/// Requires: the rectangle is inside the image.
+uint64_t IntegralSum(Integral t, int x, int y, int w, int h) ;
+
+/// Mean of the pixels in a rectangle.  Requires also: w > 0, h > 0.
+double IntegralMean(Integral t, int x, int y, int w, int h) ;
+
+/// Variance of the pixels in a rectangle.
+/// Requires also: t has the sums of squares.
+double IntegralVariance(Integral t, int x, int y, int w, int h) ;
+
+/// Histograms
+
+/// A histogram counts the pixels of an image at each gray level.
+/// It also keeps the counts of each 64x64 block of the image, so that
+/// ImageHistogramUpdate recounts only the blocks in the dirty rectangle:
+/// it costs 1/8 byte per pixel.
+
+/// Count the pixels of img at each gray level.
+/// On failure, returns NULL and errno/errCause are set accordingly.
+Histogram ImageHistogram(Image img) ;
+
+/// Update h, the histogram of img before its pixels in the dirty rectangle
+/// changed (see ImageDirtyRect), to the histogram of img.
+/// Requires: img has the size it had when h was computed.
+void ImageHistogramUpdate(Image img, Histogram h) ;
+
+/// The counts of h: the number of pixels at each level 0..255.
+/// The result belongs to h.
+const uint32_t* HistogramCounts(Histogram h) ;
+
+/// The minimum and maximum gray levels counted in h, as ImageStats.
+/// With ImageHistogramUpdate, this keeps the stats of an image up to date
+/// at the cost of the pixels changed.
+void HistogramStats(Histogram h, uint8* min, uint8* max) ;
+
+/// Destroy the histogram pointed to by (*hp).
+/// Ensures: (*hp)==NULL.
+void HistogramDestroy(Histogram* hp) ;
+
 /// Filtering
 
 /// Blur an image by a applying a (2dx+1)x(2dy+1) mean filter.
 /// Each pixel is substituted by the mean of the pixels in the rectangle
 /// [x-dx, x+dx]x[y-dy, y+dy].
 /// The image is changed in-place.
+/// 3x3 and 5x5 filters (dx = dy = 1 or 2) take a faster path, with the
+/// same results.
+/// (If memory is exhausted, the image is left unchanged.)
 void ImageBlur(Image img, int dx, int dy) ;
 
+/// Blur img into a new image, as ImageBlur, leaving img unchanged.
+/// The integral image of img is kept (see ImageIntegral), so that blurring
+/// it again, with other dx, dy, costs just the new image.  (3x3 and 5x5
+/// filters need none: they are faster without it.)
+/// Success and failure as in ImageCreate.
+Image ImageBlurred(Image img, int dx, int dy) ;
+
+/// Update dst, the blur of src (with the same dx, dy) before its pixels in
+/// the dirty rectangle changed (see ImageDirtyRect), to the blur of src.
+/// Only the pixels of dst within (dx, dy) of that rectangle are recomputed,
+/// and marked dirty in dst.
+/// Requires: dst != src; both have the same size.
+/// Returns 1 on success, or 0 if memory is exhausted, in which case dst is
+/// not changed and errno/errCause are set accordingly.
+int ImageBlurUpdate(Image src, Image dst, int dx, int dy) ;
+
+/// Denoise an image by applying a (2dx+1)x(2dy+1) median filter.
+/// Each pixel is substituted by the median of the pixels in the rectangle
+/// [x-dx, x+dx]x[y-dy, y+dy] that lie inside the image (the lower median,
+/// if their number is even).  The time per pixel does not depend on dx, dy.
+/// The image is changed in-place.
+/// Requires: dx >= 0, 0 <= dy < 32768.
+/// Returns 1 on success, or 0 if memory is exhausted, in which case img is
+/// not changed and errno/errCause are set accordingly.
+int ImageMedian(Image img, int dx, int dy) ;
+
+/// Convolution
+
+/// Border policies: how ImageConvolve reads pixels outside the image.
+typedef enum {
+  BORDER_REPLICATE,  // as the nearest pixel inside:   a a | a b c | c c
+  BORDER_REFLECT,    // as mirrored about the edge:   b a | a b c | c b
+  BORDER_ZERO,       // as black:                     0 0 | a b c | 0 0
+} BorderMode;
+
+/// Convolve an image with a kw x kh integer kernel (kw, kh odd).
+/// Each pixel (x, y) is substituted by
+///   sum k[j*kw + i] * pixel(x + i - kw/2, y + j - kh/2),  0<=i<kw, 0<=j<kh
+/// divided by div (rounding halves up), plus bias, saturated to
+/// [0, maxval].  (The kernel is not flipped, as usual for image filters.)
+/// Kernels larger than 3x3 that are separable are detected and applied in
+/// two 1D passes; 3x3 kernels, and 5x5 ones that are not separable, use
+/// unrolled code.  Use bias to show signed results, such
+/// as gradients, around mid gray.
+/// The image is changed in-place.
+/// Requires: kw, kh odd and positive, div > 0.
+/// Returns 1 on success, or 0 if memory is exhausted, in which case img is
+/// not changed and errno/errCause are set accordingly.
+int ImageConvolve(Image img, int kw, int kh, const int kernel[], int div,
+                  int bias, BorderMode border) ;
+
+/// Convolve an image with the separable kernel k[j*kw + i] = kx[i]*ky[j].
+/// Otherwise, as ImageConvolve.
+int ImageConvolveSeparable(Image img, int kw, const int kx[], int kh, const int ky[],
+                           int div, int bias, BorderMode border) ;
+
+/// Morphology
+
+/// These functions apply a (2dx+1)x(2dy+1) rectangular structuring element
+/// to an image, changing it in-place.  The time per pixel does not depend
+/// on dx, dy.  Pixels outside the image are ignored, as in ImageBlur.
+/// Requires: dx >= 0, dy >= 0.
+/// Return 1 on success, or 0 if memory is exhausted, in which case img is
+/// not changed and errno/errCause are set accordingly.
+
+/// Erode an image: each pixel is substituted by the minimum of the pixels
+/// in the rectangle [x-dx, x+dx]x[y-dy, y+dy].
+int ImageErode(Image img, int dx, int dy) ;
+
+/// Dilate an image: each pixel is substituted by the maximum of the pixels
+/// in the rectangle [x-dx, x+dx]x[y-dy, y+dy].
+int ImageDilate(Image img, int dx, int dy) ;
+
 #endif
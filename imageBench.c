@@ -0,0 +1,458 @@
+// imageBench - A benchmark for the image8bit module.
+//
+// This program times every image8bit operation on deterministic synthetic
+// images of increasing size, to show how each one scales, and where it
+// falls off a cache-size cliff.  No image files are needed.
+//
+// You may freely use and modify this code, NO WARRANTY, blah blah,
+// as long as you give proper credit to the original and subsequent authors.
+
+#include <assert.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "bitmap.h"
+#include "error.h"
+#include "image8bit.h"
+#include "instrumentation.h"
+
+static const char* USAGE =
+    "USAGE: imageBench [OPTION...]\n"
+    "  Time image8bit operations on synthetic images of sizes from MIN^2\n"
+    "  to MAX^2 (doubling), and print median and 95th percentile times and\n"
+    "  throughput (MB/s of input pixels) for each operation and size.\n"
+    "\n"
+    "OPTIONS:\n"
+    "  --min N         Smallest image side (default 256)\n"
+    "  --max N         Largest image side (default 4096, up to 16384)\n"
+    "  --reps N        Timed repetitions per measurement (default 7)\n"
+    "  --warmup N      Untimed repetitions before those (default 1)\n"
+    "  --ops LIST      Only these operations (comma separated names)\n"
+    "  --tmp DIR       Directory for load/save temporary files (default /tmp)\n"
+    "  --gen DIR       Only write the synthetic images to DIR as PGM files\n"
+    "                  (templateN.pgm is the corner of noiseN.pgm, so try:\n"
+    "                  imageTool DIR/templateN.pgm DIR/noiseN.pgm locate)\n"
+    "  --save FILE     Save the results to FILE, as a baseline\n"
+    "  --compare FILE  Compare the results with the baseline in FILE, and\n"
+    "                  exit with status 4 if any operation got slower\n"
+    "  --tolerance PCT Slowdown allowed before it is a regression (default 10)\n"
+    "  --huge MB       Use huge pages for images of MB megabytes or more\n"
+    "                  (default 16; 0 turns them off, see ImageHugePages)\n"
+    "\n"
+    "  Baseline times are kept in Calibrated Time Units (see InstrGetCTU),\n"
+    "  so a baseline saved on one machine can be checked on another.\n"
+    "\n"
+    "IMAGES:\n"
+    "  noise           Uniformly distributed random levels\n"
+    "  gradient        Diagonal ramp from black to white\n"
+    "  uniform         All pixels at mid gray\n"
+    "  template        Noise, searched for its own bottom-right 32x32 corner\n"
+    ;
+
+/// Synthetic images
+
+// Kinds of synthetic image
+typedef enum { NOISE, GRADIENT, UNIFORM, TEMPLATE } Kind;
+
+static const char* kindName[] = { "noise", "gradient", "uniform", "template" };
+
+// Side of the template embedded in TEMPLATE images
+#define TSIZE 32
+
+// Deterministic pseudo-random generator (xorshift32), so that every run
+// benchmarks exactly the same pixels.
+static uint32_t rngState;
+
+static uint32_t rng(void) {
+  rngState ^= rngState << 13;
+  rngState ^= rngState >> 17;
+  rngState ^= rngState << 5;
+  return rngState;
+}
+
+// Create a synthetic w x h image of the given kind.
+// Returns NULL on failure (as ImageCreate).
+static Image Generate(Kind kind, int w, int h) {
+  Image img = ImageCreate(w, h, PixMax);
+  if (img == NULL) return NULL;
+  rngState = 2463534242u;
+  for (int y = 0; y < h; y++) {
+    for (int x = 0; x < w; x++) {
+      int level;
+      switch (kind) {
+      case GRADIENT: level = (int)((long)(x + y) * PixMax / (w + h - 1)); break;
+      case UNIFORM:  level = PixMax / 2; break;
+      default:       level = (int)(rng() >> 24); break;  // NOISE, TEMPLATE
+      }
+      ImageSetPixel(img, x, y, (uint8)level);
+    }
+  }
+  return img;
+}
+
+/// Operations
+
+typedef enum {
+  LOAD, SAVE, STATS, NEG, THR, BRI, MAP, ROTATE, MIRROR, CROP, PASTE, BLEND,
+  LOCATE, BLUR, RESIZE, HALVE, ZOOM, MEDIAN1, MEDIAN4, MEDIAN16, ERODE1, ERODE16,
+  SHARPEN, GAUSS5, GAUSS9, PACK, BLOCATE, TROTATE, TBLUR, NUMOPS
+} Op;
+
+static const struct {
+  const char* name;
+  Kind kind;      // image to run on
+  int inPlace;    // changes the image (so runs on a fresh copy)?
+  Layout layout;  // of the image (converted in a copy, unless raster)
+} ops[NUMOPS] = {
+  [LOAD]     = { "load",     NOISE,    0, LAYOUT_RASTER },
+  [SAVE]     = { "save",     NOISE,    0, LAYOUT_RASTER },
+  [STATS]    = { "stats",    GRADIENT, 0, LAYOUT_RASTER },
+  [NEG]      = { "neg",      NOISE,    1, LAYOUT_RASTER },
+  [THR]      = { "thr",      GRADIENT, 1, LAYOUT_RASTER },
+  [BRI]      = { "bri",      NOISE,    1, LAYOUT_RASTER },
+  [MAP]      = { "map",      NOISE,    1, LAYOUT_RASTER },
+  [ROTATE]   = { "rotate",   NOISE,    0, LAYOUT_RASTER },
+  [MIRROR]   = { "mirror",   NOISE,    0, LAYOUT_RASTER },
+  [CROP]     = { "crop",     NOISE,    0, LAYOUT_RASTER },
+  [PASTE]    = { "paste",    UNIFORM,  1, LAYOUT_RASTER },
+  [BLEND]    = { "blend",    UNIFORM,  1, LAYOUT_RASTER },
+  [LOCATE]   = { "locate",   TEMPLATE, 0, LAYOUT_RASTER },
+  [BLUR]     = { "blur",     NOISE,    1, LAYOUT_RASTER },
+  [RESIZE]   = { "resize",   NOISE,    0, LAYOUT_RASTER },   // area average to 3/10 size (thumbnail)
+  [HALVE]    = { "halve",    NOISE,    0, LAYOUT_RASTER },   // area average to 1/2 size (2x2 box)
+  [ZOOM]     = { "zoom",     NOISE,    0, LAYOUT_RASTER },   // bilinear to 3/2 size
+  [MEDIAN1]  = { "median1",  NOISE,    1, LAYOUT_RASTER },   // 3x3 median
+  [MEDIAN4]  = { "median4",  NOISE,    1, LAYOUT_RASTER },   // 9x9 median
+  [MEDIAN16] = { "median16", NOISE,    1, LAYOUT_RASTER },   // 33x33 median
+  [ERODE1]   = { "erode1",   NOISE,    1, LAYOUT_RASTER },   // 3x3 erosion
+  [ERODE16]  = { "erode16",  NOISE,    1, LAYOUT_RASTER },   // 33x33 erosion
+  [SHARPEN]  = { "sharpen",  NOISE,    1, LAYOUT_RASTER },   // 3x3 convolution
+  [GAUSS5]   = { "gauss5",   NOISE,    1, LAYOUT_RASTER },   // 5x5 convolution
+  [GAUSS9]   = { "gauss9",   NOISE,    1, LAYOUT_RASTER },   // 9x9 convolution, found separable
+  [PACK]     = { "pack",     NOISE,    0, LAYOUT_RASTER },   // threshold to a bitmap
+  [BLOCATE]  = { "blocate",  TEMPLATE, 0, LAYOUT_RASTER },   // locate, on thresholded bitmaps
+  [TROTATE]  = { "trotate",  NOISE,    0, LAYOUT_TILED  },   // rotate, in tiled layout
+  [TBLUR]    = { "tblur",    NOISE,    1, LAYOUT_TILED  },   // blur, in tiled layout
+};
+
+// Kernels for the convolutions
+static const int sharpen[9] = { 0, -1, 0,  -1, 5, -1,  0, -1, 0 };
+static const int binomial5[5] = { 1, 4, 6, 4, 1 };
+static const int binomial9[9] = { 1, 8, 28, 56, 70, 56, 28, 8, 1 };
+static int gauss5[25], gauss9[81];   // outer products of the binomials
+
+// Temporary file for load and save
+static char tmpName[1024];
+
+// Run operation op once on img (aux is a second image for paste, blend
+// and locate), and return the time it took, in seconds.
+// Setup work (copies of images that are changed in-place, files to load)
+// is done before the clock starts.  Returns a negative time on failure.
+static double RunOnce(Op op, Image img, Image aux) {
+  int w = ImageWidth(img);
+  int h = ImageHeight(img);
+  Image copy = NULL;   // fresh copy, for operations that change img
+  Image res = NULL;    // result of operations that create an image
+  uint8 min, max;
+  int x, y;
+  uint8 lut[PixMax + 1];
+  Bitmap bmp = NULL;   // bitmaps, for the bitmap operations
+  Bitmap bmp2 = NULL;
+
+  if (ops[op].inPlace || ops[op].layout != LAYOUT_RASTER) {
+    copy = ImageCrop(img, 0, 0, w, h);   // (a clone: copy its pixels now, untimed)
+    if (copy == NULL || !ImageUnshare(copy) || !ImageSetLayout(copy, ops[op].layout)) {
+      ImageDestroy(&copy);
+      return -1.0;
+    }
+  }
+  if (op == LOAD && ImageSave(img, tmpName) == 0) return -1.0;
+  if (op == MAP) {
+    for (int v = 0; v <= PixMax; v++) lut[v] = (uint8)(PixMax - v/2);
+  }
+  if (op == BLOCATE) {
+    bmp = BitmapFromImage(img, PixMax/2);
+    bmp2 = BitmapFromImage(aux, PixMax/2);
+    if (bmp == NULL || bmp2 == NULL) {
+      BitmapDestroy(&bmp);
+      BitmapDestroy(&bmp2);
+      return -1.0;
+    }
+  }
+
+  double t0 = wall_time();
+  switch (op) {
+  case LOAD:   res = ImageLoad(tmpName); break;
+  case SAVE:   if (ImageSave(img, tmpName) == 0) t0 = -1.0; break;
+  case STATS:  ImageStats(img, &min, &max); break;
+  case NEG:    ImageNegative(copy); break;
+  case THR:    ImageThreshold(copy, PixMax/2); break;
+  case BRI:    ImageBrighten(copy, 1.3); break;
+  case MAP:    ImageMapLevels(copy, lut); break;
+  case ROTATE: res = ImageRotate(img); break;
+  case MIRROR: res = ImageMirror(img); break;
+  case CROP:   res = ImageCrop(img, w/4, h/4, w/2, h/2); break;
+  case PASTE:  ImagePaste(copy, w/4, h/4, aux); break;
+  case BLEND:  ImageBlend(copy, w/4, h/4, aux, 0.33); break;
+  case LOCATE: if (!ImageLocateSubImage(img, &x, &y, aux)) t0 = -1.0; break;
+  case BLUR:   ImageBlur(copy, 7, 7); break;
+  case RESIZE: res = ImageResize(img, 3*w/10, 3*h/10, RESIZE_AREA); break;
+  case HALVE:  res = ImageResize(img, w/2, h/2, RESIZE_AREA); break;
+  case MEDIAN1:  if (!ImageMedian(copy, 1, 1)) t0 = -1.0; break;
+  case MEDIAN4:  if (!ImageMedian(copy, 4, 4)) t0 = -1.0; break;
+  case MEDIAN16: if (!ImageMedian(copy, 16, 16)) t0 = -1.0; break;
+  case ERODE1:   if (!ImageErode(copy, 1, 1)) t0 = -1.0; break;
+  case ERODE16:  if (!ImageErode(copy, 16, 16)) t0 = -1.0; break;
+  case SHARPEN:  if (!ImageConvolve(copy, 3, 3, sharpen, 1, 0, BORDER_REPLICATE)) t0 = -1.0; break;
+  case GAUSS5:   if (!ImageConvolve(copy, 5, 5, gauss5, 256, 0, BORDER_REPLICATE)) t0 = -1.0; break;
+  case GAUSS9:   if (!ImageConvolve(copy, 9, 9, gauss9, 65536, 0, BORDER_REPLICATE)) t0 = -1.0; break;
+  case ZOOM:   res = ImageResize(img, 3*w/2, 3*h/2, RESIZE_BILINEAR); break;
+  case PACK:     if ((bmp = BitmapFromImage(img, PixMax/2)) == NULL) t0 = -1.0; break;
+  case BLOCATE:  if (!BitmapLocateSubImage(bmp, &x, &y, bmp2)) t0 = -1.0; break;
+  case TROTATE:  res = ImageRotate(copy); break;
+  case TBLUR:    ImageBlur(copy, 7, 7); break;
+  case NUMOPS: break;
+  }
+  double t1 = wall_time();
+
+  int failed = t0 < 0.0 || ((op == LOAD || op == ROTATE || op == TROTATE || op == MIRROR || op == CROP ||
+                                op == RESIZE || op == HALVE || op == ZOOM) && res == NULL);
+  if (res != NULL) ImageDestroy(&res);
+  if (copy != NULL) ImageDestroy(&copy);
+  BitmapDestroy(&bmp);
+  BitmapDestroy(&bmp2);
+  return failed ? -1.0 : t1 - t0;
+}
+
+static int cmpDouble(const void* a, const void* b) {
+  double x = *(const double*)a, y = *(const double*)b;
+  return (x > y) - (x < y);
+}
+
+// Statistics of the repeated timings of one operation on one size
+typedef struct {
+  Op op;
+  int size;       // image side
+  int reps;       // timed repetitions
+  double median;  // seconds
+  double p95;     // seconds (95th percentile)
+  double mbps;    // MB/s of input pixels, at the median time
+} Result;
+
+// Time operation op on img: warmup untimed runs, then reps timed runs.
+// Returns 1 on success, and fills *r; returns 0 on failure.
+static int Measure(Op op, Image img, Image aux, int warmup, int reps, Result* r) {
+  double* t = malloc(reps*sizeof(double));
+  if (t == NULL) return 0;
+  int ok = 1;
+  for (int i = 0; i < warmup && ok; i++) ok = RunOnce(op, img, aux) >= 0.0;
+  for (int i = 0; i < reps && ok; i++) ok = (t[i] = RunOnce(op, img, aux)) >= 0.0;
+  if (ok) {
+    qsort(t, reps, sizeof(double), cmpDouble);
+    r->op = op;
+    r->size = ImageWidth(img);
+    r->reps = reps;
+    r->median = reps % 2 ? t[reps/2] : (t[reps/2 - 1] + t[reps/2]) / 2;
+    r->p95 = t[(int)(0.95*(reps - 1) + 0.5)];
+    double bytes = (double)ImageWidth(img) * ImageHeight(img);
+    r->mbps = r->median > 0.0 ? bytes / r->median / 1e6 : 0.0;
+  }
+  free(t);
+  return ok;
+}
+
+/// Baselines
+
+// Most results a run can have (sizes double from above TSIZE to 16384).
+#define MAXRESULTS (NUMOPS*10)
+
+// Save the n results in res to file name, with times in CTUs.
+// Returns 1 on success, 0 on failure (errno is set).
+static int SaveBaseline(const char* name, const Result res[], int n, double ctu) {
+  FILE* f = fopen(name, "w");
+  if (f == NULL) return 0;
+  fprintf(f, "# imageBench baseline: times in CTUs of %.6e s\n", ctu);
+  fprintf(f, "# op size reps median p95\n");
+  for (int i = 0; i < n; i++) {
+    fprintf(f, "%s %d %d %.6e %.6e\n", ops[res[i].op].name, res[i].size,
+            res[i].reps, res[i].median / ctu, res[i].p95 / ctu);
+  }
+  int ok = !ferror(f);
+  return fclose(f) == 0 && ok;
+}
+
+// Compare the n results in res with the baseline in file name, and print
+// the change of median time of each operation and size found in both.
+// A result more than tol (a fraction) slower than its baseline is a
+// regression.  Returns the number of regressions, or -1 on failure to
+// read the file (errno is set).
+static int CompareBaseline(const char* name, const Result res[], int n,
+                           double ctu, double tol) {
+  FILE* f = fopen(name, "r");
+  if (f == NULL) return -1;
+  int regressions = 0;
+  int compared = 0;
+  char line[256];
+  printf("# %-8s %6s %12s %12s %9s\n", "op", "size", "base_ctu", "new_ctu", "speedup");
+  while (fgets(line, sizeof(line), f) != NULL) {
+    char op[32];
+    int size, reps;
+    double median, p95;
+    if (line[0] == '#') continue;
+    if (sscanf(line, "%31s %d %d %lf %lf", op, &size, &reps, &median, &p95) != 5) continue;
+    for (int i = 0; i < n; i++) {
+      if (res[i].size != size || strcmp(ops[res[i].op].name, op) != 0) continue;
+      double now = res[i].median / ctu;
+      // speedup > 1 is faster than baseline, < 1 is slower
+      double speedup = now > 0.0 ? median / now : 1.0;
+      int slower = now > median * (1.0 + tol);
+      regressions += slower;
+      compared++;
+      printf("  %-8s %6d %12.4g %12.4g %8.2fx%s\n", op, size, median, now, speedup,
+             slower ? "  REGRESSION" : "");
+    }
+  }
+  int failed = ferror(f);
+  fclose(f);
+  if (failed) return -1;
+  printf("# %d of %d compared results regressed by more than %g%%\n",
+         regressions, compared, 100.0*tol);
+  return regressions;
+}
+
+// Is op selected by the comma separated list of names (NULL: all)?
+static int Selected(const char* list, Op op) {
+  if (list == NULL) return 1;
+  size_t len = strlen(ops[op].name);
+  for (const char* s = list; s != NULL; s = strchr(s, ',')) {
+    if (*s == ',') s++;
+    if (strncmp(s, ops[op].name, len) == 0 && (s[len] == ',' || s[len] == '\0'))
+      return 1;
+  }
+  return 0;
+}
+
+int main(int ac, char* av[]) {
+  program_name = av[0];
+  int minSize = 256, maxSize = 4096;
+  int reps = 7, warmup = 1;
+  const char* only = NULL;
+  const char* tmpDir = "/tmp";
+  const char* genDir = NULL;
+  const char* saveName = NULL;
+  const char* compareName = NULL;
+  double tolerance = 10.0;   // percent
+  int huge = 16;             // MB
+
+  for (int k = 1; k < ac; k++) {
+    const char* opt = av[k];
+    if (strcmp(opt, "--help") == 0) {
+      printf("%s", USAGE);
+      return 0;
+    }
+    if (k + 1 >= ac) error(1, 0, "Missing operand to %s\n%s", opt, USAGE);
+    const char* arg = av[++k];
+    int ok = 1;
+    if (strcmp(opt, "--min") == 0) ok = sscanf(arg, "%d", &minSize) == 1 && minSize > TSIZE;
+    else if (strcmp(opt, "--max") == 0) ok = sscanf(arg, "%d", &maxSize) == 1 && maxSize <= 16384;
+    else if (strcmp(opt, "--reps") == 0) ok = sscanf(arg, "%d", &reps) == 1 && reps > 0;
+    else if (strcmp(opt, "--warmup") == 0) ok = sscanf(arg, "%d", &warmup) == 1 && warmup >= 0;
+    else if (strcmp(opt, "--ops") == 0) only = arg;
+    else if (strcmp(opt, "--tmp") == 0) tmpDir = arg;
+    else if (strcmp(opt, "--gen") == 0) genDir = arg;
+    else if (strcmp(opt, "--save") == 0) saveName = arg;
+    else if (strcmp(opt, "--compare") == 0) compareName = arg;
+    else if (strcmp(opt, "--tolerance") == 0) ok = sscanf(arg, "%lf", &tolerance) == 1 && tolerance >= 0.0;
+    else if (strcmp(opt, "--huge") == 0) ok = sscanf(arg, "%d", &huge) == 1 && huge >= 0;
+    else error(5, 0, "Unknown option %s\n%s", opt, USAGE);
+    if (!ok) error(5, 0, "Invalid operand to %s: %s", opt, arg);
+  }
+
+  ImageInit();
+  ImageHugePages((size_t)huge << 20, 0);
+  for (int j = 0; j < 9; j++)
+    for (int i = 0; i < 9; i++) {
+      gauss9[9*j + i] = binomial9[j]*binomial9[i];
+      if (i < 5 && j < 5) gauss5[5*j + i] = binomial5[j]*binomial5[i];
+    }
+  snprintf(tmpName, sizeof(tmpName), "%s/imageBench.%d.pgm", tmpDir, (int)getpid());
+
+  if (genDir != NULL) {
+    // Write the synthetic images, and the template searched for.
+    for (int size = minSize; size <= maxSize; size *= 2) {
+      for (Kind kind = NOISE; kind <= TEMPLATE; kind++) {
+        char name[1024];
+        Image img = Generate(kind, size, size);
+        if (img == NULL) error(2, errno, "Generating %s %d: %s", kindName[kind], size, ImageErrMsg());
+        snprintf(name, sizeof(name), "%s/%s%d.pgm", genDir, kindName[kind], size);
+        if (kind == TEMPLATE) {
+          Image t = ImageCrop(img, size - TSIZE, size - TSIZE, TSIZE, TSIZE);
+          if (t == NULL) error(2, errno, "Generating template: %s", ImageErrMsg());
+          ImageDestroy(&img);
+          img = t;
+        }
+        if (ImageSave(img, name) == 0) error(2, errno, "%s: %s", name, ImageErrMsg());
+        fprintf(stderr, "Wrote %s\n", name);
+        ImageDestroy(&img);
+      }
+    }
+    return 0;
+  }
+
+  Result* results = malloc(MAXRESULTS*sizeof(Result));
+  if (results == NULL) error(2, errno, "Allocating results");
+  int nresults = 0;
+
+  printf("# kernels: %s\n", ImageKernels());
+  printf("# %-8s %-9s %6s %5s %12s %12s %10s\n",
+         "op", "image", "size", "reps", "median_ms", "p95_ms", "MB/s");
+  for (int size = minSize; size <= maxSize; size *= 2) {
+    Image img[TEMPLATE + 1] = { NULL };
+    Image half = NULL;   // noise image of half size, for paste and blend
+    Image tmpl = NULL;   // bottom-right corner of the template image
+    for (Op op = 0; op < NUMOPS; op++) {
+      if (!Selected(only, op)) continue;
+      Kind kind = ops[op].kind;
+      // Generate the images needed (once per size).
+      if (img[kind] == NULL && (img[kind] = Generate(kind, size, size)) == NULL)
+        error(2, errno, "Generating %s %d: %s", kindName[kind], size, ImageErrMsg());
+      if ((op == PASTE || op == BLEND) && half == NULL &&
+          (half = Generate(NOISE, size/2, size/2)) == NULL)
+        error(2, errno, "Generating noise %d: %s", size/2, ImageErrMsg());
+      if ((op == LOCATE || op == BLOCATE) && tmpl == NULL &&
+          (tmpl = ImageCrop(img[kind], size - TSIZE, size - TSIZE, TSIZE, TSIZE)) == NULL)
+        error(2, errno, "Generating template: %s", ImageErrMsg());
+      Image aux = op == LOCATE || op == BLOCATE ? tmpl : half;
+
+      Result r = { 0 };
+      if (!Measure(op, img[kind], aux, warmup, reps, &r))
+        error(3, errno, "Benchmarking %s on %dx%d: %s", ops[op].name, size, size, ImageErrMsg());
+      printf("  %-8s %-9s %6d %5d %12.4f %12.4f %10.1f\n", ops[op].name, kindName[kind],
+             r.size, r.reps, 1e3*r.median, 1e3*r.p95, r.mbps);
+      fflush(stdout);
+      assert(nresults < MAXRESULTS);
+      results[nresults++] = r;
+    }
+    for (Kind kind = NOISE; kind <= TEMPLATE; kind++) ImageDestroy(&img[kind]);
+    ImageDestroy(&half);
+    ImageDestroy(&tmpl);
+  }
+  remove(tmpName);
+
+  int status = 0;
+  if (saveName != NULL || compareName != NULL) {
+    double ctu = InstrGetCTU();
+    if (compareName != NULL) {
+      int regressions = CompareBaseline(compareName, results, nresults, ctu, tolerance/100.0);
+      if (regressions < 0) error(2, errno, "Reading baseline %s", compareName);
+      if (regressions > 0) status = 4;
+    }
+    // Save after comparing, so that a baseline can be checked and renewed.
+    if (saveName != NULL && !SaveBaseline(saveName, results, nresults, ctu))
+      error(2, errno, "Saving baseline %s", saveName);
+  }
+  free(results);
+  return status;
+}
@@ -15,12 +15,803 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
+#include "bitmap.h"
 #include "image8bit.h"
 #include "instrumentation.h"
 
+// Checks: imageTest --check [NAME...] runs the named checks (or all),
+// on synthetic images, and exits with status 1 if any fails.
+// Each compares an operation with a reference computed pixel by pixel,
+// or with an equivalent operation that takes another path.
+
+static int failures = 0;   // failed conditions, in all checks
+
+static void fail(const char* cond, int line) {
+  fprintf(stderr, "imageTest.c:%d: check failed: %s\n", line, cond);
+  failures++;
+}
+
+#define CHECK(cond) ((cond) ? (void)0 : fail(#cond, __LINE__))
+
+// The image, or exit if it is NULL (out of memory).
+static Image need(Image img) {
+  if (img == NULL) error(2, errno, "Creating image: %s", ImageErrMsg());
+  return img;
+}
+
+// A w x h image of pseudo-random levels (the same for the same seed).
+static Image noise(int w, int h, unsigned seed) {
+  Image img = need(ImageCreate(w, h, 255));
+  for (int y = 0; y < h; y++)
+    for (int x = 0; x < w; x++) {
+      seed = seed*1103515245u + 12345u;
+      ImageSetPixel(img, x, y, (uint8)(seed >> 24));
+    }
+  return img;
+}
+
+// Do a and b have the same size, maxval and pixels?
+static int same(Image a, Image b) {
+  if (ImageWidth(a) != ImageWidth(b) || ImageHeight(a) != ImageHeight(b) ||
+      ImageMaxval(a) != ImageMaxval(b)) return 0;
+  for (int y = 0; y < ImageHeight(a); y++)
+    for (int x = 0; x < ImageWidth(a); x++)
+      if (ImageGetPixel(a, x, y) != ImageGetPixel(b, x, y)) return 0;
+  return 1;
+}
+
+// A copy of img, with an array of its own.
+static Image copy(Image img) {
+  Image c = need(ImageCrop(img, 0, 0, ImageWidth(img), ImageHeight(img)));
+  if (!ImageUnshare(c)) error(2, errno, "Copying image: %s", ImageErrMsg());
+  return c;
+}
+
+static void checkResize(void) {
+  Image img = noise(37, 22, 1);
+  Image view = need(ImageRotate(img));
+  Image flat = copy(view);
+  int w = ImageWidth(img), h = ImageHeight(img);
+  // Nearest: the source pixel under the center.
+  Image r = need(ImageResize(img, 80, 9, RESIZE_NEAREST));
+  for (int y = 0; y < 9; y++)
+    for (int x = 0; x < 80; x++)
+      CHECK(ImageGetPixel(r, x, y) ==
+            ImageGetPixel(img, (2*x + 1)*w/(2*80), (2*y + 1)*h/(2*9)));
+  ImageDestroy(&r);
+  // Exact halving: the rounded mean of each 2x2 block, in both modes.
+  Image even = need(ImageCrop(img, 1, 0, 36, 22));
+  for (ResizeMode mode = RESIZE_BILINEAR; mode <= RESIZE_AREA; mode++) {
+    r = need(ImageResize(even, 18, 11, mode));
+    for (int y = 0; y < 11; y++)
+      for (int x = 0; x < 18; x++) {
+        int s = ImageGetPixel(even, 2*x, 2*y) + ImageGetPixel(even, 2*x + 1, 2*y) +
+                ImageGetPixel(even, 2*x, 2*y + 1) + ImageGetPixel(even, 2*x + 1, 2*y + 1);
+        CHECK(ImageGetPixel(r, x, y) == (s + 2)/4);
+      }
+    ImageDestroy(&r);
+  }
+  ImageDestroy(&even);
+  // Any mode keeps a uniform image uniform, and the same size unchanged.
+  Image gray = need(ImageCreate(13, 7, 255));
+  ImageThreshold(gray, 0);
+  ImageBrighten(gray, 0.5);
+  for (ResizeMode mode = RESIZE_NEAREST; mode <= RESIZE_AREA; mode++) {
+    uint8 lo, hi;
+    r = need(ImageResize(gray, 31, 5, mode));
+    ImageStats(r, &lo, &hi);
+    CHECK(lo == 128 && hi == 128);
+    ImageDestroy(&r);
+    r = need(ImageResize(img, w, h, mode));
+    CHECK(same(r, img));
+    ImageDestroy(&r);
+  }
+  ImageDestroy(&gray);
+  // A view (see ImageRotate) resizes as its copy, and is not changed.
+  for (ResizeMode mode = RESIZE_NEAREST; mode <= RESIZE_AREA; mode++) {
+    Image r1 = need(ImageResize(view, 15, 50, mode));
+    Image r2 = need(ImageResize(flat, 15, 50, mode));
+    CHECK(same(r1, r2));
+    ImageDestroy(&r1);
+    ImageDestroy(&r2);
+  }
+  CHECK(same(view, flat));
+  ImageDestroy(&flat);
+  ImageDestroy(&view);
+  ImageDestroy(&img);
+}
+
+// The lower median of the levels of img in [x-dx, x+dx]x[y-dy, y+dy]
+// (clipped to the image).
+static int medianAt(Image img, int x, int y, int dx, int dy) {
+  int hist[256] = { 0 }, n = 0;
+  for (int j = y - dy; j <= y + dy; j++)
+    for (int i = x - dx; i <= x + dx; i++)
+      if (ImageValidPos(img, i, j)) {
+        hist[ImageGetPixel(img, i, j)]++;
+        n++;
+      }
+  int v = 0;
+  for (int below = 0; below + hist[v] <= (n - 1)/2; v++) below += hist[v];
+  return v;
+}
+
+static void checkMedian(void) {
+  static const int window[][2] = { {0, 0}, {1, 1}, {2, 1}, {0, 3}, {7, 7}, {40, 2} };
+  Image img = noise(29, 17, 2);
+  for (int k = 0; k < 6; k++) {
+    int dx = window[k][0], dy = window[k][1];
+    Image m = copy(img);
+    CHECK(ImageMedian(m, dx, dy));
+    int ok = 1;
+    for (int y = 0; y < 17; y++)
+      for (int x = 0; x < 29; x++)
+        ok &= ImageGetPixel(m, x, y) == medianAt(img, x, y, dx, dy);
+    CHECK(ok);
+    ImageDestroy(&m);
+  }
+  // A clone is not changed, and neither is an array in huge pages.
+  Image c = need(ImageClone(img));
+  Image m = copy(img);
+  CHECK(ImageMedian(m, 1, 1) && ImageMedian(c, 1, 1));
+  CHECK(same(c, m));
+  CHECK(!same(c, img));
+  ImageHugePages(1, 0);
+  Image big = noise(300, 200, 3);
+  Image bigRef = copy(big);
+  CHECK(ImageMedian(big, 2, 2));
+  int ok = 1;
+  for (int y = 0; y < 200; y += 7)
+    for (int x = 0; x < 300; x += 7)
+      ok &= ImageGetPixel(big, x, y) == medianAt(bigRef, x, y, 2, 2);
+  CHECK(ok);
+  ImageHugePages(16 << 20, 0);
+  ImageDestroy(&big);
+  ImageDestroy(&bigRef);
+  ImageDestroy(&m);
+  ImageDestroy(&c);
+  ImageDestroy(&img);
+}
+
+// The minimum (max = 0) or maximum (max = 1) level of img in
+// [x-dx, x+dx]x[y-dy, y+dy] (clipped to the image).
+static int extremeAt(Image img, int x, int y, int dx, int dy, int max) {
+  int v = max ? 0 : 255;
+  for (int j = y - dy; j <= y + dy; j++)
+    for (int i = x - dx; i <= x + dx; i++)
+      if (ImageValidPos(img, i, j)) {
+        int p = ImageGetPixel(img, i, j);
+        if (max ? p > v : p < v) v = p;
+      }
+  return v;
+}
+
+static void checkMorph(void) {
+  static const int window[][2] = { {0, 0}, {1, 0}, {0, 2}, {3, 3}, {5, 1}, {30, 20} };
+  Image img = noise(27, 19, 4);
+  for (int k = 0; k < 6; k++) {
+    int dx = window[k][0], dy = window[k][1];
+    for (int max = 0; max <= 1; max++) {
+      Image m = copy(img);
+      CHECK(max ? ImageDilate(m, dx, dy) : ImageErode(m, dx, dy));
+      int ok = 1;
+      for (int y = 0; y < 19; y++)
+        for (int x = 0; x < 27; x++)
+          ok &= ImageGetPixel(m, x, y) == extremeAt(img, x, y, dx, dy, max);
+      CHECK(ok);
+      ImageDestroy(&m);
+    }
+  }
+  // Erosion and dilation of a mirrored view, and its mirror image, agree.
+  Image view = need(ImageMirror(img));
+  Image m = copy(img);
+  CHECK(ImageErode(view, 2, 1) && ImageErode(m, 2, 1));
+  Image back = need(ImageMirror(view));
+  CHECK(same(back, m));
+  ImageDestroy(&back);
+  ImageDestroy(&m);
+  ImageDestroy(&view);
+  ImageDestroy(&img);
+}
+
+// The level of img at (x, y), for the border policy if outside (-1: zero).
+static int borderAt(Image img, int x, int y, BorderMode border) {
+  int w = ImageWidth(img), h = ImageHeight(img);
+  if (!ImageValidPos(img, x, y)) {
+    if (border == BORDER_ZERO) return 0;
+    if (border == BORDER_REPLICATE) {
+      x = x < 0 ? 0 : x >= w ? w - 1 : x;
+      y = y < 0 ? 0 : y >= h ? h - 1 : y;
+    } else {
+      x = ((x % (2*w)) + 2*w) % (2*w);
+      y = ((y % (2*h)) + 2*h) % (2*h);
+      if (x >= w) x = 2*w - 1 - x;
+      if (y >= h) y = 2*h - 1 - y;
+    }
+  }
+  return ImageGetPixel(img, x, y);
+}
+
+// Does img2 hold the convolution of img1 (see ImageConvolve)?
+static int convolved(Image img1, Image img2, int kw, int kh, const int k[],
+                     int div, int bias, BorderMode border) {
+  for (int y = 0; y < ImageHeight(img1); y++)
+    for (int x = 0; x < ImageWidth(img1); x++) {
+      long s = div/2;
+      for (int j = 0; j < kh; j++)
+        for (int i = 0; i < kw; i++)
+          s += k[j*kw + i]*borderAt(img1, x + i - kw/2, y + j - kh/2, border);
+      long v = (s >= 0 ? s/div : -((div - 1 - s)/div)) + bias;
+      v = v < 0 ? 0 : v > ImageMaxval(img1) ? ImageMaxval(img1) : v;
+      if (ImageGetPixel(img2, x, y) != v) return 0;
+    }
+  return 1;
+}
+
+static void checkConvolve(void) {
+  static const int k1[] = { 3 };
+  static const int k3[] = { -1, 0, 1, -2, 0, 2, -1, 0, 1 };    // sobel x
+  static const int k5[25] = { 1, 2, 3, 2, 1, 0, 0, 4, 0, 0, -1, -1, 9, -1, -1,
+                              2, 0, 0, 0, 2, 1, 1, 1, 1, 1 };  // not separable
+  static const int kx[] = { 1, 4, 6, 4, 1 }, ky[] = { 1, 2, 1 };
+  int ksep[15], k73[21];
+  for (int j = 0; j < 3; j++)
+    for (int i = 0; i < 5; i++) ksep[5*j + i] = kx[i]*ky[j];  // separable 5x3
+  for (int i = 0; i < 21; i++) k73[i] = (i*7) % 5 - 2;        // 7x3, not separable
+  static const struct { int kw, kh; int div, bias; } cases[] = {
+    { 1, 1, 2, 0 }, { 3, 3, 1, 128 }, { 5, 5, 13, 0 }, { 5, 3, 64, 0 }, { 7, 3, 3, 100 },
+  };
+  const int* kernel[] = { k1, k3, k5, ksep, k73 };
+  Image img = noise(23, 14, 5);
+  for (BorderMode border = BORDER_REPLICATE; border <= BORDER_ZERO; border++) {
+    for (int c = 0; c < 5; c++) {
+      Image r = copy(img);
+      CHECK(ImageConvolve(r, cases[c].kw, cases[c].kh, kernel[c], cases[c].div,
+                          cases[c].bias, border));
+      CHECK(convolved(img, r, cases[c].kw, cases[c].kh, kernel[c], cases[c].div,
+                      cases[c].bias, border));
+      ImageDestroy(&r);
+    }
+    Image r = copy(img);
+    CHECK(ImageConvolveSeparable(r, 5, kx, 3, ky, 64, 0, border));
+    CHECK(convolved(img, r, 5, 3, ksep, 64, 0, border));
+    ImageDestroy(&r);
+  }
+  // A kernel larger than the image reflects more than once.
+  Image tiny = noise(3, 2, 6);
+  Image r = copy(tiny);
+  CHECK(ImageConvolve(r, 7, 3, k73, 3, 100, BORDER_REFLECT));
+  CHECK(convolved(tiny, r, 7, 3, k73, 3, 100, BORDER_REFLECT));
+  ImageDestroy(&r);
+  ImageDestroy(&tiny);
+  ImageDestroy(&img);
+}
+
+static void checkBitmap(void) {
+  Image img = noise(150, 40, 7);
+  Bitmap bmp = BitmapFromImage(img, 100);
+  CHECK(bmp != NULL && BitmapWidth(bmp) == 150 && BitmapHeight(bmp) == 40);
+  if (bmp == NULL) {
+    ImageDestroy(&img);
+    return;
+  }
+  // Bits as ImageThreshold sets pixels.
+  Image thr = copy(img);
+  ImageThreshold(thr, 100);
+  long count = 0;
+  int ok = 1;
+  for (int y = 0; y < 40; y++)
+    for (int x = 0; x < 150; x++) {
+      ok &= BitmapGetBit(bmp, x, y) == (ImageGetPixel(thr, x, y) != 0);
+      count += BitmapGetBit(bmp, x, y);
+    }
+  CHECK(ok);
+  CHECK(BitmapCount(bmp) == count);
+  Image back = BitmapToImage(bmp, 255);
+  CHECK(back != NULL && same(back, thr));
+  ImageDestroy(&back);
+
+  // PBM: saved and loaded back, with 1 for black.
+  char name[64];
+  snprintf(name, sizeof(name), "/tmp/imageTest.%d.pbm", (int)getpid());
+  CHECK(BitmapSave(bmp, name));
+  Bitmap loaded = BitmapLoad(name);
+  FILE* f = fopen(name, "rb");
+  int w = 0, h = 0;
+  CHECK(f != NULL && fscanf(f, "P4 %d %d", &w, &h) == 2 && fgetc(f) != EOF);
+  CHECK(w == 150 && h == 40);
+  int byte = f != NULL ? fgetc(f) : EOF;
+  CHECK(byte != EOF && (byte >> 7) == !BitmapGetBit(bmp, 0, 0));
+  if (f != NULL) fclose(f);
+  unlink(name);
+  CHECK(loaded != NULL);
+  if (loaded != NULL) {
+    ok = 1;
+    for (int y = 0; y < 40; y++)
+      for (int x = 0; x < 150; x++) ok &= BitmapGetBit(loaded, x, y) == BitmapGetBit(bmp, x, y);
+    CHECK(ok);
+    BitmapDestroy(&loaded);
+  }
+
+  // Combine, bit by bit, at a position that is not word aligned.
+  Image img2 = noise(70, 9, 8);
+  Bitmap bmp2 = BitmapFromImage(img2, 128);
+  CHECK(bmp2 != NULL);
+  for (BitOp op = BIT_AND; bmp2 != NULL && op <= BIT_XOR; op++) {
+    Bitmap c = BitmapFromImage(img, 100);
+    CHECK(c != NULL);
+    if (c == NULL) break;
+    BitmapCombine(c, 71, 13, bmp2, op);
+    ok = 1;
+    for (int y = 0; y < 40; y++)
+      for (int x = 0; x < 150; x++) {
+        int a = BitmapGetBit(bmp, x, y), r = a;
+        if (x >= 71 && x < 71 + 70 && y >= 13 && y < 13 + 9) {
+          int b = BitmapGetBit(bmp2, x - 71, y - 13);
+          r = op == BIT_AND ? a & b : op == BIT_OR ? a | b : a ^ b;
+        }
+        ok &= BitmapGetBit(c, x, y) == r;
+      }
+    CHECK(ok);
+    BitmapDestroy(&c);
+  }
+
+  // Locate a part of the bitmap, not word aligned.
+  Image part = need(ImageCrop(img, 77, 21, 60, 12));
+  Bitmap sub = BitmapFromImage(part, 100);
+  int px = -1, py = -1;
+  CHECK(sub != NULL && BitmapLocateSubImage(bmp, &px, &py, sub));
+  CHECK(px == 77 && py == 21);
+  CHECK(sub != NULL && BitmapMatchSubImage(bmp, 77, 21, sub) && !BitmapMatchSubImage(bmp, 78, 21, sub));
+  BitmapDestroy(&sub);
+  ImageDestroy(&part);
+  BitmapDestroy(&bmp2);
+  ImageDestroy(&img2);
+  ImageDestroy(&thr);
+  BitmapDestroy(&bmp);
+  ImageDestroy(&img);
+}
+
+// A copy of img in layout.
+static Image inLayout(Image img, Layout layout) {
+  Image c = copy(img);
+  if (!ImageSetLayout(c, layout)) error(2, errno, "Converting image: %s", ImageErrMsg());
+  return c;
+}
+
+static void checkTiled(void) {
+  // Sizes that end in partial tiles.
+  Image img = noise(150, 90, 9);
+  Image small = noise(70, 33, 10);
+  Image t = inLayout(img, LAYOUT_TILED);
+  CHECK(ImageLayout(t) == LAYOUT_TILED && same(t, img));
+  Image r = inLayout(t, LAYOUT_RASTER);
+  CHECK(ImageLayout(r) == LAYOUT_RASTER && same(r, img));
+  ImageDestroy(&r);
+
+  // Rows, stats and saved files as the raster image.
+  uint8 row1[150], row2[150], lo1, hi1, lo2, hi2;
+  ImageGetRow(img, 77, row1);
+  ImageGetRow(t, 77, row2);
+  CHECK(memcmp(row1, row2, 150) == 0);
+  ImageStats(img, &lo1, &hi1);
+  ImageStats(t, &lo2, &hi2);
+  CHECK(lo1 == lo2 && hi1 == hi2);
+  char name[64];
+  snprintf(name, sizeof(name), "/tmp/imageTest.%d.pgm", (int)getpid());
+  CHECK(ImageSave(t, name));
+  Image loaded = ImageLoad(name);
+  unlink(name);
+  CHECK(loaded != NULL && same(loaded, img));
+  ImageDestroy(&loaded);
+
+  // Each operation on a tiled image gives the result of the raster one.
+  for (int op = 0; op < 9; op++) {
+    Image a = copy(img), b = inLayout(img, LAYOUT_TILED);
+    Image sa = inLayout(small, LAYOUT_TILED), sb = copy(small);
+    Image ra = NULL, rb = NULL;
+    switch (op) {
+    case 0: ImageNegative(a); ImageNegative(b); break;
+    case 1: ImageThreshold(a, 90); ImageThreshold(b, 90); break;
+    case 2: ImageBrighten(a, 1.7); ImageBrighten(b, 1.7); break;
+    case 3: ra = ImageRotate(a); rb = ImageRotate(b); break;
+    case 4: ra = ImageMirror(a); rb = ImageMirror(b); break;
+    case 5: ra = ImageCrop(a, 60, 30, 80, 50); rb = ImageCrop(b, 60, 30, 80, 50); break;
+    case 6: ImagePaste(a, 63, 50, sa); ImagePaste(b, 63, 50, sb); break;
+    case 7: ImageBlend(a, 65, 1, sa, 0.3); ImageBlend(b, 65, 1, sb, 0.3); break;
+    case 8: ImageBlur(a, 3, 2); ImageBlur(b, 3, 2); break;
+    }
+    if (op >= 3 && op <= 5) {
+      CHECK(ra != NULL && rb != NULL && same(ra, rb));
+      CHECK(rb == NULL || ImageLayout(rb) == LAYOUT_TILED);
+    } else {
+      CHECK(same(a, b));
+    }
+    CHECK(ImageLayout(b) == LAYOUT_TILED);
+    ImageDestroy(&ra); ImageDestroy(&rb);
+    ImageDestroy(&sa); ImageDestroy(&sb);
+    ImageDestroy(&a); ImageDestroy(&b);
+  }
+
+  ImageDestroy(&t);
+  ImageDestroy(&small);
+  ImageDestroy(&img);
+}
+
+static void checkStream(void) {
+  Image frame[3] = { noise(31, 17, 11), noise(31, 17, 12), noise(8, 40, 13) };
+  FILE* f = tmpfile();
+  CHECK(f != NULL);
+  if (f == NULL) return;
+  for (int k = 0; k < 3; k++) CHECK(ImageWriteStream(f, frame[k]));
+  rewind(f);
+  // Frames of the same size reuse the image; a clone of it keeps its frame.
+  Image img = NULL, clone = NULL;
+  for (int k = 0; k < 3; k++) {
+    CHECK(ImageReadStream(f, &img) == 1);
+    CHECK(img != NULL && same(img, frame[k]));
+    if (clone != NULL) CHECK(same(clone, frame[k-1]));
+    ImageDestroy(&clone);
+    if (img != NULL) clone = need(ImageClone(img));
+  }
+  CHECK(ImageReadStream(f, &img) == 0);
+  fclose(f);
+  // A truncated frame fails.
+  f = tmpfile();
+  CHECK(f != NULL);
+  if (f != NULL) {
+    fputs("P5\n4 4\n255\n012345", f);
+    rewind(f);
+    CHECK(ImageReadStream(f, &img) == -1);
+    fclose(f);
+  }
+  ImageDestroy(&clone);
+  ImageDestroy(&img);
+  for (int k = 0; k < 3; k++) ImageDestroy(&frame[k]);
+}
+
+// Does h count the levels of img?
+static int counts(Histogram h, Image img) {
+  uint32_t ref[256] = { 0 };
+  for (int y = 0; y < ImageHeight(img); y++)
+    for (int x = 0; x < ImageWidth(img); x++) ref[ImageGetPixel(img, x, y)]++;
+  return memcmp(ref, HistogramCounts(h), sizeof(ref)) == 0;
+}
+
+static void checkDirty(void) {
+  Image img = noise(150, 130, 14);
+  int x, y, w, h;
+  CHECK(ImageDirtyRect(img, &x, &y, &w, &h));   // (set by noise)
+  ImageClearDirty(img);
+  CHECK(!ImageDirtyRect(img, &x, &y, &w, &h));
+  Histogram hist = ImageHistogram(img);
+  CHECK(hist != NULL && counts(hist, img));
+  if (hist == NULL) {
+    ImageDestroy(&img);
+    return;
+  }
+  Image blur = need(ImageBlurred(img, 2, 1));
+  ImageClearDirty(img);
+
+  // Two edits: the dirty rectangle bounds both.
+  ImageSetPixel(img, 70, 3, 0);
+  Image patch = noise(10, 20, 15);
+  ImagePaste(img, 100, 60, patch);
+  CHECK(ImageDirtyRect(img, &x, &y, &w, &h));
+  CHECK(x == 70 && y == 3 && w == 40 && h == 77);
+
+  // Incremental results equal those computed again.
+  ImageHistogramUpdate(img, hist);
+  CHECK(counts(hist, img));
+  uint8 lo1, hi1, lo2, hi2;
+  HistogramStats(hist, &lo1, &hi1);
+  ImageStats(img, &lo2, &hi2);
+  CHECK(lo1 == lo2 && hi1 == hi2);
+  CHECK(ImageBlurUpdate(img, blur, 2, 1));
+  Image ref = copy(img);
+  ImageBlur(ref, 2, 1);
+  CHECK(same(blur, ref));
+  ImageClearDirty(img);
+  CHECK(!ImageDirtyRect(img, &x, &y, &w, &h));
+
+  // A whole-image operation dirties all, and updates still agree.
+  ImageNegative(img);
+  CHECK(ImageDirtyRect(img, &x, &y, &w, &h) && x == 0 && y == 0 && w == 150 && h == 130);
+  ImageHistogramUpdate(img, hist);
+  CHECK(counts(hist, img));
+  CHECK(ImageBlurUpdate(img, blur, 2, 1));
+  ImageDestroy(&ref);
+  ref = copy(img);
+  ImageBlur(ref, 2, 1);
+  CHECK(same(blur, ref));
+
+  ImageDestroy(&ref);
+  ImageDestroy(&patch);
+  ImageDestroy(&blur);
+  HistogramDestroy(&hist);
+  ImageDestroy(&img);
+}
+
+static void checkClone(void) {
+  Image img = noise(90, 70, 16);
+  Image ref = copy(img);
+  Image small = noise(20, 10, 17);
+  static const int k3[] = { 1, 2, 1, 2, 4, 2, 1, 2, 1 };
+  uint8 lut[256], row[90];
+  for (int v = 0; v < 256; v++) lut[v] = (uint8)(v/3);
+  memset(row, 7, sizeof(row));
+  // Each change, to the clone or to the original, leaves the other alone.
+  for (int op = 0; op < 14; op++) {
+    for (int which = 0; which < 2; which++) {
+      Image c = need(ImageClone(img));
+      CHECK(same(c, img));
+      Image target = which == 0 ? c : img;
+      Image other = which == 0 ? img : c;
+      switch (op) {
+      case 0: ImageNegative(target); break;
+      case 1: ImageThreshold(target, 100); break;
+      case 2: ImageBrighten(target, 0.5); break;
+      case 3: ImageMapLevels(target, lut); break;
+      case 4: ImagePaste(target, 5, 5, small); break;
+      case 5: ImageBlend(target, 5, 5, small, 0.5); break;
+      case 6: ImageBlur(target, 1, 1); break;
+      case 7: CHECK(ImageMedian(target, 1, 1)); break;
+      case 8: CHECK(ImageErode(target, 1, 1)); break;
+      case 9: CHECK(ImageConvolve(target, 3, 3, k3, 16, 0, BORDER_ZERO)); break;
+      case 10: ImageSetPixel(target, 3, 4, (uint8)(ImageGetPixel(target, 3, 4) + 1)); break;
+      case 11: ImageSetRow(target, 9, row); break;
+      case 12: CHECK(ImageSetLayout(target, LAYOUT_TILED)); ImageNegative(target); break;
+      case 13: CHECK(ImageUnshare(target)); ImageNegative(target); break;
+      }
+      CHECK(!same(target, other));
+      CHECK(same(other, ref));
+      ImageDestroy(&c);
+      if (which == 1) {   // restore img
+        ImageDestroy(&img);
+        img = copy(ref);
+      }
+    }
+  }
+  // Clones outlive the original, and clones of clones share too.
+  Image c1 = need(ImageClone(img));
+  Image c2 = need(ImageClone(c1));
+  Image whole = need(ImageCrop(img, 0, 0, 90, 70));
+  ImageDestroy(&img);
+  CHECK(same(c1, ref) && same(c2, ref) && same(whole, ref));
+  ImageNegative(c2);
+  CHECK(same(c1, ref) && same(whole, ref));
+  ImageDestroy(&c1);
+  ImageDestroy(&whole);
+  ImageNegative(c2);
+  CHECK(same(c2, ref));
+  ImageDestroy(&c2);
+  ImageDestroy(&small);
+  ImageDestroy(&ref);
+}
+
+// Rotated (rotate = 1) or mirrored copy of img, pixel by pixel.
+static Image turned(Image img, int rotate) {
+  int w = ImageWidth(img), h = ImageHeight(img);
+  Image r = need(rotate ? ImageCreate(h, w, 255) : ImageCreate(w, h, 255));
+  for (int y = 0; y < h; y++)
+    for (int x = 0; x < w; x++) {
+      if (rotate) ImageSetPixel(r, y, w - 1 - x, ImageGetPixel(img, x, y));
+      else ImageSetPixel(r, w - 1 - x, y, ImageGetPixel(img, x, y));
+    }
+  return r;
+}
+
+static void checkViews(void) {
+  Image img = noise(45, 26, 18);
+  Image ref0 = copy(img);
+  Image small = noise(9, 5, 19);
+  char name[64];
+  snprintf(name, sizeof(name), "/tmp/imageTest.%d.pgm", (int)getpid());
+  // Every chain of up to 4 rotations (bit 1) and mirrors (bit 0).
+  for (int n = 1; n <= 4; n++) {
+    for (int bits = 0; bits < (1 << n); bits++) {
+      Image view = copy(img), ref = copy(img);
+      for (int k = 0; k < n; k++) {
+        int rotate = (bits >> k) & 1;
+        Image v = need(rotate ? ImageRotate(view) : ImageMirror(view));
+        Image r = turned(ref, rotate);
+        ImageDestroy(&view);
+        ImageDestroy(&ref);
+        view = v;
+        ref = r;
+      }
+      CHECK(same(view, ref));
+      int w = ImageWidth(ref), h = ImageHeight(ref);
+
+      // Reads through the view: rows, stats, crops, saved files, search.
+      uint8 row1[45], row2[45], lo1, hi1, lo2, hi2;
+      ImageGetRow(view, h - 1, row1);
+      ImageGetRow(ref, h - 1, row2);
+      CHECK(memcmp(row1, row2, w) == 0);
+      ImageStats(view, &lo1, &hi1);
+      ImageStats(ref, &lo2, &hi2);
+      CHECK(lo1 == lo2 && hi1 == hi2);
+      Image c1 = need(ImageCrop(view, 3, 2, w - 7, h - 5));
+      Image c2 = need(ImageCrop(ref, 3, 2, w - 7, h - 5));
+      CHECK(same(c1, c2));
+      Image part = need(ImageCrop(ref, w - 14, h - 9, 10, 6));
+      int px = -1, py = -1;
+      CHECK(ImageLocateSubImage(view, &px, &py, part) && px == w - 14 && py == h - 9);
+      CHECK(ImageMatchSubImage(c1, w - 17, h - 11, part));
+      ImageDestroy(&part);
+      ImageDestroy(&c2);
+      ImageDestroy(&c1);
+      CHECK(ImageSave(view, name));
+      Image loaded = ImageLoad(name);
+      CHECK(loaded != NULL && same(loaded, ref));
+      ImageDestroy(&loaded);
+
+      // Writes through the view, and filters, leave the original alone.
+      ImageSetPixel(view, 1, 2, 0);
+      ImageSetPixel(ref, 1, 2, 0);
+      ImagePaste(view, 4, 3, small);
+      ImagePaste(ref, 4, 3, small);
+      ImageBlend(view, w - 9, h - 5, small, 0.25);
+      ImageBlend(ref, w - 9, h - 5, small, 0.25);
+      CHECK(same(view, ref));
+      ImageBlur(view, 2, 1);
+      ImageBlur(ref, 2, 1);
+      CHECK(same(view, ref));
+      CHECK(same(img, ref0));
+      ImageDestroy(&view);
+      ImageDestroy(&ref);
+    }
+  }
+  unlink(name);
+  ImageDestroy(&small);
+  ImageDestroy(&ref0);
+  ImageDestroy(&img);
+}
+
+// Does img2 hold the (2dx+1)x(2dy+1) mean of img1 (see ImageBlur)?
+static int blurred(Image img1, Image img2, int dx, int dy) {
+  for (int y = 0; y < ImageHeight(img1); y++)
+    for (int x = 0; x < ImageWidth(img1); x++) {
+      int s = 0, n = 0;
+      for (int j = y - dy; j <= y + dy; j++)
+        for (int i = x - dx; i <= x + dx; i++)
+          if (ImageValidPos(img1, i, j)) {
+            s += ImageGetPixel(img1, i, j);
+            n++;
+          }
+      if (ImageGetPixel(img2, x, y) != (2*s + n)/(2*n)) return 0;
+    }
+  return 1;
+}
+
+static void checkBlur(void) {
+  static const int window[][2] = { {1, 1}, {2, 2}, {0, 0}, {1, 2}, {2, 1}, {3, 3}, {0, 4} };
+  // All small sizes (narrower and lower than the window, too), and one
+  // larger, with the 3x3 and 5x5 paths and the general one.
+  for (int size = 0; size < 50; size++) {
+    int w = size < 49 ? 1 + size % 7 : 131, h = size < 49 ? 1 + size / 7 : 77;
+    Image img = noise(w, h, 20 + size);
+    for (int k = 0; k < 7; k++) {
+      int dx = window[k][0], dy = window[k][1];
+      Image b = copy(img);
+      ImageBlur(b, dx, dy);
+      CHECK(blurred(img, b, dx, dy));
+      Image c = need(ImageBlurred(img, dx, dy));
+      CHECK(same(c, b));
+      ImageDestroy(&c);
+      ImageDestroy(&b);
+    }
+    ImageDestroy(&img);
+  }
+  // Saturated levels: the column sums of the 5x5 path must not overflow.
+  Image white = need(ImageCreate(70, 300, 255));
+  ImageThreshold(white, 0);
+  Image b = copy(white);
+  ImageBlur(b, 2, 2);
+  CHECK(same(b, white));
+  ImageDestroy(&b);
+  ImageDestroy(&white);
+}
+
+// A w x h image of level v.
+static Image level(int w, int h, uint8 v) {
+  Image img = need(ImageCreate(w, h, 255));
+  for (int y = 0; y < h; y++)
+    for (int x = 0; x < w; x++) ImageSetPixel(img, x, y, v);
+  return img;
+}
+
+static void checkBlend(void) {
+  // Known results, with alpha inside and outside [0, 1].  The first one
+  // comes out 126 if the blend is contracted into an FMA instruction.
+  static const struct { uint8 dst, src; double alpha; uint8 result; } cases[] = {
+    { 110, 160, 0.33, 127 }, { 0, 255, 0.5, 128 }, { 10, 20, 1.0, 20 },
+    { 37, 91, 0.0, 37 }, { 200, 100, 2.5, 0 }, { 100, 200, 2.5, 255 },
+  };
+  for (int c = 0; c < (int)(sizeof(cases)/sizeof(cases[0])); c++) {
+    // Odd sizes and position, so that rows end in partial chunks.
+    Image img = level(203, 5, cases[c].dst);
+    Image src = level(150, 3, cases[c].src);
+    ImageBlend(img, 7, 1, src, cases[c].alpha);
+    int ok = 1;
+    for (int y = 0; y < 5; y++)
+      for (int x = 0; x < 203; x++) {
+        int in = x >= 7 && x < 157 && y >= 1 && y < 4;
+        ok &= ImageGetPixel(img, x, y) == (in ? cases[c].result : cases[c].dst);
+      }
+    CHECK(ok);
+    ImageDestroy(&src);
+    ImageDestroy(&img);
+  }
+}
+
+static void checkBrighten(void) {
+  static const double factor[] = { 0.0, 0.6, 1.0, 1.3, 3.7 };
+  Image img = noise(203, 37, 12);
+  for (int k = 0; k < 5; k++) {
+    Image b = copy(img);
+    ImageBrighten(b, factor[k]);
+    // Rounded, and saturated at maxval.
+    int ok = 1;
+    for (int y = 0; y < 37; y++)
+      for (int x = 0; x < 203; x++) {
+        double v = ImageGetPixel(img, x, y)*factor[k] + 0.5;
+        ok &= ImageGetPixel(b, x, y) == (v < 255 ? (int)v : 255);
+      }
+    CHECK(ok);
+    ImageDestroy(&b);
+  }
+  ImageDestroy(&img);
+}
+
+static const struct {
+  const char* name;
+  void (*run)(void);
+} checks[] = {
+  { "resize", checkResize },
+  { "median", checkMedian },
+  { "morph", checkMorph },
+  { "convolve", checkConvolve },
+  { "bitmap", checkBitmap },
+  { "tiled", checkTiled },
+  { "stream", checkStream },
+  { "dirty", checkDirty },
+  { "clone", checkClone },
+  { "views", checkViews },
+  { "blur", checkBlur },
+  { "blend", checkBlend },
+  { "brighten", checkBrighten },
+};
+
+#define NUMCHECKS (int)(sizeof(checks)/sizeof(checks[0]))
+
+// Run the checks named in names[0..n-1], or all if n == 0.
+static int runChecks(int n, char* names[]) {
+  for (int k = 0; k < n; k++) {
+    int found = 0;
+    for (int c = 0; c < NUMCHECKS; c++) found |= strcmp(names[k], checks[c].name) == 0;
+    if (!found) error(1, 0, "Unknown check: %s", names[k]);
+  }
+  for (int c = 0; c < NUMCHECKS; c++) {
+    int run = n == 0;
+    for (int k = 0; k < n; k++) run |= strcmp(names[k], checks[c].name) == 0;
+    if (!run) continue;
+    int before = failures;
+    checks[c].run();
+    printf("# check %-10s %s\n", checks[c].name, failures == before ? "ok" : "FAILED");
+  }
+  return failures == 0 ? 0 : 1;
+}
+
 int main(int argc, char* argv[]) {
+  if (argc >= 2 && strcmp(argv[1], "--check") == 0) {
+    ImageInit();
+    return runChecks(argc - 2, argv + 2);
+  }
   if (argc != 3) {
-    error(1, 0, "Usage: imageTest input.pgm output.pgm");
+    error(1, 0, "Usage: imageTest input.pgm output.pgm\n"
+                "       imageTest --check [NAME...]");
   }
 
   ImageInit();
@@ -17,10 +17,17 @@
 #include <assert.h>
 
 #include "image8bit.h"
+#include "batch.h"
 #include "instrumentation.h"
+#include "pipeline.h"
+#include "server.h"
 
 static const char* USAGE =
-    "USAGE: imageTool [FILE...] [OPERATION [OPERAND...]]\n"
+    "USAGE: imageTool [OPTION...] [FILE...] [OPERATION [OPERAND...]]\n"
+    "       imageTool --batch DIR [OPTION...] FILE... -- [OPERATION [OPERAND...]]\n"
+    "       imageTool --frames [OPTION...] [OPERATION [OPERAND...]] <IN >OUT\n"
+    "       imageTool --serve SOCKET [--workers N] [--cache MB]\n"
+    "       imageTool --connect SOCKET [--explain] [FILE...] [OPERATION [OPERAND...]]\n"
     "  Apply pipeline of image processing operations to PGM files.\n"
     "  Arguments are processed from left to right and may be\n"
     "  FILES, OPERATIONS, or OPERANDS to operations.\n"
@@ -29,10 +36,46 @@ static const char* USAGE =
     "  The last image in the buffer is called the current image CURR and its\n"
     "  predecessor is PRED.\n"
     "  Most operations apply to CURR and some also use PRED.\n"
+    "  The whole pipeline is read and optimized before it runs: only the\n"
+    "  operations needed by save, info and locate, or timed by tic/toc, are\n"
+    "  executed, crops are done before point operations, and point operations\n"
+    "  are fused.\n"
+    "\n"
+    "OPTIONS:\n"
+    "  --explain       Print the optimized plan instead of running it\n"
+    "  --calibrate     Measure the calibrated time unit again (see toc)\n"
+    "  --perf          Add hardware counters (cycles, cache misses...) to toc\n"
+    "  --huge MB       Use huge pages for images of MB megabytes or more\n"
+    "                  (default 16; 0 turns them off)\n"
+    "  --hugetlb       Try pages reserved for huge pages first (see\n"
+    "                  /proc/sys/vm/nr_hugepages)\n"
+    "  --profile FILE  Record time and counters of each operation run in FILE,\n"
+    "                  as JSON lines if FILE ends in .json or .jsonl, else CSV\n"
+    "  --script FILE   Read pipeline words from FILE, before the remaining\n"
+    "                  arguments (words are separated by blanks, and a word\n"
+    "                  starting with # comments out the rest of the line)\n"
+    "  --batch DIR     Apply the pipeline to each FILE before --, in turn:\n"
+    "                  it starts with the FILE image as I0, and CURR is saved\n"
+    "                  to DIR, with the same name.  Files are loaded ahead and\n"
+    "                  saved behind, in other threads, while images are processed\n"
+    "  --depth N       Images loaded ahead, and waiting to be saved (default 4)\n"
+    "  --frames        Apply the pipeline to each PGM image (frame) read from\n"
+    "                  standard input, in turn: it starts with the frame as I0,\n"
+    "                  and CURR is written to standard output (so info and\n"
+    "                  locate should not be used)\n"
+    "  --serve SOCKET  Run as a server on Unix domain socket SOCKET: run the\n"
+    "                  pipelines sent by clients, keeping loaded images cached\n"
+    "  --workers N     Pipelines the server runs at the same time (default 4)\n"
+    "  --cache MB      Megabytes of images the server keeps cached (default 256)\n"
+    "  --connect SOCKET  Send the pipeline to the server on SOCKET to run,\n"
+    "                  and print its results (file names are relative to the\n"
+    "                  current directory, as usual)\n"
     "\n"
     "FILES:\n"
     "  Currently, only image files in 8-bit raw PGM format are accepted.\n"
     "  Input file names must be distinct from operation names.\n"
+    "  shm:/NAME names an image in shared memory, to hand it over to another\n"
+    "  process: loading maps it without copying, and saving replaces it.\n"
     "\n"
     "OPERATIONS:\n"
     "  FILE            Load PGM image file, creating new image\n"
@@ -49,6 +92,7 @@ static const char* USAGE =
     "  rotate          Rotate CURR 90º counter-clockwise, creating new image\n"
     "  mirror          Mirror CURR left-to-right, creating new image\n"
     "  crop X,Y,W,H    Crop a rectangle from CURR, creating new image\n"
+    "  resize W,H[,MODE] Resize CURR to WxH pixels, creating new image\n"
     "\n"              
     "  paste X,Y       Paste PRED into CURR at position (X,Y)\n"
     "  blend X,Y,alpha Blend PRED into CURR at position (X,Y) with given alpha\n"
@@ -56,34 +100,54 @@ static const char* USAGE =
     "  locate          Search PRED in CURR, print matching position, or NOTFOUND\n"
     "\n"              
     "  blur DX,DY      blur CURR using (2DX+1)x(2Dy+1) mean filter\n"
+    "  median DX,DY    denoise CURR using (2DX+1)x(2DY+1) median filter\n"
+    "  conv KERNEL[,BORDER] convolve CURR with KERNEL\n"
+    "\n"
+    "  erode DX,DY     minimum of CURR over (2DX+1)x(2DY+1) rectangles\n"
+    "  dilate DX,DY    maximum of CURR over (2DX+1)x(2DY+1) rectangles\n"
+    "  open DX,DY      erode, then dilate CURR (removes small bright spots)\n"
+    "  close DX,DY     dilate, then erode CURR (fills small dark holes)\n"
     "\n"              
     "OPERANDS:\n"     
     "  X,Y             Pixel coordinates: 0,0 is top left corner\n"
     "  DX,DY           Displacement\n"
     "  W,H             Width and height of image or rectangular region\n"
     "  alpha           Blending factor\n"
+    "  MODE            Resampling: nearest, bilinear (default) or area\n"
+    "  KERNEL          sharpen, laplacian, sobelx, sobely, gauss3, gauss5, or a\n"
+    "                  file with: WIDTH HEIGHT DIVISOR BIAS and the weights\n"
+    "  BORDER          Pixels outside: replicate (default), reflect or zero\n"
     "\n"
     ;
 
-static char* errors[] = {
-  "Success",
-  "Insufficient operands",
-  "Insufficient images",
-  "Image buffer is full",
-  "Image8bit failure: %s",
-  "Invalid operand",
-  "Invalid rect (overflow)",
-  "Invalid alpha",
-};
-
-
 // This program strives for correctness and robustness.
 // You may want to temporarily comment out operand validation, namely
 // precondition checks, so that you can force precondition violations, and
 // observe the effect of assertions.
 //
 // Also, the program does not test every module function, but you may easily
-// add new operations for that purpose.
+// add new operations for that purpose (see pipeline.c).
+
+// Apply template p to each frame read from stdin, writing results to stdout.
+// The frame buffer is reused: pipelines that work in place, and keep the
+// frame size, do not allocate an image per frame.
+// Returns 0 on success, or a nonzero error code (see PipelineErrMsg).
+static int runFrames(Pipeline p) {
+  Image frame = NULL;
+  int err = 0;
+  int rc;
+  for (int n = 0; err == 0 && (rc = ImageReadStream(stdin, &frame)) != 0; n++) {
+    if (rc < 0) {
+      err = 4;
+    } else if ((err = PipelineRunOn(p, &frame)) == 0) {
+      // Flush each frame, so that the next process gets it right away.
+      if (ImageWriteStream(stdout, frame) == 0 || fflush(stdout) != 0) err = 4;
+    }
+    if (err != 0) fprintf(stderr, "Failed on frame %d\n", n);
+  }
+  ImageDestroy(&frame);
+  return err;
+}
 
 int main(int ac, char* av[]) {
   program_name = av[0];
@@ -91,138 +155,167 @@ int main(int ac, char* av[]) {
     error(5, 0, "\n%s", USAGE);
   }
 
-  ImageInit();
-
   int err = 0;
-  int x, y, w, h;
-
-  // The image buffer
-  const int N = 10;   // buffer capacity
-  Image img[N];     // the images
-  int n = 0;          // number of images created
+  int explain = 0;
+  int perf = 0;
+  char* profile = NULL;   // file to record operations in
+  char** script = NULL;   // words read from script file
+  int nscript = 0;
+  char* batch = NULL;     // output directory, in batch mode
+  int depth = 4;          // queue depth, in batch mode
+  int frames = 0;         // process frames from stdin to stdout?
+  char* serve = NULL;     // socket to serve on
+  char* server = NULL;    // socket of the server to send the pipeline to
+  int workers = 4;        // threads of the server
+  int cache = 256;        // MB of images cached by the server
+  int huge = 16;          // MB of an image backed by huge pages
+  int hugetlb = 0;        // use reserved huge pages?
 
+  // Options come before the pipeline
   int k = 1;
-  while (k < ac) {
-    if (strcmp(av[k], "info") == 0) {
-      if (n < 1) { err = 2; break; }
-      fprintf(stderr, "Info on I%d\n", n-1);
-      uint8 min, max;
-      w = ImageWidth(img[n-1]);
-      h = ImageHeight(img[n-1]);
-      uint8 maxval = ImageMaxval(img[n-1]);
-      ImageStats(img[n-1], &min, &max);
-      printf("# Size: %dx%d\n# Maxval: %hhu\n", w, h, maxval);
-      printf("# Gray level range: [%hhu, %hhu]\n", min, max);
-    } else if (strcmp(av[k], "tic") == 0) {
-      InstrReset();
-    } else if (strcmp(av[k], "toc") == 0) {
-      InstrPrint();
-    } else if (strcmp(av[k], "neg") == 0) {
-      if (n < 1) { err = 2; break; }
-      fprintf(stderr, "Negating I%d\n", n-1);
-      ImageNegative(img[n-1]);
-    } else if (strcmp(av[k], "thr") == 0) {
-      if (++k >= ac) { err = 1; break; }
-      if (n < 1) { err = 2; break; }
-      uint8 thr;
-      if (sscanf(av[k], "%hhu", &thr) != 1) { err = 5; break; }
-      fprintf(stderr, "Thresholding I%d at %d\n", n-1, thr);
-      ImageThreshold(img[n-1], (uint8)thr);
-    } else if (strcmp(av[k], "bri") == 0) {
-      if (++k >= ac) { err = 1; break; }
-      if (n < 1) { err = 2; break; }
-      double factor;
-      if (sscanf(av[k], "%lf", &factor) != 1) { err = 5; break; }
-      fprintf(stderr, "Brightening I%d by %lf\n", n-1, factor);
-      ImageBrighten(img[n-1], factor);
-    } else if (strcmp(av[k], "create") == 0) {
-      if (++k >= ac) { err = 1; break; }
-      if (n >= N) { err = 3; break; }
-      if (sscanf(av[k], "%d,%d", &w, &h) != 2) { err = 5; break; }
-      if (w < 0 || h < 0) { err = 5; break; }   // precondition check!
-      fprintf(stderr, "Creating black image (%d,%d) -> I%d\n", w, h, n);
-      img[n] = ImageCreate(w, h, PixMax);
-      if (img[n] == NULL) { err = 4; break; }
-      n++;
-    } else if (strcmp(av[k], "rotate") == 0) {
-      if (n < 1) { err = 2; break; }
-      if (n >= N) { err = 3; break; }
-      fprintf(stderr, "Rotating I%d -> I%d\n", n-1, n);
-      img[n] = ImageRotate(img[n-1]);
-      if (img[n] == NULL) { err = 4; break; }
-      n++;
-    } else if (strcmp(av[k], "mirror") == 0) {
-      if (n < 1) { err = 2; break; }
-      if (n >= N) { err = 3; break; }
-      fprintf(stderr, "Mirroring I%d -> I%d\n", n-1, n);
-      img[n] = ImageMirror(img[n-1]);
-      if (img[n] == NULL) { err = 4; break; }
-      n++;
-    } else if (strcmp(av[k], "crop") == 0) {
-      if (++k >= ac) { err = 1; break; }
-      if (n < 1) { err = 2; break; }
-      if (n >= N) { err = 3; break; }
-      if (sscanf(av[k], "%d,%d,%d,%d", &x, &y, &w, &h) != 4) { err = 5; break; }
-      if (!ImageValidRect(img[n-1], x, y, w, h)) { err = 5; break; }   // precondition check!
-      fprintf(stderr, "Cropping I%d (%d,%d,%d,%d) -> I%d\n", n-1, x, y, w, h, n);
-      img[n] = ImageCrop(img[n-1], x, y, w, h);
-      if (img[n] == NULL) { err = 4; break; }
-      n++;
-    } else if (strcmp(av[k], "paste") == 0) {
-      if (++k >= ac) { err = 1; break; }
-      if (n < 2) { err = 2; break; }
-      if (sscanf(av[k], "%d,%d", &x, &y) != 2) { err = 5; break; }
-      w = ImageWidth(img[n-2]);
-      h = ImageHeight(img[n-2]);
-      if (!ImageValidRect(img[n-1], x, y, w, h)) { err = 6; break; }
-      fprintf(stderr, "Pasting I%d at I%d (%d,%d)\n", n-2, n-1, x, y);
-      ImagePaste(img[n-1], x, y, img[n-2]);
-    } else if (strcmp(av[k], "blend") == 0) {
-      if (++k >= ac) { err = 1; break; }
-      if (n < 2) { err = 2; break; }
-      double alpha;
-      if (sscanf(av[k], "%d,%d,%lf", &x, &y, &alpha) != 3) { err = 5; break; }
-      w = ImageWidth(img[n-2]);
-      h = ImageHeight(img[n-2]);
-      if (!ImageValidRect(img[n-1], x, y, w, h)) { err = 6; break; }
-      fprintf(stderr, "Blending I%d with I%d@(%d,%d) with alpha=%.3f\n", n-2, n-1, x, y, alpha);
-      ImageBlend(img[n-1], x, y, img[n-2], alpha);
-    } else if (strcmp(av[k], "locate") == 0) {
-      if (n < 2) { err = 2; break; }
-      fprintf(stderr, "Locating I%d in I%d\n", n-2, n-1);
-      if (ImageLocateSubImage(img[n-1], &x, &y, img[n-2])) {
-        printf("# FOUND (%d,%d)\n", x, y);
-      } else {
-        printf("# NOTFOUND\n");
-      }
-    } else if (strcmp(av[k], "blur") == 0) {
-      if (++k >= ac) { err = 1; break; }
-      if (n < 1) { err = 2; break; }
-      int dx; int dy;
-      if (sscanf(av[k], "%d,%d", &dx, &dy) != 2) { err = 5; break; }
-      fprintf(stderr, "Blur I%d with %dx%d mean filter\n", n-1, 2*dx+1, 2*dy+1);
-      ImageBlur(img[n-1], dx, dy);
-    } else if (strcmp(av[k], "save") == 0) {
-      if (++k >= ac) { err = 1; break; }
-      if (n < 1) { err = 2; break; }
-      fprintf(stderr, "Saving %s <- I%d\n", av[k], n-1);
-      if (ImageSave(img[n-1], av[k]) == 0) { err = 4; break; }
-    } else {  // image file
-      if (n >= N) { err = 3; break; }
-      fprintf(stderr, "Loading %s -> I%d\n", av[k], n);
-      img[n] = ImageLoad(av[k]);
-      if (img[n] == NULL) { err = 4; break; }
-      n++;
+  while (k < ac && strncmp(av[k], "--", 2) == 0) {
+    if (strcmp(av[k], "--explain") == 0) {
+      explain = 1;
+    } else if (strcmp(av[k], "--calibrate") == 0) {
+      InstrCalibrate();   // and update the cached CTU
+    } else if (strcmp(av[k], "--perf") == 0) {
+      perf = 1;
+    } else if (strcmp(av[k], "--profile") == 0) {
+      if (++k >= ac) { error(1, 0, "Missing profile file"); }
+      profile = av[k];
+    } else if (strcmp(av[k], "--script") == 0) {
+      if (++k >= ac) { error(1, 0, "Missing script file"); }
+      free(script);
+      script = PipelineReadScript(av[k], &nscript);
+      if (script == NULL) { error(8, errno, "%s", av[k]); }
+    } else if (strcmp(av[k], "--batch") == 0) {
+      if (++k >= ac) { error(1, 0, "Missing batch directory"); }
+      batch = av[k];
+    } else if (strcmp(av[k], "--huge") == 0) {
+      if (++k >= ac) { error(1, 0, "Missing huge page threshold"); }
+      if (sscanf(av[k], "%d", &huge) != 1 || huge < 0) { error(5, 0, "Invalid huge page threshold %s", av[k]); }
+    } else if (strcmp(av[k], "--hugetlb") == 0) {
+      hugetlb = 1;
+    } else if (strcmp(av[k], "--serve") == 0) {
+      if (++k >= ac) { error(1, 0, "Missing server socket"); }
+      serve = av[k];
+    } else if (strcmp(av[k], "--connect") == 0) {
+      if (++k >= ac) { error(1, 0, "Missing server socket"); }
+      server = av[k];
+    } else if (strcmp(av[k], "--workers") == 0) {
+      if (++k >= ac) { error(1, 0, "Missing workers"); }
+      if (sscanf(av[k], "%d", &workers) != 1 || workers <= 0) { error(5, 0, "Invalid workers %s", av[k]); }
+    } else if (strcmp(av[k], "--cache") == 0) {
+      if (++k >= ac) { error(1, 0, "Missing cache size"); }
+      if (sscanf(av[k], "%d", &cache) != 1 || cache < 0) { error(5, 0, "Invalid cache size %s", av[k]); }
+    } else if (strcmp(av[k], "--frames") == 0) {
+      frames = 1;
+    } else if (strcmp(av[k], "--depth") == 0) {
+      if (++k >= ac) { error(1, 0, "Missing depth"); }
+      if (sscanf(av[k], "%d", &depth) != 1 || depth <= 0) { error(5, 0, "Invalid depth %s", av[k]); }
+    } else {
+      error(5, 0, "Unknown option %s\n%s", av[k], USAGE);
     }
     k++;
   }
-  
-  // Destroy remaining images
-  while (n > 0) {
-    ImageDestroy(&img[--n]);
+
+  if ((batch != NULL) + frames + (serve != NULL) + (server != NULL) > 1) {
+    error(5, 0, "Options --batch, --frames, --serve and --connect exclude each other");
+  }
+
+  // In batch mode, the input files come first, up to --
+  int nfiles = 0;
+  char** files = av + k;
+  if (batch != NULL) {
+    while (k < ac && strcmp(av[k], "--") != 0) k++;
+    if (k == ac) { error(1, 0, "Missing -- after batch files"); }
+    nfiles = k++ - (files - av);
   }
 
-  error(err, errno, errors[err], ImageErrMsg());
+  // The pipeline words: script first, then remaining arguments
+  int nwords = nscript + (ac - k);
+  char** words = malloc((nwords + 1)*sizeof(char*));
+  if (words == NULL) { error(4, errno, "Out of memory"); }
+  for (int i = 0; i < nscript; i++) words[i] = script[i];
+  for (int i = k; i < ac; i++) words[nscript + i - k] = av[i];
+  words[nwords] = NULL;
+
+  // A client only sends the words (after --explain, if given) to the server.
+  if (server != NULL) {
+    const char* cause = NULL;
+    char** request = malloc((nwords + 2)*sizeof(char*));
+    if (request == NULL) { error(4, errno, "Out of memory"); }
+    request[0] = "--explain";
+    memcpy(request + 1, words, (nwords + 1)*sizeof(char*));
+    err = ServerRequest(server, nwords + explain, request + !explain, &cause);
+    free(request);
+    free(words);
+    free(script);
+    error(err, errno, PipelineErrMsg(err), cause);
+    return 0;
+  }
+
+  // Batch results go to DIR/NAME, for each input file .../NAME
+  char** outs = NULL;
+  if (batch != NULL) {
+    outs = calloc(nfiles + 1, sizeof(char*));
+    if (outs == NULL) { error(4, errno, "Out of memory"); }
+    for (int i = 0; i < nfiles; i++) {
+      const char* name = strrchr(files[i], '/');
+      name = name != NULL ? name + 1 : files[i];
+      outs[i] = malloc(strlen(batch) + strlen(name) + 2);
+      if (outs[i] == NULL) { error(4, errno, "Out of memory"); }
+      sprintf(outs[i], "%s/%s", batch, name);
+    }
+  }
+
+  ImageInit();
+  ImageHugePages((size_t)huge << 20, hugetlb);
+  if (serve != NULL) {
+    const char* cause;
+    err = ServerRun(serve, workers, (size_t)cache << 20, &cause);
+    error(err, errno, PipelineErrMsg(err), cause);
+  }
+  if (perf && InstrPerfOpen() == 0) {
+    error(0, errno, "Hardware counters not available (see perf_event_paranoid)");
+    errno = 0;
+  }
+
+  FILE* prof = NULL;
+  if (profile != NULL && !explain && (prof = fopen(profile, "w")) == NULL) {
+    error(4, errno, "%s", profile);
+  }
+
+  Pipeline p = batch != NULL || frames ? PipelineParseTemplate(nwords, words, &err)
+                             : PipelineParse(nwords, words, &err);
+  const char* cause = NULL;   // error cause, if not ImageErrMsg()
+  if (p != NULL) {
+    PipelineOptimize(p);
+    if (explain) {
+      PipelineExplain(p, stdout);
+    } else {
+      const char* ext = strrchr(profile != NULL ? profile : "", '.');
+      int json = ext != NULL && (strcmp(ext, ".json") == 0 || strcmp(ext, ".jsonl") == 0);
+      PipelineProfile(p, prof, json);
+      InstrReset();   // so hardware events (if any) start counting
+      if (batch != NULL) {
+        int failed;
+        err = BatchRun(p, nfiles, files, outs, depth, &failed, &cause);
+        if (err != 0 && failed >= 0) fprintf(stderr, "Failed on %s\n", files[failed]);
+      } else if (frames) {
+        err = runFrames(p);
+      } else {
+        err = PipelineRun(p);
+      }
+    }
+    PipelineDestroy(&p);
+  }
+  if (prof != NULL) fclose(prof);
+  for (int i = 0; i < nfiles; i++) free(outs[i]);
+  free(outs);
+  free(words);
+  free(script);
+
+  error(err, errno, PipelineErrMsg(err), cause != NULL ? cause : ImageErrMsg());
   return 0;
 }
-
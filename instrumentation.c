@@ -9,30 +9,37 @@
 /// // Name the counters you're going to use: 
 /// InstrName[0] = "memops";
 /// InstrName[1] = "adds";
-/// InstrCalibrate();  // Call once, to measure CTU
+/// InstrCalibrate();  // Optional: InstrPrint calibrates when first needed
 /// ...
 /// InstrReset();  // reset to zero
 /// for (...) {
-///   InstrCount[0] += 3;  // to count array acesses
-///   InstrCount[1] += 1;  // to count addition
 ///   a[k] = a[i] + a[j];
 /// }
+/// InstrAdd(0, 3*n);  // to count array acesses (once, not in the loop!)
+/// InstrAdd(1, n);    // to count additions
 /// InstrPrint();  // to show time and counters
 
 #include "instrumentation.h"
+#include <stdatomic.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 /// Cpu time in seconds
 double cpu_time(void) ; ///
 
+/// Wall clock time in seconds
+double wall_time(void) ; ///
+
 #if defined(__linux__) || defined(__APPLE__)
 
 //
 // GNU/Linux and MacOS code to measure elapsed time
 //
 
+#include <sys/stat.h>
 #include <time.h>
+#include <unistd.h>
 
 double cpu_time(void) {
   struct timespec current_time;
@@ -42,6 +49,23 @@ double cpu_time(void) {
   return (double)current_time.tv_sec + 1.0e-9 * (double)current_time.tv_nsec;
 }
 
+// CPU time of the calling thread only
+static double thread_cpu_time(void) {
+  struct timespec current_time;
+
+  if (clock_gettime(CLOCK_THREAD_CPUTIME_ID, &current_time) != 0)
+    return -1.0; // clock_gettime() failed!!!
+  return (double)current_time.tv_sec + 1.0e-9 * (double)current_time.tv_nsec;
+}
+
+double wall_time(void) {
+  struct timespec current_time;
+
+  if (clock_gettime(CLOCK_MONOTONIC, &current_time) != 0)
+    return -1.0; // clock_gettime() failed!!!
+  return (double)current_time.tv_sec + 1.0e-9 * (double)current_time.tv_nsec;
+}
+
 #endif
 
 
@@ -66,10 +90,19 @@ double cpu_time(void) {
   return (double)current_time.QuadPart / (double)frequency.QuadPart;
 }
 
+double wall_time(void) {
+  return cpu_time();  // cpu_time() above already measures elapsed time
+}
+
+static double thread_cpu_time(void) {
+  return cpu_time();
+}
+
 #endif
 
-/// Array of operation counters:
-unsigned long InstrCount[NUMCOUNTERS];  ///extern
+/// Array of operation counters (one array per thread):
+_Alignas(64) _Thread_local unsigned long InstrCount[NUMCOUNTERS];  ///extern
+    // Aligned to a cache line, so threads never share one.
 
 /// Array of names for the counters:
 char* InstrName[NUMCOUNTERS] = {NULL};  ///extern
@@ -79,9 +112,101 @@ char* InstrName[NUMCOUNTERS] = {NULL};  ///extern
 /// Cpu_time read on previous reset (~seconds)
 double InstrTime;  ///extern
 
-/// Calibrated Time Unit (in seconds, initially 1s)
+/// Calibrated Time Unit (in seconds, initially 1s; see InstrGetCTU)
 double InstrCTU = 1.0;  ///extern
 
+// Has InstrCTU been found (measured or read from cache)?
+static int calibrated = 0;
+
+// Key identifying this machine in the CTU cache: "host<TAB>cpu model".
+static void machineKey(char* key, size_t size) {
+  char host[256] = "unknown";
+  char cpu[256] = "unknown";
+#if defined(__linux__) || defined(__APPLE__)
+  if (gethostname(host, sizeof(host)) != 0) strcpy(host, "unknown");
+  host[sizeof(host)-1] = '\0';
+#endif
+#if defined(__linux__)
+  FILE* f = fopen("/proc/cpuinfo", "r");
+  char line[512];
+  while (f != NULL && fgets(line, sizeof(line), f) != NULL) {
+    char* colon = strchr(line, ':');
+    if (strncmp(line, "model name", 10) == 0 && colon != NULL) {
+      snprintf(cpu, sizeof(cpu), "%s", colon + 1 + (colon[1] == ' '));
+      cpu[strcspn(cpu, "\n")] = '\0';
+      break;
+    }
+  }
+  if (f != NULL) fclose(f);
+#endif
+  // Tabs and newlines separate fields and entries in the cache.
+  for (char* c = host; *c != '\0'; c++) if (*c == '\t') *c = ' ';
+  for (char* c = cpu; *c != '\0'; c++) if (*c == '\t') *c = ' ';
+  snprintf(key, size, "%s\t%s", host, cpu);
+}
+
+// Name of the CTU cache file (empty: no cache).
+static void cacheName(char* name, size_t size) {
+  const char* env = getenv("INSTR_CTU_CACHE");
+  const char* home = getenv("HOME");
+  if (env != NULL) snprintf(name, size, "%s", env);
+  else if (home != NULL) snprintf(name, size, "%s/.cache/instr-ctu", home);
+  else name[0] = '\0';
+}
+
+// The cache is a text file with one "host<TAB>cpu model<TAB>CTU" line per
+// machine, so that it may be shared by machines with a common home.
+
+// Look up the CTU of this machine in the cache.
+// Returns 1 and sets *ctu if found, 0 otherwise.
+static int cacheRead(double* ctu) {
+  char name[1024], key[600], line[700];
+  cacheName(name, sizeof(name));
+  if (name[0] == '\0') return 0;
+  machineKey(key, sizeof(key));
+  size_t len = strlen(key);
+  FILE* f = fopen(name, "r");
+  int found = 0;
+  while (!found && f != NULL && fgets(line, sizeof(line), f) != NULL) {
+    found = strncmp(line, key, len) == 0 && line[len] == '\t' &&
+            sscanf(line + len + 1, "%lf", ctu) == 1 && *ctu > 0.0;
+  }
+  if (f != NULL) fclose(f);
+  return found;
+}
+
+// Save the CTU of this machine in the cache, replacing any previous value.
+// Failures are ignored: the cache is only an optimization.
+static void cacheWrite(double ctu) {
+  char name[1024], key[600], line[700];
+  cacheName(name, sizeof(name));
+  if (name[0] == '\0') return;
+  machineKey(key, sizeof(key));
+  size_t len = strlen(key);
+  // Keep the entries of other machines (at most a few).
+  char others[16][700];
+  int n = 0;
+  FILE* f = fopen(name, "r");
+  while (f != NULL && n < 16 && fgets(line, sizeof(line), f) != NULL) {
+    if (!(strncmp(line, key, len) == 0 && line[len] == '\t'))
+      strcpy(others[n++], line);
+  }
+  if (f != NULL) fclose(f);
+#if defined(__linux__) || defined(__APPLE__)
+  // Create the directory of the cache, if needed (as in ~/.cache).
+  char* slash = strrchr(name, '/');
+  if (slash != NULL && slash != name) {
+    *slash = '\0';
+    mkdir(name, 0755);
+    *slash = '/';
+  }
+#endif
+  if ((f = fopen(name, "w")) == NULL) return;
+  for (int i = 0; i < n; i++) fputs(others[i], f);
+  fprintf(f, "%s\t%.9g\n", key, ctu);
+  fclose(f);
+}
+
 /// Find the Calibrated Time Unit (CTU).
 /// Run and time a loop of basic memory and arithmetic operations to set
 /// a reasonably cpu-independent time unit.
@@ -99,31 +224,256 @@ void InstrCalibrate(void) { ///
     //printf("%d %d %d\n", i, j, k);  // debug
   }
   InstrCTU = cpu_time() - time;
+  calibrated = 1;
+  cacheWrite(InstrCTU);
+}
+
+/// Get the Calibrated Time Unit, finding it on first use.
+double InstrGetCTU(void) { ///
+  if (!calibrated) {
+    const char* force = getenv("INSTR_RECALIBRATE");
+    if ((force == NULL || force[0] == '\0') && cacheRead(&InstrCTU)) {
+      calibrated = 1;
+    } else {
+      InstrCalibrate();
+    }
+  }
+  return InstrCTU;
+}
+
+// Registry of the counter arrays of all threads.
+// Each thread links its own (thread-local) entry into a global list.
+// Only its thread writes InstrCount: InstrReset records their values at
+// the reset in base, which the totals subtract.
+typedef struct block {
+  unsigned long* count;   // InstrCount of the thread (NULL if unregistered)
+  unsigned long base[NUMCOUNTERS];  // counts at the last reset (under lock)
+  struct block* next;
+} Block;
+
+static _Thread_local Block self;          // entry of the calling thread
+static Block* blocks = NULL;              // list of registered entries
+static unsigned long retired[NUMCOUNTERS];  // counts of unregistered threads
+static atomic_flag lock = ATOMIC_FLAG_INIT; // protects blocks and retired
+
+// Registration is rare, so a spin lock is enough.
+static void acquire(void) {
+  while (atomic_flag_test_and_set_explicit(&lock, memory_order_acquire))
+    ;
+}
+
+static void release(void) {
+  atomic_flag_clear_explicit(&lock, memory_order_release);
+}
+
+/// Register the counters of the calling thread.
+void InstrThreadBegin(void) { ///
+  if (self.count != NULL) return;  // already registered
+  self.count = InstrCount;
+  acquire();
+  self.next = blocks;
+  blocks = &self;
+  release();
+}
+
+/// Unregister the counters of the calling thread, keeping their values.
+void InstrThreadEnd(void) { ///
+  if (self.count == NULL) return;  // not registered
+  acquire();
+  Block** b = &blocks;
+  while (*b != &self)
+    b = &(*b)->next;
+  *b = self.next;
+  for (int i = 0; i < NUMCOUNTERS; i++) {
+    retired[i] += InstrCount[i] - self.base[i];
+    InstrCount[i] = 0ul;  // so they are not counted twice
+    self.base[i] = 0ul;
+  }
+  release();
+  self.count = NULL;
+}
+
+/// Sum the counters of all threads into total.
+void InstrTotals(unsigned long total[NUMCOUNTERS]) { ///
+  InstrThreadBegin();
+  acquire();
+  for (int i = 0; i < NUMCOUNTERS; i++)
+    total[i] = retired[i];
+  // Other threads may be counting: read their counters atomically (they
+  // update them with atomic stores, see InstrAdd).
+  for (Block* b = blocks; b != NULL; b = b->next)
+    for (int i = 0; i < NUMCOUNTERS; i++)
+      total[i] += __atomic_load_n(&b->count[i], __ATOMIC_RELAXED) - b->base[i];
+  release();
+}
+
+/// Names of the hardware events:
+const char* InstrPerfName[NUMPERFEVENTS] = {  ///extern
+  "cycles", "instructions", "L1d-misses", "LLC-misses", "branch-misses", "dTLB-misses"
+};
+
+#if defined(__linux__)
+
+//
+// GNU/Linux code to read hardware performance counters
+//
+
+#include <linux/perf_event.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+// File descriptors of the events (-1 if not available); the first one
+// available leads the group, so that all are enabled and read together.
+static int perfFd[NUMPERFEVENTS] = {-1, -1, -1, -1, -1, -1};
+static int perfLeader = -1;  // fd of the group leader
+static int perfCount = 0;    // number of events in the group
+
+// Open one hardware event, in the group led by fd leader (-1: new group).
+static int perfEventOpen(unsigned int type, unsigned long long config, int leader) {
+  struct perf_event_attr attr;
+  memset(&attr, 0, sizeof(attr));
+  attr.size = sizeof(attr);
+  attr.type = type;
+  attr.config = config;
+  attr.disabled = leader == -1;   // the leader starts the whole group
+  attr.exclude_kernel = 1;        // allowed with perf_event_paranoid <= 2
+  attr.exclude_hv = 1;
+  attr.read_format = PERF_FORMAT_GROUP |
+      PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+  return (int)syscall(SYS_perf_event_open, &attr, 0, -1, leader, 0);
+}
+
+/// Open a perf_event group counting the hardware events in the calling thread.
+int InstrPerfOpen(void) { ///
+  static const struct { unsigned int type; unsigned long long config; } event[NUMPERFEVENTS] = {
+    { PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES },
+    { PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS },
+    { PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_L1D |
+        (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16) },
+    { PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_LL |
+        (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16) },
+    { PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES },
+    { PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_DTLB |
+        (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16) },
+  };
+  InstrPerfClose();
+  for (int e = 0; e < NUMPERFEVENTS; e++) {
+    perfFd[e] = perfEventOpen(event[e].type, event[e].config, perfLeader);
+    if (perfFd[e] < 0) {
+      perfFd[e] = -1;  // not supported, or not allowed: leave it out
+      continue;
+    }
+    if (perfLeader == -1) perfLeader = perfFd[e];
+    perfCount++;
+  }
+  return perfCount;
+}
+
+/// Close the perf_event group, if open.
+void InstrPerfClose(void) { ///
+  for (int e = 0; e < NUMPERFEVENTS; e++) {
+    if (perfFd[e] >= 0) close(perfFd[e]);
+    perfFd[e] = -1;
+  }
+  perfLeader = -1;
+  perfCount = 0;
+}
+
+// Restart counting from zero.
+static void perfRestart(void) {
+  if (perfLeader < 0) return;
+  ioctl(perfLeader, PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+  ioctl(perfLeader, PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+}
+
+/// Read the hardware events counted since the last InstrReset.
+int InstrPerfRead(double value[NUMPERFEVENTS]) { ///
+  // Group read format: nr, time_enabled, time_running, value[nr]
+  unsigned long long buf[3 + NUMPERFEVENTS];
+  int ok = perfLeader >= 0 && read(perfLeader, buf, sizeof(buf)) >= (ssize_t)(3*sizeof(buf[0]));
+  // Scale counts if the events were multiplexed (running < enabled).
+  double scale = ok && buf[2] > 0 ? (double)buf[1] / (double)buf[2] : 1.0;
+  int k = 0;  // index of the event in the group
+  for (int e = 0; e < NUMPERFEVENTS; e++) {
+    value[e] = -1.0;
+    if (ok && perfFd[e] >= 0 && k < (int)buf[0])
+      value[e] = (double)buf[3 + k++] * scale;
+  }
+  return ok ? perfCount : 0;
+}
+
+#else
+
+// No hardware performance counters on other systems.
+
+int InstrPerfOpen(void) { return 0; }
+
+void InstrPerfClose(void) { }
+
+static void perfRestart(void) { }
+
+int InstrPerfRead(double value[NUMPERFEVENTS]) {
+  for (int e = 0; e < NUMPERFEVENTS; e++)
+    value[e] = -1.0;
+  return 0;
+}
+
+#endif
+
+/// Take a snapshot of times, counters and hardware events.
+void InstrSnapshot(InstrSnap* snap) { ///
+  snap->wall = wall_time();
+  snap->cpu = thread_cpu_time();
+  for (int i = 0; i < NUMCOUNTERS; i++)
+    snap->count[i] = InstrCount[i];
+  InstrPerfRead(snap->perf);
 }
 
-/// Reset counters to zero and store cpu_time.
+/// Reset counters (of all threads) to zero and store cpu_time.
 void InstrReset(void) { ///
+  InstrThreadBegin();
+  acquire();
   for (int i = 0; i < NUMCOUNTERS; i++)
-    InstrCount[i] = 0ul;
+    retired[i] = 0ul;
+  for (Block* b = blocks; b != NULL; b = b->next)
+    for (int i = 0; i < NUMCOUNTERS; i++)
+      b->base[i] = __atomic_load_n(&b->count[i], __ATOMIC_RELAXED);
+  release();
+  perfRestart();
   InstrTime = cpu_time();
 }
 
-// Print times and all named counter values
+// Print times, all named counter values and available hardware events
+// (Counters are not shown when compiled with INSTR=0: they are never updated.)
 void InstrPrint(void) { ///
   // elapsed time since last reset:
   double time = cpu_time() - InstrTime;
-  // compute time in calibrated time units:
-  double caltime = time / InstrCTU;
+  // compute time in calibrated time units (calibrating, if not done yet):
+  double caltime = time / InstrGetCTU();
+  // counters summed over all threads:
+  unsigned long count[NUMCOUNTERS];
+  InstrTotals(count);
+  // hardware events, if available:
+  double perf[NUMPERFEVENTS];
+  InstrPerfRead(perf);
 
   printf("#%14.15s\t%15.15s", "time", "caltime");
   for (int i = 0; i < NUMCOUNTERS; i++)
-    if (InstrName[i] != NULL)
+    if (INSTR && InstrName[i] != NULL)
       printf("\t%15.15s", InstrName[i]);
+  for (int e = 0; e < NUMPERFEVENTS; e++)
+    if (perf[e] >= 0.0)
+      printf("\t%15.15s", InstrPerfName[e]);
   puts("");
   printf("%15.6f\t%15.6f", time, caltime);
   for (int i = 0; i < NUMCOUNTERS; i++)
-    if (InstrName[i] != NULL)
-      printf("\t%15lu", InstrCount[i]);  
+    if (INSTR && InstrName[i] != NULL)
+      printf("\t%15lu", count[i]);
+  for (int e = 0; e < NUMPERFEVENTS; e++)
+    if (perf[e] >= 0.0)
+      printf("\t%15.0f", perf[e]);
   puts("");
 }
 
@@ -9,27 +9,62 @@
 /// // Name the counters you're going to use: 
 /// InstrName[0] = "memops";
 /// InstrName[1] = "adds";
-/// InstrCalibrate();  // Call once, to measure CTU
+/// InstrCalibrate();  // Optional: InstrPrint calibrates when first needed
 /// ...
 /// InstrReset();  // reset to zero
 /// for (...) {
-///   InstrCount[0] += 3;  // to count array acesses
-///   InstrCount[1] += 1;  // to count addition
 ///   a[k] = a[i] + a[j];
 /// }
+/// InstrAdd(0, 3*n);  // to count array acesses (once, not in the loop!)
+/// InstrAdd(1, n);    // to count additions
 /// InstrPrint();  // to show time and counters
+///
+/// Compile with -DINSTR=0 (make INSTR=0) to turn InstrAdd into a no-op,
+/// so that uninstrumented programs carry no counting cost at all.
+///
+/// Each thread counts in its own InstrCount block.  Other threads that
+/// count must be bracketed by InstrThreadBegin() and InstrThreadEnd();
+/// InstrReset() and InstrPrint() then act on the sum of all blocks; while
+/// other threads are counting, the sum they print is approximate.
+///
+/// On Linux, InstrPerfOpen() adds hardware performance counters (cycles,
+/// instructions, cache and branch misses) of the calling thread, which
+/// InstrReset() restarts and InstrPrint() shows next to the other columns.
 
 #ifndef INSTRUMENTATION_H
 #define INSTRUMENTATION_H
 
+/// Instrumentation switch: counters are updated only if INSTR is nonzero.
+#ifndef INSTR
+#define INSTR 1
+#endif
+
 /// Cpu time in seconds
 double cpu_time(void) ; ///
 
+/// Wall clock time in seconds
+double wall_time(void) ; ///
+
 /// Ten counters should be more than enough
 #define NUMCOUNTERS 10
 
-/// Array of operation counters:
-extern unsigned long InstrCount[NUMCOUNTERS];  ///extern
+/// Array of operation counters (one array per thread):
+extern _Thread_local unsigned long InstrCount[NUMCOUNTERS];  ///extern
+
+/// Add n to counter i (of the calling thread).
+/// Counters live in memory, so updating them inside a loop forces a memory
+/// read-modify-write per iteration and blocks vectorization:
+/// count in a local variable, or compute the total, and add it once.
+/// (Only the thread updates its counters, but InstrTotals may read them
+/// meanwhile: the store is atomic, which costs nothing more.)
+#if INSTR
+#define InstrAdd(i, n) \
+  __atomic_store_n(&InstrCount[i], InstrCount[i] + (unsigned long)(n), __ATOMIC_RELAXED)
+#else
+// (i and n are not evaluated, but still count as used: no warnings for
+// variables that only feed counters.)
+#define InstrAdd(i, n) ((void)sizeof(InstrCount[i] += (unsigned long)(n)))
+#endif
 
 /// Array of names for the counters:
 extern char* InstrName[NUMCOUNTERS];  ///extern
@@ -37,18 +72,79 @@ extern char* InstrName[NUMCOUNTERS];  ///extern
 /// Cpu_time read on previous reset (~seconds)
 extern double InstrTime;  ///extern
 
-/// Calibrated Time Unit (in seconds, initially 1s)
+/// Calibrated Time Unit (in seconds, initially 1s; see InstrGetCTU)
 extern double InstrCTU;  ///extern
 
 /// Find the Calibrated Time Unit (CTU).
 /// Run and time a loop of basic memory and arithmetic operations to set
 /// a reasonably cpu-independent time unit.
+/// The result is saved in the CTU cache file (see InstrGetCTU).
 void InstrCalibrate(void) ;
 
-/// Reset counters to zero and store cpu_time.
+/// Get the Calibrated Time Unit, finding it on first use.
+/// Calibrating takes a while, so the CTU is cached in a file, keyed by
+/// host name and CPU model, and reused by later runs on the same machine.
+/// The cache file is $INSTR_CTU_CACHE, or else ~/.cache/instr-ctu;
+/// set INSTR_CTU_CACHE to the empty string to not use a cache, and
+/// INSTR_RECALIBRATE to a nonempty string to ignore the cached value.
+double InstrGetCTU(void) ;
+
+/// Register the counters of the calling thread.
+/// The thread calling InstrReset or InstrPrint is registered implicitly.
+void InstrThreadBegin(void) ;
+
+/// Unregister the counters of the calling thread, keeping their values in
+/// the totals.  Must be called by registered threads before they exit.
+void InstrThreadEnd(void) ;
+
+/// Sum the counters of all threads into total.
+/// While other threads are counting, the total is approximate: it takes
+/// each counter at some instant during the call.
+void InstrTotals(unsigned long total[NUMCOUNTERS]) ;
+
+/// Reset counters (of all threads) to zero and store cpu_time.
 void InstrReset(void) ;
 
+/// Print time since reset and the (summed) named counters.
 void InstrPrint(void) ;
 
+/// Number of hardware events
+#define NUMPERFEVENTS 6
+
+/// Names of the hardware events:
+extern const char* InstrPerfName[NUMPERFEVENTS];  ///extern
+
+/// Open a perf_event group counting the hardware events in the calling
+/// thread (user mode only), from the next InstrReset on.
+/// Returns the number of events available: 0 if perf events are not
+/// supported or not allowed (see /proc/sys/kernel/perf_event_paranoid).
+/// Events the CPU does not support are simply left out.
+int InstrPerfOpen(void) ;
+
+/// Close the perf_event group, if open.
+void InstrPerfClose(void) ;
+
+/// Read the hardware events counted since the last InstrReset.
+/// Sets value[e] to the count of event e (scaled, if the kernel had to
+/// multiplex the counters), or to -1 if event e is not available.
+/// Returns the number of events available.
+int InstrPerfRead(double value[NUMPERFEVENTS]) ;
+
+/// Times, counters and hardware events at some instant.
+/// The difference of two snapshots measures the interval between them.
+typedef struct {
+  double wall;                        // wall_time()
+  double cpu;                         // CPU time of the thread
+  unsigned long count[NUMCOUNTERS];   // InstrCount (of the thread)
+  double perf[NUMPERFEVENTS];         // InstrPerfRead()
+} InstrSnap;
+
+/// Take a snapshot of times, counters and hardware events.
+/// CPU time and counters are those of the calling thread only, so that
+/// the difference of two snapshots measures the work of that thread,
+/// whatever other threads do meanwhile.  (Hardware events are counted
+/// for the thread that called InstrPerfOpen.)
+void InstrSnapshot(InstrSnap* snap) ;
+
 #endif
 
@@ -0,0 +1,259 @@
+/// kernels - Hot pixel loops of image8bit, for each CPU instruction set.
+///
+/// This module is internal to image8bit,
+/// a programming project for the course AED, DETI / UA.PT
+///
+/// You may freely use and modify this code, at your own risk,
+/// as long as you give proper credit to the original and subsequent authors.
+
+#include "kernels.h"
+
+#include <assert.h>
+#include <string.h>
+
+// Each kernel is written once, as an inline function of a chunk size CH:
+// its main loop runs over chunks of CH levels, with an inner loop of a
+// fixed trip count, which -O2 vectorizes (as in image8bit), and its last
+// levels one by one.  Each set instantiates every kernel with the chunk
+// size of its vector registers, compiled for its instruction set:
+//   scalar   CH = 1  (not vectorized at all: for testing)
+//   sse2     CH = 16 (the baseline of x86-64)
+//   avx2     CH = 32
+//   avx512bw CH = 64
+//   generic  CH = 16 (the baseline of other targets, whatever its vectors)
+// Reductions (minMax, compare) keep CH partial results, combined at the
+// end.  All sets compute the same operations in the same order, so their
+// results are the same.  (Floating-point expressions must not be
+// contracted into FMA instructions, which round differently, whatever
+// the compiler options: hence the pragmas, for GCC and for clang.)
+//
+// Plain loops of CH = 1 would still be vectorized, and no attribute turns
+// that off in every compiler: so this file is compiled twice (see the
+// Makefile).  With KERNELS_SCALAR defined, and without vectorization, it
+// is only the scalar set, kernels_scalar; otherwise, all the other sets.
+
+#ifdef __clang__
+#pragma STDC FP_CONTRACT OFF
+#pragma clang fp contract(off)
+#else
+#pragma GCC optimize("fp-contract=off")
+#endif
+
+#define INLINE static inline __attribute__((always_inline))
+
+INLINE void negateBody(uint8_t* p, size_t n, uint8_t maxval, const int CH) {
+  size_t i = 0;
+  for (; i + CH <= n; i += CH)
+    for (int j = 0; j < CH; j++) p[i+j] = maxval - p[i+j];
+  for (; i < n; i++) p[i] = maxval - p[i];
+}
+
+INLINE void thresholdBody(uint8_t* p, size_t n, uint8_t thr, uint8_t maxval, const int CH) {
+  size_t i = 0;
+  for (; i + CH <= n; i += CH)
+    for (int j = 0; j < CH; j++) p[i+j] = p[i+j] >= thr ? maxval : 0;
+  for (; i < n; i++) p[i] = p[i] >= thr ? maxval : 0;
+}
+
+INLINE void minMaxBody(const uint8_t* p, size_t n, uint8_t* lo, uint8_t* hi, const int CH) {
+  uint8_t l[64], h[64];   // partial results, per position in the chunk
+  for (int j = 0; j < CH; j++) {
+    l[j] = *lo;
+    h[j] = *hi;
+  }
+  size_t i = 0;
+  for (; i + CH <= n; i += CH) {
+    for (int j = 0; j < CH; j++) {
+      uint8_t v = p[i+j];
+      l[j] = v < l[j] ? v : l[j];
+      h[j] = v > h[j] ? v : h[j];
+    }
+  }
+  for (; i < n; i++) {
+    l[0] = p[i] < l[0] ? p[i] : l[0];
+    h[0] = p[i] > h[0] ? p[i] : h[0];
+  }
+  for (int j = 0; j < CH; j++) {
+    *lo = l[j] < *lo ? l[j] : *lo;
+    *hi = h[j] > *hi ? h[j] : *hi;
+  }
+}
+
+INLINE size_t compareBody(const uint8_t* a, const uint8_t* b, size_t n, const int CH) {
+  // Most comparisons of a search fail at once: reject them before any chunk.
+  if (n == 0 || a[0] != b[0]) return 0;
+  size_t i = 0;
+  // Skip whole chunks that match; find the mismatch in the chunk that doesn't.
+  for (; i + CH <= n; i += CH) {
+    uint8_t diff = 0;
+    for (int j = 0; j < CH; j++) diff |= a[i+j] ^ b[i+j];
+    if (diff != 0) break;
+  }
+  while (i < n && a[i] == b[i]) i++;
+  return i;
+}
+
+// Blended level, as ImageBlend computed it (saturated, for alpha outside
+// [0, 1]).
+INLINE uint8_t blendLevel(uint8_t s, uint8_t d, double alpha, double beta) {
+  double v = s*alpha + d*beta + 0.5;
+  v = v > 0.0 ? v : 0.0;
+  v = v < 255.0 ? v : 255.0;
+  return (uint8_t)v;
+}
+
+INLINE void blendBody(uint8_t* restrict dst, const uint8_t* restrict src, size_t n, double alpha, const int CH) {
+  double beta = 1 - alpha;
+  size_t i = 0;
+  for (; i + CH <= n; i += CH)
+    for (int j = 0; j < CH; j++) dst[i+j] = blendLevel(src[i+j], dst[i+j], alpha, beta);
+  for (; i < n; i++) dst[i] = blendLevel(src[i], dst[i], alpha, beta);
+}
+
+INLINE void addRowBody(uint16_t* restrict col, const uint8_t* restrict row, size_t n, const int CH) {
+  size_t i = 0;
+  for (; i + CH <= n; i += CH)
+    for (int j = 0; j < CH; j++) col[i+j] += row[i+j];
+  for (; i < n; i++) col[i] += row[i];
+}
+
+INLINE void subRowBody(uint16_t* restrict col, const uint8_t* restrict row, size_t n, const int CH) {
+  size_t i = 0;
+  for (; i + CH <= n; i += CH)
+    for (int j = 0; j < CH; j++) col[i+j] -= row[i+j];
+  for (; i < n; i++) col[i] -= row[i];
+}
+
+#define MEAN3(i) (uint8_t)(((2u*(col[(i)-1] + col[i] + col[(i)+1]) + a)*m) >> shift)
+#define MEAN5(i) (uint8_t)(((2u*(col[(i)-2] + col[(i)-1] + col[i] + col[(i)+1] + col[(i)+2]) + a)*m) >> shift)
+
+INLINE void meanRowBody(const uint16_t* restrict col, uint8_t* restrict out, size_t n, int r,
+                        uint32_t a, uint32_t m, int shift, const int CH) {
+  size_t i = 0;
+  if (r == 1) {
+    for (; i + CH <= n; i += CH)
+      for (int j = 0; j < CH; j++) out[i+j] = MEAN3(i+j);
+    for (; i < n; i++) out[i] = MEAN3(i);
+  } else {
+    for (; i + CH <= n; i += CH)
+      for (int j = 0; j < CH; j++) out[i+j] = MEAN5(i+j);
+    for (; i < n; i++) out[i] = MEAN5(i);
+  }
+}
+
+#undef MEAN3
+#undef MEAN5
+
+// The kernels of set NAME, with chunks of CH levels, compiled with
+// function attributes ATTR, and their table, kernels_NAME.
+#define KERNEL_SET(NAME, CH, ATTR) \
+ATTR static void negate_##NAME(uint8_t* p, size_t n, uint8_t maxval) { \
+  negateBody(p, n, maxval, CH); \
+} \
+ATTR static void threshold_##NAME(uint8_t* p, size_t n, uint8_t thr, uint8_t maxval) { \
+  thresholdBody(p, n, thr, maxval, CH); \
+} \
+ATTR static void minMax_##NAME(const uint8_t* p, size_t n, uint8_t* lo, uint8_t* hi) { \
+  minMaxBody(p, n, lo, hi, CH); \
+} \
+ATTR static size_t compare_##NAME(const uint8_t* a, const uint8_t* b, size_t n) { \
+  return compareBody(a, b, n, CH); \
+} \
+ATTR static void blend_##NAME(uint8_t* dst, const uint8_t* src, size_t n, double alpha) { \
+  blendBody(dst, src, n, alpha, CH); \
+} \
+ATTR static void addRow_##NAME(uint16_t* col, const uint8_t* row, size_t n) { \
+  addRowBody(col, row, n, CH); \
+} \
+ATTR static void subRow_##NAME(uint16_t* col, const uint8_t* row, size_t n) { \
+  subRowBody(col, row, n, CH); \
+} \
+ATTR static void meanRow_##NAME(const uint16_t* col, uint8_t* out, size_t n, int r, \
+                                uint32_t a, uint32_t m, int shift) { \
+  meanRowBody(col, out, n, r, a, m, shift, CH); \
+} \
+SET_SCOPE const Kernels kernels_##NAME = KERNEL_TABLE(NAME);
+
+// The table of the kernels of set NAME.
+#define KERNEL_TABLE(NAME) { \
+  #NAME, negate_##NAME, threshold_##NAME, minMax_##NAME, compare_##NAME, \
+  blend_##NAME, addRow_##NAME, subRow_##NAME, meanRow_##NAME, \
+}
+
+#ifdef KERNELS_SCALAR
+
+// The scalar set, for the other object.
+#define SET_SCOPE
+KERNEL_SET(scalar, 1, )
+
+#else
+
+#define SET_SCOPE static
+extern const Kernels kernels_scalar;
+
+#if defined(__x86_64__) || defined(__i386__)
+#define X86 1
+KERNEL_SET(sse2, 16, __attribute__((target("sse2"))))
+KERNEL_SET(avx2, 32, __attribute__((target("avx2"))))
+KERNEL_SET(avx512bw, 64, __attribute__((target("avx512bw,prefer-vector-width=512"))))
+#else
+#define X86 0
+#endif
+
+// The baseline: SSE2 on x86-64, whatever the target has elsewhere
+// (32-bit x86 included: it may lack SSE2).
+#ifdef __x86_64__
+#define BASELINE sse2
+#else
+#define BASELINE generic
+KERNEL_SET(generic, 16, )
+#endif
+
+// The sets, from the most to the least capable.
+static const Kernels* const sets[] = {
+#if X86
+  &kernels_avx512bw,
+  &kernels_avx2,
+  &kernels_sse2,
+#endif
+#ifndef __x86_64__
+  &kernels_generic,
+#endif
+  &kernels_scalar,
+};
+
+#define NUMSETS (int)(sizeof(sets)/sizeof(sets[0]))
+
+// Does this CPU support set k?
+static int supported(int k) {
+#if X86
+  __builtin_cpu_init();
+  if (sets[k] == &kernels_avx512bw) return __builtin_cpu_supports("avx512bw");
+  if (sets[k] == &kernels_avx2) return __builtin_cpu_supports("avx2");
+  if (sets[k] == &kernels_sse2) return __builtin_cpu_supports("sse2");
+#endif
+  return 1;
+}
+
+// Until selected: the set of the baseline.
+#define TABLE(NAME) KERNEL_TABLE(NAME)   // (expands NAME first)
+Kernels kernels = TABLE(BASELINE);
+
+/// Select the kernels for instruction set name, or the best supported.
+int KernelsSelect(const char* name) { ///
+  int best = -1;
+  for (int k = 0; k < NUMSETS; k++) {
+    if (!supported(k)) continue;
+    if (name == NULL || strcmp(name, sets[k]->name) == 0) {
+      kernels = *sets[k];
+      return 1;
+    }
+    if (best < 0) best = k;
+  }
+  // (The scalar set is always supported.)
+  assert(best >= 0);
+  kernels = *sets[best];
+  return 0;
+}
+
+#endif
@@ -0,0 +1,60 @@
+/// kernels - Hot pixel loops of image8bit, for each CPU instruction set.
+///
+/// The Makefile compiles for the baseline instruction set of the target
+/// (SSE2, on x86-64), so that the programs run on any machine of that
+/// kind.  This module also compiles the loops that take most of the time
+/// (negative, threshold, blend, stats, compare and the small blurs) for
+/// newer instruction sets (AVX2, AVX-512BW), and KernelsSelect picks, at
+/// run time, the best set the CPU supports.  (ImageMapLevels, and so
+/// ImageBrighten and fused point operations, look each level up in a
+/// table: none of these sets has a vector form of that, so it is the
+/// same loop for all.)
+///
+/// Every set computes exactly the same results: only their speed differs.
+///
+/// This module is internal to image8bit.
+///
+/// You may freely use and modify this code, at your own risk,
+/// as long as you give proper credit to the original and subsequent authors.
+
+#ifndef KERNELS_H
+#define KERNELS_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/// A set of kernels.  Each works on a contiguous array of n levels.
+typedef struct {
+  const char* name;
+  /// p[i] = maxval - p[i]
+  void (*negate)(uint8_t* p, size_t n, uint8_t maxval);
+  /// p[i] = p[i] >= thr ? maxval : 0
+  void (*threshold)(uint8_t* p, size_t n, uint8_t thr, uint8_t maxval);
+  /// Lower *lo and raise *hi to the minimum and maximum of p[0..n-1].
+  void (*minMax)(const uint8_t* p, size_t n, uint8_t* lo, uint8_t* hi);
+  /// Index of the first i where a[i] != b[i], or n if none.
+  size_t (*compare)(const uint8_t* a, const uint8_t* b, size_t n);
+  /// dst[i] = src[i]*alpha + dst[i]*(1 - alpha), rounded and saturated.
+  /// (dst and src may be the same array, but must not overlap otherwise.)
+  void (*blend)(uint8_t* dst, const uint8_t* src, size_t n, double alpha);
+  /// col[i] += row[i]  /  col[i] -= row[i]
+  void (*addRow)(uint16_t* col, const uint8_t* row, size_t n);
+  void (*subRow)(uint16_t* col, const uint8_t* row, size_t n);
+  /// out[i] = (2*s + a)*m >> shift, where s is the sum of col[i-r..i+r]:
+  /// the inside of a row of a (2r+1)-wide mean filter, for r = 1 or 2.
+  void (*meanRow)(const uint16_t* col, uint8_t* out, size_t n, int r,
+                  uint32_t a, uint32_t m, int shift);
+} Kernels;
+
+/// The kernels selected (by KernelsSelect).
+extern Kernels kernels;
+
+/// Select the kernels for instruction set name, or the best the CPU
+/// supports, if name is NULL.  The sets are "sse2", "avx2" and "avx512bw"
+/// on x86, "generic" (the baseline of the target) on all but x86-64, and
+/// "scalar" (not vectorized) everywhere.
+/// Returns 1, or 0 if that set is unknown or not supported (and then the
+/// best supported set is selected).
+int KernelsSelect(const char* name) ;
+
+#endif
@@ -0,0 +1,1059 @@
+/// pipeline - Lazy execution of imageTool pipelines.
+///
+/// This module is an extension of imageTool,
+/// a programming project for the course AED, DETI / UA.PT
+///
+/// You may freely use and modify this code, at your own risk,
+/// as long as you give proper credit to the original and subsequent authors.
+
+#include "pipeline.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "image8bit.h"
+#include "instrumentation.h"
+
+// The data structure
+//
+// A pipeline is an array of nodes, in the order the operations were given.
+// Each node that produces an image names its inputs by their index in the
+// array, so inputs always come before the nodes that use them.
+// While parsing, the imageTool image buffer (I0, I1, ..., PRED, CURR) is
+// simulated: each buffer slot holds the index of the node that produced its
+// current image.  An operation that modifies CURR in-place becomes a new
+// node whose input is the previous CURR node.
+//
+// Sinks (save, info, locate) and barriers (tic, toc) produce no image.
+// Running the pipeline means running the sinks and barriers in order;
+// every other node runs only when some sink needs its image.
+//
+// A template (see PipelineParseTemplate) starts with an input node, whose
+// image is given to each run, and ends with an output node, a sink that
+// keeps the final CURR for the caller.  Nodes are reset between runs.
+
+// Capacity of the image buffer
+#define NUMSLOTS 10
+
+// Maximum number of point operations fused into a single node
+#define MAXSTAGES 16
+
+static char* errors[] = {
+  "Success",
+  "Insufficient operands",
+  "Insufficient images",
+  "Image buffer is full",
+  "Image8bit failure: %s",
+  "Invalid operand",
+  "Invalid rect (overflow)",
+  "Invalid alpha",
+  "Reading script failed",
+  "Reading kernel failed",
+};
+
+/// Error message format for error code err (0 means success).
+const char* PipelineErrMsg(int err) { ///
+  assert(0 <= err && err < (int)(sizeof(errors)/sizeof(errors[0])));
+  return errors[err];
+}
+
+// Operation codes
+typedef enum {
+  OP_LOAD, OP_CREATE, OP_INPUT,     // sources: create a new image
+  OP_SAVE, OP_INFO, OP_LOCATE,      // sinks: only read images
+  OP_OUTPUT,                        // sink: takes over its input image
+  OP_TIC, OP_TOC,                   // barriers
+  OP_POINT,                         // neg, thr, bri: change CURR in-place
+  OP_ROTATE, OP_MIRROR, OP_CROP,    // geometric: create a new image
+  OP_RESIZE,
+  OP_PASTE, OP_BLEND,               // change CURR in-place, using PRED
+  OP_BLUR, OP_MEDIAN,               // change CURR in-place
+  OP_ERODE, OP_DILATE, OP_CONV,
+} OpCode;
+
+// Point operations (functions of the pixel level alone)
+typedef enum { PT_NEG, PT_THR, PT_BRI } PointOp;
+
+typedef struct {
+  PointOp op;
+  double arg;     // threshold level or brightness factor
+} Stage;
+
+struct node {
+  OpCode op;
+  int in[2];      // input nodes: in[0] is CURR, in[1] is PRED (-1 = none)
+  int slot;       // buffer slot of the result (-1 = no result)
+  int epoch;      // number of barriers before this node
+  char* file;     // file name (load, save), kernel operand (conv)
+  int x, y, w, h; // integer operands (also dx, dy for blur)
+  double alpha;   // blending factor
+  ResizeMode mode;  // resampling mode (resize)
+  int* kernel;    // kernel (conv): width, height, div, bias, then weights
+  BorderMode border;  // border policy (conv)
+  int nstages;    // point operations, applied in order (OP_POINT)
+  Stage stage[MAXSTAGES];
+  int fused;      // merged into its consumer?
+  int live;       // is the result needed by some sink (or timed by toc)?
+  int uses;       // number of consumers that have not run yet
+  int done;       // has the node run?
+  Image img;      // the result, while some consumer needs it
+};
+
+struct pipeline {
+  int size;             // number of nodes
+  int capacity;         // allocated nodes
+  struct node* node;    // the nodes
+  FILE* profile;        // where to record each operation run (or NULL)
+  int json;             // record as JSON lines (or CSV)?
+  int output;           // the output node of a template (-1 = not a template)
+  Image input;          // image for the input node, until it runs
+  FILE* out;            // where info and locate print
+  const char* dir;      // directory of relative file names (or NULL)
+  LoadFunction loader;  // loads image files (or NULL, for ImageLoad)
+  void* loaderArg;
+};
+
+static int isSink(const struct node* nd) {
+  return nd->op == OP_SAVE || nd->op == OP_INFO || nd->op == OP_LOCATE ||
+         nd->op == OP_OUTPUT || nd->op == OP_TIC || nd->op == OP_TOC;
+}
+
+// Does the node change its CURR input in-place?
+static int isInPlace(const struct node* nd) {
+  return nd->op == OP_POINT || nd->op == OP_PASTE || nd->op == OP_BLEND ||
+         nd->op == OP_BLUR || nd->op == OP_MEDIAN || nd->op == OP_ERODE ||
+         nd->op == OP_DILATE || nd->op == OP_CONV;
+}
+
+// Names of the resampling modes, indexed by ResizeMode
+static const char* modeName[] = { "nearest", "bilinear", "area" };
+
+// Names of the border policies, indexed by BorderMode
+static const char* borderName[] = { "replicate", "reflect", "zero" };
+
+// Named kernels for conv: width, height, div, bias, then the weights.
+// Signed results (gradients, laplacian) are shown around mid gray.
+static const struct {
+  const char* name;
+  int kernel[4 + 25];
+} namedKernels[] = {
+  { "sharpen",   { 3, 3, 1, 0,     0, -1, 0,  -1, 5, -1,  0, -1, 0 } },
+  { "laplacian", { 3, 3, 1, 128,   0, 1, 0,  1, -4, 1,  0, 1, 0 } },
+  { "sobelx",    { 3, 3, 8, 128,   -1, 0, 1,  -2, 0, 2,  -1, 0, 1 } },
+  { "sobely",    { 3, 3, 8, 128,   -1, -2, -1,  0, 0, 0,  1, 2, 1 } },
+  { "gauss3",    { 3, 3, 16, 0,    1, 2, 1,  2, 4, 2,  1, 2, 1 } },
+  { "gauss5",    { 5, 5, 256, 0,   1, 4, 6, 4, 1,  4, 16, 24, 16, 4,  6, 24, 36, 24, 6,
+                                   4, 16, 24, 16, 4,  1, 4, 6, 4, 1 } },
+};
+
+static int resolve(Pipeline p, const char* file, char* path);
+
+// Parse the operand of conv: a kernel name or file, optionally followed by
+// a comma and a border policy.  A kernel file holds the width, height,
+// divisor and bias, then the width*height weights, row by row (# starts a
+// comment), relative to the directory of p.
+// Returns the kernel, as in struct node, or NULL and sets *err.
+static int* parseKernel(Pipeline p, const char* operand, BorderMode* border, int* err) {
+  char spec[1024];
+  if (snprintf(spec, sizeof(spec), "%s", operand) >= (int)sizeof(spec)) { *err = 5; return NULL; }
+  *border = BORDER_REPLICATE;
+  char* comma = strrchr(spec, ',');
+  for (int b = BORDER_REPLICATE; comma != NULL && b <= BORDER_ZERO; b++) {
+    if (strcmp(comma + 1, borderName[b]) == 0) {
+      *border = b;
+      *comma = '\0';
+    }
+  }
+
+  int nk = sizeof(namedKernels)/sizeof(namedKernels[0]);
+  for (int i = 0; i < nk; i++) {
+    if (strcmp(spec, namedKernels[i].name) != 0) continue;
+    const int* named = namedKernels[i].kernel;
+    int* kernel = malloc((4 + named[0]*named[1])*sizeof(int));
+    if (kernel == NULL) { *err = 4; return NULL; }
+    memcpy(kernel, named, (4 + named[0]*named[1])*sizeof(int));
+    return kernel;
+  }
+
+  char path[PATH_MAX];
+  int nwords;
+  char** words = resolve(p, spec, path) ? PipelineReadScript(path, &nwords) : NULL;
+  if (words == NULL) { *err = 9; return NULL; }
+  int* kernel = malloc((nwords > 4 ? nwords : 4)*sizeof(int));
+  if (kernel == NULL) { free(words); *err = 4; return NULL; }
+  int ok = nwords >= 4;
+  for (int i = 0; i < nwords && ok; i++) {
+    char c;
+    ok = sscanf(words[i], "%d%c", &kernel[i], &c) == 1;
+  }
+  free(words);
+  int kw = kernel[0], kh = kernel[1];
+  ok = ok && kw > 0 && kw % 2 == 1 && kh > 0 && kh % 2 == 1 && kernel[2] > 0 &&
+       nwords - 4 == (long)kw*kh;   // precondition check!
+  if (!ok) { free(kernel); *err = 5; return NULL; }
+  return kernel;
+}
+
+// Append a new node with given op and inputs to the pipeline.
+// Returns its index, or -1 if memory is exhausted.
+static int addNode(Pipeline p, OpCode op, int in0, int in1, int slot, int epoch) {
+  if (p->size == p->capacity) {
+    int capacity = 2*p->capacity + 16;
+    struct node* node = realloc(p->node, capacity*sizeof(struct node));
+    if (node == NULL) return -1;
+    p->node = node;
+    p->capacity = capacity;
+  }
+  struct node* nd = &p->node[p->size];
+  memset(nd, 0, sizeof(*nd));
+  nd->op = op;
+  nd->in[0] = in0;
+  nd->in[1] = in1;
+  nd->slot = slot;
+  nd->epoch = epoch;
+  return p->size++;
+}
+
+// Append a single point operation on node in0.
+static int addPoint(Pipeline p, PointOp op, double arg, int in0, int slot, int epoch) {
+  int k = addNode(p, OP_POINT, in0, -1, slot, epoch);
+  if (k < 0) return k;
+  p->node[k].nstages = 1;
+  p->node[k].stage[0].op = op;
+  p->node[k].stage[0].arg = arg;
+  return k;
+}
+
+/// Read the words of a pipeline script file.
+char** PipelineReadScript(const char* filename, int* nwords) { ///
+  assert(nwords != NULL);
+  FILE* f = fopen(filename, "r");
+  if (f == NULL) return NULL;
+
+  // Read the whole file into a growing buffer.
+  size_t len = 0, cap = 1024;
+  char* text = malloc(cap);
+  size_t r;
+  while (text != NULL && (r = fread(text + len, 1, cap - len - 1, f)) > 0) {
+    len += r;
+    if (len + 1 == cap) {
+      char* bigger = realloc(text, 2*cap);
+      if (bigger == NULL) { free(text); text = NULL; break; }
+      text = bigger;
+      cap *= 2;
+    }
+  }
+  int errsave = errno;
+  int failed = text == NULL || ferror(f);
+  fclose(f);
+  if (failed) {
+    free(text);
+    errno = errsave;
+    return NULL;
+  }
+  text[len] = '\0';
+
+  // Blank out comments and count words.
+  int n = 0;
+  for (size_t i = 0; i < len; ) {
+    while (i < len && strchr(" \t\r\n", text[i]) != NULL) i++;
+    if (i == len) break;
+    if (text[i] == '#') {
+      while (i < len && text[i] != '\n') text[i++] = ' ';
+      continue;
+    }
+    n++;
+    while (i < len && strchr(" \t\r\n", text[i]) == NULL) i++;
+  }
+
+  // Array of n+1 pointers, followed by the text they point into.
+  char** words = malloc((n + 1)*sizeof(char*) + len + 1);
+  if (words == NULL) { free(text); return NULL; }
+  char* copy = (char*)(words + n + 1);
+  memcpy(copy, text, len + 1);
+  free(text);
+  n = 0;
+  // (strtok_r: server workers parse kernel files at the same time.)
+  char* rest;
+  for (char* w = strtok_r(copy, " \t\r\n", &rest); w != NULL; w = strtok_r(NULL, " \t\r\n", &rest)) {
+    words[n++] = w;
+  }
+  words[n] = NULL;
+  *nwords = n;
+  return words;
+}
+
+// Parse a pipeline, or a template: a pipeline that starts with an input
+// image in the buffer and ends with an output node.  Relative file names
+// are relative to dir (if not NULL).
+static Pipeline parse(int ac, char* av[], int* err, int template, const char* dir) {
+  assert(err != NULL);
+  Pipeline p = calloc(1, sizeof(struct pipeline));
+  if (p == NULL) { *err = 4; return NULL; }
+  p->output = -1;
+  p->out = stdout;
+  p->dir = dir;
+
+  int slot[NUMSLOTS];   // node that produced each image in the buffer
+  int n = 0;            // number of images in the buffer
+  int epoch = 0;        // barriers seen so far
+  int x, y, w, h;
+  int k = 0;
+  int nd = 0;           // index of the last node added
+  *err = 0;
+  if (template) {
+    nd = slot[n++] = addNode(p, OP_INPUT, -1, -1, 0, epoch);
+    if (nd < 0) *err = 4;
+  }
+  while (k < ac && *err == 0) {
+    if (strcmp(av[k], "info") == 0) {
+      if (n < 1) { *err = 2; break; }
+      nd = addNode(p, OP_INFO, slot[n-1], -1, -1, epoch);
+    } else if (strcmp(av[k], "tic") == 0 || strcmp(av[k], "toc") == 0) {
+      nd = addNode(p, av[k][1] == 'i' ? OP_TIC : OP_TOC, -1, -1, -1, epoch);
+      epoch++;
+    } else if (strcmp(av[k], "neg") == 0) {
+      if (n < 1) { *err = 2; break; }
+      nd = slot[n-1] = addPoint(p, PT_NEG, 0.0, slot[n-1], n-1, epoch);
+    } else if (strcmp(av[k], "thr") == 0) {
+      if (++k >= ac) { *err = 1; break; }
+      if (n < 1) { *err = 2; break; }
+      uint8 thr;
+      if (sscanf(av[k], "%hhu", &thr) != 1) { *err = 5; break; }
+      nd = slot[n-1] = addPoint(p, PT_THR, thr, slot[n-1], n-1, epoch);
+    } else if (strcmp(av[k], "bri") == 0) {
+      if (++k >= ac) { *err = 1; break; }
+      if (n < 1) { *err = 2; break; }
+      double factor;
+      if (sscanf(av[k], "%lf", &factor) != 1) { *err = 5; break; }
+      nd = slot[n-1] = addPoint(p, PT_BRI, factor, slot[n-1], n-1, epoch);
+    } else if (strcmp(av[k], "create") == 0) {
+      if (++k >= ac) { *err = 1; break; }
+      if (n >= NUMSLOTS) { *err = 3; break; }
+      if (sscanf(av[k], "%d,%d", &w, &h) != 2) { *err = 5; break; }
+      if (w < 0 || h < 0) { *err = 5; break; }   // precondition check!
+      nd = slot[n] = addNode(p, OP_CREATE, -1, -1, n, epoch);
+      if (nd >= 0) { p->node[nd].w = w; p->node[nd].h = h; }
+      n++;
+    } else if (strcmp(av[k], "rotate") == 0 || strcmp(av[k], "mirror") == 0) {
+      if (n < 1) { *err = 2; break; }
+      if (n >= NUMSLOTS) { *err = 3; break; }
+      OpCode op = av[k][0] == 'r' ? OP_ROTATE : OP_MIRROR;
+      nd = slot[n] = addNode(p, op, slot[n-1], -1, n, epoch);
+      n++;
+    } else if (strcmp(av[k], "crop") == 0) {
+      if (++k >= ac) { *err = 1; break; }
+      if (n < 1) { *err = 2; break; }
+      if (n >= NUMSLOTS) { *err = 3; break; }
+      if (sscanf(av[k], "%d,%d,%d,%d", &x, &y, &w, &h) != 4) { *err = 5; break; }
+      nd = slot[n] = addNode(p, OP_CROP, slot[n-1], -1, n, epoch);
+      if (nd >= 0) {
+        p->node[nd].x = x; p->node[nd].y = y;
+        p->node[nd].w = w; p->node[nd].h = h;
+      }
+      n++;
+    } else if (strcmp(av[k], "resize") == 0) {
+      if (++k >= ac) { *err = 1; break; }
+      if (n < 1) { *err = 2; break; }
+      if (n >= NUMSLOTS) { *err = 3; break; }
+      char name[16] = "bilinear";
+      int c = sscanf(av[k], "%d,%d,%15s", &w, &h, name);
+      if (c != 2 && c != 3) { *err = 5; break; }
+      if (w <= 0 || h <= 0) { *err = 5; break; }   // precondition check!
+      ResizeMode mode = RESIZE_NEAREST;
+      while (mode <= RESIZE_AREA && strcmp(name, modeName[mode]) != 0) mode++;
+      if (mode > RESIZE_AREA) { *err = 5; break; }
+      nd = slot[n] = addNode(p, OP_RESIZE, slot[n-1], -1, n, epoch);
+      if (nd >= 0) {
+        p->node[nd].w = w; p->node[nd].h = h;
+        p->node[nd].mode = mode;
+      }
+      n++;
+    } else if (strcmp(av[k], "paste") == 0 || strcmp(av[k], "blend") == 0) {
+      int blend = av[k][0] == 'b';
+      if (++k >= ac) { *err = 1; break; }
+      if (n < 2) { *err = 2; break; }
+      double alpha = 1.0;
+      if (blend ? sscanf(av[k], "%d,%d,%lf", &x, &y, &alpha) != 3
+                : sscanf(av[k], "%d,%d", &x, &y) != 2) { *err = 5; break; }
+      nd = slot[n-1] = addNode(p, blend ? OP_BLEND : OP_PASTE,
+                               slot[n-1], slot[n-2], n-1, epoch);
+      if (nd >= 0) {
+        p->node[nd].x = x; p->node[nd].y = y;
+        p->node[nd].alpha = alpha;
+      }
+    } else if (strcmp(av[k], "locate") == 0) {
+      if (n < 2) { *err = 2; break; }
+      nd = addNode(p, OP_LOCATE, slot[n-1], slot[n-2], -1, epoch);
+    } else if (strcmp(av[k], "blur") == 0 || strcmp(av[k], "median") == 0) {
+      OpCode op = av[k][0] == 'b' ? OP_BLUR : OP_MEDIAN;
+      if (++k >= ac) { *err = 1; break; }
+      if (n < 1) { *err = 2; break; }
+      int dx; int dy;
+      if (sscanf(av[k], "%d,%d", &dx, &dy) != 2) { *err = 5; break; }
+      if (dx < 0 || dy < 0 || (op == OP_MEDIAN && dy >= 32768)) { *err = 5; break; }   // precondition check!
+      nd = slot[n-1] = addNode(p, op, slot[n-1], -1, n-1, epoch);
+      if (nd >= 0) { p->node[nd].x = dx; p->node[nd].y = dy; }
+    } else if (strcmp(av[k], "conv") == 0) {
+      if (++k >= ac) { *err = 1; break; }
+      if (n < 1) { *err = 2; break; }
+      BorderMode border;
+      int* kernel = parseKernel(p, av[k], &border, err);
+      if (kernel == NULL) break;
+      nd = slot[n-1] = addNode(p, OP_CONV, slot[n-1], -1, n-1, epoch);
+      if (nd < 0) { free(kernel); break; }
+      p->node[nd].kernel = kernel;
+      p->node[nd].border = border;
+      p->node[nd].file = av[k];
+    } else if (strcmp(av[k], "erode") == 0 || strcmp(av[k], "dilate") == 0 ||
+               strcmp(av[k], "open") == 0 || strcmp(av[k], "close") == 0) {
+      // open is erode then dilate; close is dilate then erode.
+      OpCode first = av[k][0] == 'e' || av[k][0] == 'o' ? OP_ERODE : OP_DILATE;
+      int both = av[k][0] == 'o' || av[k][0] == 'c';
+      if (++k >= ac) { *err = 1; break; }
+      if (n < 1) { *err = 2; break; }
+      int dx; int dy;
+      if (sscanf(av[k], "%d,%d", &dx, &dy) != 2) { *err = 5; break; }
+      if (dx < 0 || dy < 0) { *err = 5; break; }   // precondition check!
+      for (int i = 0; i <= both && nd >= 0; i++) {
+        OpCode op = (i == 0) == (first == OP_ERODE) ? OP_ERODE : OP_DILATE;
+        nd = slot[n-1] = addNode(p, op, slot[n-1], -1, n-1, epoch);
+        if (nd >= 0) { p->node[nd].x = dx; p->node[nd].y = dy; }
+      }
+    } else if (strcmp(av[k], "save") == 0) {
+      if (++k >= ac) { *err = 1; break; }
+      if (n < 1) { *err = 2; break; }
+      nd = addNode(p, OP_SAVE, slot[n-1], -1, -1, epoch);
+      if (nd >= 0) p->node[nd].file = av[k];
+    } else {  // image file
+      if (n >= NUMSLOTS) { *err = 3; break; }
+      nd = slot[n] = addNode(p, OP_LOAD, -1, -1, n, epoch);
+      if (nd >= 0) p->node[nd].file = av[k];
+      n++;
+    }
+    if (nd < 0) { *err = 4; break; }
+    k++;
+  }
+  if (template && *err == 0) {
+    nd = p->output = addNode(p, OP_OUTPUT, slot[n-1], -1, -1, epoch);
+    if (nd < 0) *err = 4;
+  }
+
+  // File names are copied, so that the words may be discarded.
+  // (On a parse error, they are just dropped, as they are not ours to free.)
+  int parsed = *err == 0;
+  for (int i = 0; i < p->size; i++) {
+    if (p->node[i].file == NULL) continue;
+    p->node[i].file = parsed ? strdup(p->node[i].file) : NULL;
+    if (parsed && p->node[i].file == NULL) *err = 4;
+  }
+  if (*err != 0) {
+    PipelineDestroy(&p);
+  }
+  return p;
+}
+
+/// Parse a pipeline from an array of ac words.
+Pipeline PipelineParse(int ac, char* av[], int* err) { ///
+  return parse(ac, av, err, 0, NULL);
+}
+
+/// Parse a pipeline, with file names relative to directory dir.
+Pipeline PipelineParseIn(const char* dir, int ac, char* av[], int* err) { ///
+  return parse(ac, av, err, 0, dir);
+}
+
+/// Parse a pipeline template from an array of ac words.
+Pipeline PipelineParseTemplate(int ac, char* av[], int* err) { ///
+  return parse(ac, av, err, 1, NULL);
+}
+
+/// Destroy the pipeline pointed to by (*pp), and any image it still holds.
+void PipelineDestroy(Pipeline* pp) { ///
+  assert(pp != NULL);
+  Pipeline p = *pp;
+  if (p == NULL) return;
+  for (int i = 0; i < p->size; i++) {
+    free(p->node[i].file);
+    free(p->node[i].kernel);
+    if (p->node[i].img != NULL) ImageDestroy(&p->node[i].img);
+  }
+  if (p->input != NULL) ImageDestroy(&p->input);
+  free(p->node);
+  free(p);
+  *pp = NULL;
+}
+
+// Mark live nodes and count their uses.
+// A node is live if it is a sink or barrier, if it comes (after a tic) before
+// a toc, which times it, or if a live node uses it.
+// Since inputs precede their consumers, one backwards pass is enough.
+static void analyze(Pipeline p) {
+  int timed = 0;
+  for (int i = p->size - 1; i >= 0; i--) {
+    if (p->node[i].op == OP_TOC) timed = 1;
+    if (p->node[i].op == OP_TIC) timed = 0;
+    p->node[i].live = isSink(&p->node[i]) || (timed && !p->node[i].fused);
+    p->node[i].uses = 0;
+  }
+  for (int i = p->size - 1; i >= 0; i--) {
+    struct node* nd = &p->node[i];
+    if (!nd->live) continue;
+    for (int j = 0; j < 2; j++) {
+      if (nd->in[j] >= 0) {
+        p->node[nd->in[j]].live = 1;
+        p->node[nd->in[j]].uses++;
+      }
+    }
+  }
+}
+
+// Can node k be folded into its (only) consumer c?
+static int foldable(Pipeline p, int k, int c) {
+  return k >= 0 && p->node[k].uses == 1 && p->node[k].epoch == p->node[c].epoch;
+}
+
+/// Rewrite the pipeline DAG.
+void PipelineOptimize(Pipeline p) { ///
+  assert(p != NULL);
+  analyze(p);
+
+  // Push crops before point operations:
+  //   A -> POINT -> CROP   becomes   A -> CROP -> POINT
+  // when the CROP is the only consumer of the full-size POINT result.
+  // The crop result keeps its buffer slot, so the point operation now
+  // runs on that (smaller) image.  Repeat, to cross a chain of points.
+  // (The POINT takes over the consumers of the CROP: their uses must be
+  // counted again after each rewrite.)
+  int changed = 1;
+  while (changed) {
+    changed = 0;
+    for (int c = 0; c < p->size; c++) {
+      int k = p->node[c].in[0];
+      if (p->node[c].op != OP_CROP || !foldable(p, k, c)) continue;
+      if (p->node[k].op != OP_POINT) continue;
+      struct node point = p->node[k];
+      struct node crop = p->node[c];
+      p->node[k] = crop;
+      p->node[k].in[0] = point.in[0];
+      p->node[c] = point;
+      p->node[c].in[0] = k;
+      p->node[c].slot = crop.slot;
+      analyze(p);
+      changed = 1;
+    }
+  }
+
+  // Fuse adjacent point operations:
+  //   A -> POINT1 -> POINT2   becomes   A -> POINT1+2
+  // POINT1 loses its only consumer, so it will not run.
+  for (int c = 0; c < p->size; c++) {
+    struct node* nd = &p->node[c];
+    int k = nd->in[0];
+    if (nd->op != OP_POINT || !foldable(p, k, c)) continue;
+    struct node* prev = &p->node[k];
+    if (prev->op != OP_POINT || prev->nstages + nd->nstages > MAXSTAGES) continue;
+    memmove(&nd->stage[prev->nstages], &nd->stage[0], nd->nstages*sizeof(Stage));
+    memcpy(&nd->stage[0], &prev->stage[0], prev->nstages*sizeof(Stage));
+    nd->nstages += prev->nstages;
+    nd->in[0] = prev->in[0];
+    prev->uses = 0;   // so it does not fuse again
+    prev->fused = 1;
+  }
+
+  // Recompute liveness: fused and unused nodes are dropped.
+  analyze(p);
+}
+
+// Describe the point stages of a node, as "neg,thr 128,bri 0.33".
+static void stagesText(const struct node* nd, char* buf, size_t size) {
+  size_t len = 0;
+  buf[0] = '\0';
+  for (int s = 0; s < nd->nstages && len < size; s++) {
+    const Stage* st = &nd->stage[s];
+    const char* sep = s > 0 ? "," : "";
+    switch (st->op) {
+    case PT_NEG: len += snprintf(buf + len, size - len, "%sneg", sep); break;
+    case PT_THR: len += snprintf(buf + len, size - len, "%sthr %d", sep, (int)st->arg); break;
+    case PT_BRI: len += snprintf(buf + len, size - len, "%sbri %g", sep, st->arg); break;
+    }
+  }
+}
+
+static void printStages(const struct node* nd, FILE* f) {
+  char buf[MAXSTAGES*32];
+  stagesText(nd, buf, sizeof(buf));
+  fputs(buf, f);
+}
+
+/// Print the (optimized) plan to f, one node per line.
+void PipelineExplain(Pipeline p, FILE* f) { ///
+  assert(p != NULL);
+  int live = 0;
+  for (int i = 0; i < p->size; i++) live += p->node[i].live;
+  fprintf(f, "# Plan: %d operations, %d to run\n", p->size, live);
+  for (int i = 0; i < p->size; i++) {
+    const struct node* nd = &p->node[i];
+    fprintf(f, "# %4d%c ", i, nd->live ? ' ' : '-');
+    switch (nd->op) {
+    case OP_LOAD:   fprintf(f, "load %s", nd->file); break;
+    case OP_CREATE: fprintf(f, "create %d,%d", nd->w, nd->h); break;
+    case OP_INPUT:  fprintf(f, "input"); break;
+    case OP_OUTPUT: fprintf(f, "output <- %%%d", nd->in[0]); break;
+    case OP_SAVE:   fprintf(f, "save %s <- %%%d", nd->file, nd->in[0]); break;
+    case OP_INFO:   fprintf(f, "info %%%d", nd->in[0]); break;
+    case OP_LOCATE: fprintf(f, "locate %%%d in %%%d", nd->in[1], nd->in[0]); break;
+    case OP_TIC:    fprintf(f, "tic"); break;
+    case OP_TOC:    fprintf(f, "toc"); break;
+    case OP_POINT:  printStages(nd, f); fprintf(f, " %%%d", nd->in[0]); break;
+    case OP_ROTATE: fprintf(f, "rotate %%%d", nd->in[0]); break;
+    case OP_MIRROR: fprintf(f, "mirror %%%d", nd->in[0]); break;
+    case OP_CROP:
+      fprintf(f, "crop %d,%d,%d,%d %%%d", nd->x, nd->y, nd->w, nd->h, nd->in[0]);
+      break;
+    case OP_RESIZE:
+      fprintf(f, "resize %d,%d,%s %%%d", nd->w, nd->h, modeName[nd->mode], nd->in[0]);
+      break;
+    case OP_PASTE:
+      fprintf(f, "paste %%%d at %d,%d %%%d", nd->in[1], nd->x, nd->y, nd->in[0]);
+      break;
+    case OP_BLEND:
+      fprintf(f, "blend %%%d at %d,%d,%g %%%d", nd->in[1], nd->x, nd->y, nd->alpha, nd->in[0]);
+      break;
+    case OP_BLUR:   fprintf(f, "blur %d,%d %%%d", nd->x, nd->y, nd->in[0]); break;
+    case OP_MEDIAN: fprintf(f, "median %d,%d %%%d", nd->x, nd->y, nd->in[0]); break;
+    case OP_ERODE:  fprintf(f, "erode %d,%d %%%d", nd->x, nd->y, nd->in[0]); break;
+    case OP_CONV:
+      fprintf(f, "conv %dx%d/%d%+d,%s %%%d", nd->kernel[0], nd->kernel[1], nd->kernel[2],
+              nd->kernel[3], borderName[nd->border], nd->in[0]);
+      break;
+    case OP_DILATE: fprintf(f, "dilate %d,%d %%%d", nd->x, nd->y, nd->in[0]); break;
+    }
+    if (nd->slot >= 0) fprintf(f, " -> I%d", nd->slot);
+    if (!nd->live) fprintf(f, nd->fused ? "  (fused)" : "  (skipped)");
+    fputc('\n', f);
+  }
+}
+
+// Apply the point stages of a node to img.
+// A single stage calls the corresponding image8bit function;
+// several stages are first folded into one lookup table, by applying them
+// to a ramp of all levels, so that the result is exactly the same.
+// Returns 0 on success, or an error code.
+static int runPoint(const struct node* nd, Image img) {
+  if (nd->nstages == 1) {
+    const Stage* st = &nd->stage[0];
+    switch (st->op) {
+    case PT_NEG: ImageNegative(img); break;
+    case PT_THR: ImageThreshold(img, (uint8)st->arg); break;
+    case PT_BRI: ImageBrighten(img, st->arg); break;
+    }
+    return 0;
+  }
+  Image ramp = ImageCreate(PixMax + 1, 1, ImageMaxval(img));
+  if (ramp == NULL) return 4;
+  for (int v = 0; v <= PixMax; v++) ImageSetPixel(ramp, v, 0, (uint8)v);
+  for (int s = 0; s < nd->nstages; s++) {
+    const Stage* st = &nd->stage[s];
+    switch (st->op) {
+    case PT_NEG: ImageNegative(ramp); break;
+    case PT_THR: ImageThreshold(ramp, (uint8)st->arg); break;
+    case PT_BRI: ImageBrighten(ramp, st->arg); break;
+    }
+  }
+  uint8 lut[PixMax + 1];
+  for (int v = 0; v <= PixMax; v++) lut[v] = ImageGetPixel(ramp, v, 0);
+  ImageDestroy(&ramp);
+  ImageMapLevels(img, lut);
+  return 0;
+}
+
+// File names with this prefix name shared memory images (see ImageCreateShared).
+#define SHM_PREFIX "shm:"
+
+static int isShared(const char* file) {
+  return strncmp(file, SHM_PREFIX, strlen(SHM_PREFIX)) == 0;
+}
+
+// Resolve file name against the directory of p, into path[PATH_MAX].
+// Returns 0 (with errno set) if the result is too long.
+static int resolve(Pipeline p, const char* file, char* path) {
+  int n = p->dir == NULL || file[0] == '/' ? snprintf(path, PATH_MAX, "%s", file)
+                                           : snprintf(path, PATH_MAX, "%s/%s", p->dir, file);
+  if (n >= PATH_MAX) errno = ENAMETOOLONG;
+  return n < PATH_MAX;
+}
+
+// Load image file, or attach to a shared image (without copying it).
+static Image load(Pipeline p, const char* file) {
+  if (isShared(file)) return ImageAttachShared(file + strlen(SHM_PREFIX));
+  char path[PATH_MAX];
+  if (!resolve(p, file, path)) return NULL;
+  return p->loader != NULL ? p->loader(path, p->loaderArg) : ImageLoad(path);
+}
+
+// Save img to file, or copy it to a new shared image.
+// Returns nonzero on success.
+static int save(Pipeline p, Image img, const char* file) {
+  if (!isShared(file)) {
+    char path[PATH_MAX];
+    return resolve(p, file, path) && ImageSave(img, path);
+  }
+  Image shared = ImageCreateShared(file + strlen(SHM_PREFIX),
+                                   ImageWidth(img), ImageHeight(img), ImageMaxval(img));
+  if (shared == NULL) return 0;
+  ImagePaste(shared, 0, 0, img);
+  ImageDestroy(&shared);
+  return 1;
+}
+
+static int evaluate(Pipeline p, int k);
+
+// Run a single node, whose inputs have already run.
+static int execute(Pipeline p, int k) {
+  struct node* nd = &p->node[k];
+  Image in0 = nd->in[0] >= 0 ? p->node[nd->in[0]].img : NULL;
+  Image in1 = nd->in[1] >= 0 ? p->node[nd->in[1]].img : NULL;
+  int x, y;
+
+  // In-place operations (and the output) take over the input image, if
+  // this is its last consumer, or work on a clone of it, otherwise.
+  // (A blur makes its own copy, keeping the integral image of the input.)
+  // Clones are copied before operations that cannot fail, so that running
+  // out of memory is reported here; the others copy them as needed, and a
+  // median or the output never does.
+  if (isInPlace(nd) || nd->op == OP_OUTPUT) {
+    struct node* src = &p->node[nd->in[0]];
+    if (src->uses == 1) {
+      nd->img = src->img;
+      src->img = NULL;
+    } else if (nd->op != OP_BLUR) {
+      nd->img = ImageClone(in0);
+      if (nd->img == NULL) return 4;
+    }
+    if (nd->op == OP_POINT || nd->op == OP_PASTE || nd->op == OP_BLEND) {
+      if (!ImageUnshare(nd->img)) return 4;
+    }
+  }
+
+  switch (nd->op) {
+  case OP_LOAD:
+    fprintf(stderr, "Loading %s -> I%d\n", nd->file, nd->slot);
+    nd->img = load(p, nd->file);
+    if (nd->img == NULL) return 4;
+    break;
+  case OP_CREATE:
+    fprintf(stderr, "Creating black image (%d,%d) -> I%d\n", nd->w, nd->h, nd->slot);
+    nd->img = ImageCreate(nd->w, nd->h, PixMax);
+    if (nd->img == NULL) return 4;
+    break;
+  case OP_INPUT:
+    nd->img = p->input;
+    p->input = NULL;
+    break;
+  case OP_OUTPUT:   // the image is left in nd->img, for PipelineRunOn
+    break;
+  case OP_SAVE:
+    fprintf(stderr, "Saving %s <- I%d\n", nd->file, p->node[nd->in[0]].slot);
+    if (save(p, in0, nd->file) == 0) return 4;
+    break;
+  case OP_INFO: {
+    fprintf(stderr, "Info on I%d\n", p->node[nd->in[0]].slot);
+    uint8 min, max;
+    uint8 maxval = ImageMaxval(in0);
+    ImageStats(in0, &min, &max);
+    fprintf(p->out, "# Size: %dx%d\n# Maxval: %hhu\n", ImageWidth(in0), ImageHeight(in0), maxval);
+    fprintf(p->out, "# Gray level range: [%hhu, %hhu]\n", min, max);
+    break;
+  }
+  case OP_LOCATE:
+    fprintf(stderr, "Locating I%d in I%d\n", p->node[nd->in[1]].slot, p->node[nd->in[0]].slot);
+    if (ImageLocateSubImage(in0, &x, &y, in1)) {
+      fprintf(p->out, "# FOUND (%d,%d)\n", x, y);
+    } else {
+      fprintf(p->out, "# NOTFOUND\n");
+    }
+    break;
+  case OP_TIC:
+  case OP_TOC:
+    break;
+  case OP_POINT:
+    if (nd->nstages == 1) {
+      const Stage* st = &nd->stage[0];
+      if (st->op == PT_NEG) fprintf(stderr, "Negating I%d\n", nd->slot);
+      if (st->op == PT_THR) fprintf(stderr, "Thresholding I%d at %d\n", nd->slot, (int)st->arg);
+      if (st->op == PT_BRI) fprintf(stderr, "Brightening I%d by %lf\n", nd->slot, st->arg);
+    } else {
+      fprintf(stderr, "Mapping I%d levels through ", nd->slot);
+      printStages(nd, stderr);
+      fputc('\n', stderr);
+    }
+    return runPoint(nd, nd->img);
+  case OP_ROTATE:
+    fprintf(stderr, "Rotating I%d -> I%d\n", p->node[nd->in[0]].slot, nd->slot);
+    nd->img = ImageRotate(in0);
+    if (nd->img == NULL) return 4;
+    break;
+  case OP_MIRROR:
+    fprintf(stderr, "Mirroring I%d -> I%d\n", p->node[nd->in[0]].slot, nd->slot);
+    nd->img = ImageMirror(in0);
+    if (nd->img == NULL) return 4;
+    break;
+  case OP_CROP:
+    if (!ImageValidRect(in0, nd->x, nd->y, nd->w, nd->h)) return 5;   // precondition check!
+    fprintf(stderr, "Cropping I%d (%d,%d,%d,%d) -> I%d\n", p->node[nd->in[0]].slot,
+            nd->x, nd->y, nd->w, nd->h, nd->slot);
+    nd->img = ImageCrop(in0, nd->x, nd->y, nd->w, nd->h);
+    if (nd->img == NULL) return 4;
+    break;
+  case OP_RESIZE:
+    fprintf(stderr, "Resizing I%d to (%d,%d) by %s sampling -> I%d\n", p->node[nd->in[0]].slot,
+            nd->w, nd->h, modeName[nd->mode], nd->slot);
+    nd->img = ImageResize(in0, nd->w, nd->h, nd->mode);
+    if (nd->img == NULL) return 4;
+    break;
+  case OP_PASTE:
+    if (!ImageValidRect(nd->img, nd->x, nd->y, ImageWidth(in1), ImageHeight(in1))) return 6;
+    fprintf(stderr, "Pasting I%d at I%d (%d,%d)\n", p->node[nd->in[1]].slot, nd->slot, nd->x, nd->y);
+    ImagePaste(nd->img, nd->x, nd->y, in1);
+    break;
+  case OP_BLEND:
+    if (!ImageValidRect(nd->img, nd->x, nd->y, ImageWidth(in1), ImageHeight(in1))) return 6;
+    fprintf(stderr, "Blending I%d with I%d@(%d,%d) with alpha=%.3f\n", p->node[nd->in[1]].slot,
+            nd->slot, nd->x, nd->y, nd->alpha);
+    ImageBlend(nd->img, nd->x, nd->y, in1, nd->alpha);
+    break;
+  case OP_BLUR:
+    fprintf(stderr, "Blur I%d with %dx%d mean filter\n", nd->slot, 2*nd->x+1, 2*nd->y+1);
+    if (nd->img != NULL) {
+      ImageBlur(nd->img, nd->x, nd->y);
+    } else {
+      nd->img = ImageBlurred(in0, nd->x, nd->y);
+      if (nd->img == NULL) return 4;
+    }
+    break;
+  case OP_MEDIAN:
+    fprintf(stderr, "Median I%d with %dx%d filter\n", nd->slot, 2*nd->x+1, 2*nd->y+1);
+    if (!ImageMedian(nd->img, nd->x, nd->y)) return 4;
+    break;
+  case OP_CONV:
+    fprintf(stderr, "Convolve I%d with %s\n", nd->slot, nd->file);
+    if (!ImageConvolve(nd->img, nd->kernel[0], nd->kernel[1], nd->kernel + 4,
+                       nd->kernel[2], nd->kernel[3], nd->border)) return 4;
+    break;
+  case OP_ERODE:
+    fprintf(stderr, "Erode I%d with %dx%d rectangle\n", nd->slot, 2*nd->x+1, 2*nd->y+1);
+    if (!ImageErode(nd->img, nd->x, nd->y)) return 4;
+    break;
+  case OP_DILATE:
+    fprintf(stderr, "Dilate I%d with %dx%d rectangle\n", nd->slot, 2*nd->x+1, 2*nd->y+1);
+    if (!ImageDilate(nd->img, nd->x, nd->y)) return 4;
+    break;
+  }
+  return 0;
+}
+
+/// Print the results of info and locate to f.
+void PipelineOutput(Pipeline p, FILE* f) { ///
+  assert(p != NULL);
+  assert(f != NULL);
+  p->out = f;
+}
+
+/// Resolve relative file names against directory dir.
+void PipelineDirectory(Pipeline p, const char* dir) { ///
+  assert(p != NULL);
+  p->dir = dir;
+}
+
+/// Load image files with loader.
+void PipelineLoader(Pipeline p, LoadFunction loader, void* arg) { ///
+  assert(p != NULL);
+  p->loader = loader;
+  p->loaderArg = arg;
+}
+
+/// Record every operation run by PipelineRun in f.
+void PipelineProfile(Pipeline p, FILE* f, int json) { ///
+  assert(p != NULL);
+  p->profile = f;
+  p->json = json;
+  if (f == NULL || json) return;
+  // CSV header: fixed columns, then named counters and available events
+  fprintf(f, "op,width,height,params,wall_ns,cpu_ns");
+  for (int i = 0; i < NUMCOUNTERS; i++)
+    if (INSTR && InstrName[i] != NULL) fprintf(f, ",%s", InstrName[i]);
+  double perf[NUMPERFEVENTS];
+  InstrPerfRead(perf);
+  for (int e = 0; e < NUMPERFEVENTS; e++)
+    if (perf[e] >= 0.0) fprintf(f, ",%s", InstrPerfName[e]);
+  fputc('\n', f);
+}
+
+// Name and operands of a node, as recorded in the profile.
+static const char* opText(const struct node* nd, char* params, size_t size) {
+  params[0] = '\0';
+  switch (nd->op) {
+  case OP_LOAD:   snprintf(params, size, "%s", nd->file); return "load";
+  case OP_CREATE: snprintf(params, size, "%d,%d", nd->w, nd->h); return "create";
+  case OP_INPUT:  return "input";
+  case OP_OUTPUT: return "output";
+  case OP_SAVE:   snprintf(params, size, "%s", nd->file); return "save";
+  case OP_INFO:   return "info";
+  case OP_LOCATE: return "locate";
+  case OP_TIC:    return "tic";
+  case OP_TOC:    return "toc";
+  case OP_POINT:
+    if (nd->nstages > 1) {
+      stagesText(nd, params, size);
+      return "map";
+    }
+    if (nd->stage[0].op == PT_THR) snprintf(params, size, "%d", (int)nd->stage[0].arg);
+    if (nd->stage[0].op == PT_BRI) snprintf(params, size, "%g", nd->stage[0].arg);
+    return nd->stage[0].op == PT_NEG ? "neg" : nd->stage[0].op == PT_THR ? "thr" : "bri";
+  case OP_ROTATE: return "rotate";
+  case OP_MIRROR: return "mirror";
+  case OP_CROP:   snprintf(params, size, "%d,%d,%d,%d", nd->x, nd->y, nd->w, nd->h); return "crop";
+  case OP_RESIZE: snprintf(params, size, "%d,%d,%s", nd->w, nd->h, modeName[nd->mode]); return "resize";
+  case OP_PASTE:  snprintf(params, size, "%d,%d", nd->x, nd->y); return "paste";
+  case OP_BLEND:  snprintf(params, size, "%d,%d,%g", nd->x, nd->y, nd->alpha); return "blend";
+  case OP_BLUR:   snprintf(params, size, "%d,%d", nd->x, nd->y); return "blur";
+  case OP_MEDIAN: snprintf(params, size, "%d,%d", nd->x, nd->y); return "median";
+  case OP_ERODE:  snprintf(params, size, "%d,%d", nd->x, nd->y); return "erode";
+  case OP_CONV:   snprintf(params, size, "%s", nd->file); return "conv";
+  case OP_DILATE: snprintf(params, size, "%d,%d", nd->x, nd->y); return "dilate";
+  }
+  return "?";
+}
+
+// Write a string as a quoted CSV field or JSON string.
+static void putQuoted(FILE* f, const char* str, int json) {
+  fputc('"', f);
+  for (const char* c = str; *c != '\0'; c++) {
+    if (*c == '"') fputs(json ? "\\\"" : "\"\"", f);
+    else if (json && *c == '\\') fputs("\\\\", f);
+    else if (json && (unsigned char)*c < 0x20) fprintf(f, "\\u%04x", *c);
+    else fputc(*c, f);
+  }
+  fputc('"', f);
+}
+
+// Record node nd, which ran on a w x h image between snapshots t0 and t1.
+static void record(Pipeline p, const struct node* nd, int w, int h,
+                   const InstrSnap* t0, const InstrSnap* t1) {
+  FILE* f = p->profile;
+  char params[MAXSTAGES*32 + 256];
+  const char* op = opText(nd, params, sizeof(params));
+  double wall = 1e9*(t1->wall - t0->wall);
+  double cpu = 1e9*(t1->cpu - t0->cpu);
+  if (p->json) {
+    fprintf(f, "{\"op\":\"%s\",\"width\":%d,\"height\":%d,\"params\":", op, w, h);
+    putQuoted(f, params, 1);
+    fprintf(f, ",\"wall_ns\":%.0f,\"cpu_ns\":%.0f", wall, cpu);
+  } else {
+    fprintf(f, "%s,%d,%d,", op, w, h);
+    putQuoted(f, params, 0);
+    fprintf(f, ",%.0f,%.0f", wall, cpu);
+  }
+  for (int i = 0; i < NUMCOUNTERS; i++) {
+    if (!INSTR || InstrName[i] == NULL) continue;
+    if (p->json) fprintf(f, ",\"%s\":", InstrName[i]);
+    else fputc(',', f);
+    fprintf(f, "%lu", t1->count[i] - t0->count[i]);
+  }
+  for (int e = 0; e < NUMPERFEVENTS; e++) {
+    if (t1->perf[e] < 0.0) continue;
+    if (p->json) fprintf(f, ",\"%s\":", InstrPerfName[e]);
+    else fputc(',', f);
+    fprintf(f, "%.0f", t1->perf[e] - t0->perf[e]);
+  }
+  fputs(p->json ? "}\n" : "\n", f);
+}
+
+// Run node k, after running its inputs (if not done yet).
+// Input images are destroyed as soon as their last consumer has run.
+// Returns 0 on success, or an error code.
+static int evaluate(Pipeline p, int k) {
+  struct node* nd = &p->node[k];
+  if (nd->done) return 0;
+  // Run inputs in the order they were given.
+  int first = nd->in[1] >= 0 && nd->in[1] < nd->in[0];
+  for (int j = 0; j < 2; j++) {
+    int in = nd->in[first ? 1 - j : j];
+    if (in >= 0) {
+      int err = evaluate(p, in);
+      if (err != 0) return err;
+    }
+  }
+  // Run the node, taking snapshots around it if recording.
+  InstrSnap t0, t1;
+  Image in0 = nd->in[0] >= 0 ? p->node[nd->in[0]].img : NULL;
+  int w = in0 != NULL ? ImageWidth(in0) : 0;
+  int h = in0 != NULL ? ImageHeight(in0) : 0;
+  int timed = p->profile != NULL && nd->op != OP_TIC && nd->op != OP_TOC;
+  if (timed) InstrSnapshot(&t0);
+  int err = execute(p, k);
+  if (err != 0) return err;
+  if (timed) {
+    InstrSnapshot(&t1);
+    if (in0 == NULL && nd->img != NULL) {   // sources: size of the result
+      w = ImageWidth(nd->img);
+      h = ImageHeight(nd->img);
+    }
+    record(p, nd, w, h, &t0, &t1);
+  }
+  nd->done = 1;
+  for (int j = 0; j < 2; j++) {
+    if (nd->in[j] < 0) continue;
+    struct node* src = &p->node[nd->in[j]];
+    if (--src->uses == 0 && src->img != NULL) ImageDestroy(&src->img);
+  }
+  return 0;
+}
+
+/// Run the pipeline.
+int PipelineRun(Pipeline p) { ///
+  assert(p != NULL);
+  for (int k = 0; k < p->size; k++) {
+    struct node* nd = &p->node[k];
+    if (!isSink(nd)) continue;
+    // Barriers first run all the (live) work that comes before them.
+    if (nd->op == OP_TIC || nd->op == OP_TOC) {
+      for (int i = 0; i < k; i++) {
+        int err = p->node[i].live ? evaluate(p, i) : 0;
+        if (err != 0) return err;
+      }
+    }
+    int err = evaluate(p, k);
+    if (err != 0) return err;
+    if (nd->op == OP_TIC) InstrReset();
+    if (nd->op == OP_TOC) InstrPrint();
+  }
+  return 0;
+}
+
+/// Run a pipeline template on image *img.
+int PipelineRunOn(Pipeline p, Image* img) { ///
+  assert(p != NULL);
+  assert(p->output >= 0);
+  assert(img != NULL && *img != NULL);
+  // Reset the nodes, which may have run before.
+  analyze(p);
+  for (int i = 0; i < p->size; i++) p->node[i].done = 0;
+  p->input = *img;
+  *img = NULL;
+  int err = PipelineRun(p);
+  if (err == 0) {
+    *img = p->node[p->output].img;
+    p->node[p->output].img = NULL;
+  }
+  // Release whatever a failed run left behind.
+  for (int i = 0; i < p->size; i++) {
+    if (p->node[i].img != NULL) ImageDestroy(&p->node[i].img);
+  }
+  if (p->input != NULL) ImageDestroy(&p->input);
+  return err;
+}
@@ -0,0 +1,111 @@
+/// pipeline - Lazy execution of imageTool pipelines.
+///
+/// A pipeline is the sequence of FILES, OPERATIONS and OPERANDS accepted
+/// by imageTool.  Instead of running each operation as soon as it is read,
+/// the whole sequence is parsed into a DAG of image8bit operations, which
+/// is then optimized and executed on demand:
+///   - only operations whose result reaches a save, info or locate, or that
+///     are timed between tic and toc, are run;
+///   - crops are pushed before point operations (neg, thr, bri), so these
+///     only touch the pixels that survive the crop;
+///   - adjacent point operations are fused into a single ImageMapLevels pass.
+/// The tic and toc operations are barriers: no work is moved across them.
+///
+/// Use as follows:
+///
+///   int err;
+///   Pipeline p = PipelineParse(ac, av, &err);
+///   if (p != NULL) {
+///     PipelineOptimize(p);
+///     PipelineExplain(p, stdout);   // optional: show the plan
+///     err = PipelineRun(p);
+///     PipelineDestroy(&p);
+///   }
+///   if (err != 0) ... PipelineErrMsg(err) ...
+
+#ifndef PIPELINE_H
+#define PIPELINE_H
+
+#include <stdio.h>
+#include "image8bit.h"
+
+// Type Pipeline is a pointer to pipeline objects
+typedef struct pipeline *Pipeline;
+
+/// Error message format for error code err (0 means success).
+/// The format may contain one %s, to be filled with ImageErrMsg().
+const char* PipelineErrMsg(int err) ;
+
+/// Read the words of a pipeline script file.
+/// Words are separated by blanks; a word starting with # starts a comment
+/// that runs to the end of the line.
+/// On success, returns a NULL-terminated array of *nwords words, in a
+/// single block that the caller releases with free().
+/// On failure, returns NULL and errno is set accordingly.
+char** PipelineReadScript(const char* filename, int* nwords) ;
+
+/// Parse a pipeline from an array of ac words (FILES, OPERATIONS, OPERANDS).
+/// On success, a new pipeline is returned.
+/// (The caller is responsible for destroying it!)
+/// On failure, returns NULL and sets *err to a nonzero error code.
+Pipeline PipelineParse(int ac, char* av[], int* err) ;
+
+/// As PipelineParse, but relative file names are relative to directory dir
+/// (see PipelineDirectory), also those of kernel files, read while parsing.
+Pipeline PipelineParseIn(const char* dir, int ac, char* av[], int* err) ;
+
+/// Parse a pipeline template, to be run on many images (see PipelineRunOn).
+/// As PipelineParse, but the image buffer starts with the input image (I0),
+/// and the result is CURR after the last word.
+Pipeline PipelineParseTemplate(int ac, char* av[], int* err) ;
+
+/// Destroy the pipeline pointed to by (*pp), and any image it still holds.
+/// If (*pp)==NULL, no operation is performed.
+/// Ensures: (*pp)==NULL.
+void PipelineDestroy(Pipeline* pp) ;
+
+/// Rewrite the pipeline DAG: push crops before point operations, fuse
+/// adjacent point operations and drop operations whose result is unused.
+/// The images produced by save, info and locate are not changed.
+void PipelineOptimize(Pipeline p) ;
+
+/// Print the (optimized) plan to f, one node per line.
+void PipelineExplain(Pipeline p, FILE* f) ;
+
+/// Record every operation run by PipelineRun in f, one line per operation:
+/// as CSV (after a header line written now), if json is 0, or as JSON
+/// lines, otherwise.  Each record has the operation name, the size of the
+/// image it works on, its operands, its wall and cpu times in ns, and the
+/// increments of the named instrumentation counters and of the available
+/// hardware events.  Pass f==NULL to stop recording.
+void PipelineProfile(Pipeline p, FILE* f, int json) ;
+
+/// Print the results of info and locate to f (stdout, by default).
+void PipelineOutput(Pipeline p, FILE* f) ;
+
+/// Resolve relative file names (of files loaded and saved) against
+/// directory dir, which must outlive the pipeline.  Pass NULL to use them
+/// as they are (the default).  (Kernel files are read while parsing: see
+/// PipelineParseIn.)
+void PipelineDirectory(Pipeline p, const char* dir) ;
+
+/// Function that loads image file path, as ImageLoad does.
+typedef Image (*LoadFunction)(const char* path, void* arg);
+
+/// Load image files with loader(path, arg), instead of ImageLoad; for
+/// instance, to take them from a cache.  Pass NULL to use ImageLoad again.
+void PipelineLoader(Pipeline p, LoadFunction loader, void* arg) ;
+
+/// Run the pipeline.
+/// Sinks (save, info, locate) and barriers (tic, toc) are run in the order
+/// they were given; each one first runs the operations it depends on.
+/// Returns 0 on success, or a nonzero error code (see PipelineErrMsg).
+int PipelineRun(Pipeline p) ;
+
+/// Run a pipeline template (optimized, as for PipelineRun) on image *img.
+/// The input image is consumed: on success, *img is replaced by the result;
+/// on failure, *img is set to NULL.  A template may run any number of times.
+/// Returns 0 on success, or a nonzero error code (see PipelineErrMsg).
+int PipelineRunOn(Pipeline p, Image* img) ;
+
+#endif
@@ -0,0 +1,436 @@
+/// server - Serve imageTool pipelines over a Unix domain socket.
+///
+/// This module is an extension of imageTool,
+/// a programming project for the course AED, DETI / UA.PT
+///
+/// You may freely use and modify this code, at your own risk,
+/// as long as you give proper credit to the original and subsequent authors.
+
+#include "server.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include "image8bit.h"
+#include "instrumentation.h"
+#include "pipeline.h"
+
+// The protocol
+//
+// A client connects, sends its working directory and the words of the
+// pipeline, each terminated by '\0', and shuts down its side.
+// The server replies with a line "ERR ERRNO CAUSE", the error code of the
+// pipeline (0 on success), errno and the error cause (if any), followed by
+// the text printed by the pipeline, and closes the connection.
+
+#define MAXREQUEST (1 << 20)  // bytes in a request
+
+// The data structure
+//
+// The main thread accepts connections and puts them in a queue, a ring
+// buffer of at most capacity sockets; the worker threads take them out.
+// Loaded images are kept in a cache of entries, each valid while its file
+// is not changed (its modification time and size are the same).
+// When the cache is full, the least recently used entries are dropped.
+// A single mutex protects both.  Pipelines get copies of the cached images,
+// as they may change them in-place.
+
+typedef struct {
+  char* path;               // of the file
+  Image img;
+  struct timespec mtime;    // modification time of the file, when loaded
+  off_t size;               // and its size
+  unsigned long used;       // when last used (a tick of the cache clock)
+} Entry;
+
+struct server {
+  pthread_mutex_t lock;
+  pthread_cond_t changed;
+  int* conn;                // ring buffer of accepted sockets
+  int capacity;
+  int head;
+  int count;
+  int closed;               // no more sockets will be put?
+  Entry* entry;             // the cache
+  int entries;
+  int maxEntries;           // allocated entries
+  size_t bytes;             // pixels in the cache
+  size_t limit;             // and their limit
+  unsigned long clock;      // ticks at each use of the cache
+};
+
+// Is entry e the image of the file with status st?
+static int current(const Entry* e, const char* path, const struct stat* st) {
+  return strcmp(e->path, path) == 0 && e->size == st->st_size &&
+         e->mtime.tv_sec == st->st_mtim.tv_sec && e->mtime.tv_nsec == st->st_mtim.tv_nsec;
+}
+
+// Remove entry i from the cache.  (Call with the lock held.)
+static void drop(struct server* s, int i) {
+  Entry* e = &s->entry[i];
+  s->bytes -= (size_t)ImageWidth(e->img)*ImageHeight(e->img);
+  free(e->path);
+  ImageDestroy(&e->img);
+  s->entry[i] = s->entry[--s->entries];
+}
+
+// Clone of the cached image of the file with status st, or NULL.
+// (Pipelines that only read it never copy its pixels.)
+static Image lookup(struct server* s, const char* path, const struct stat* st) {
+  Image copy = NULL;
+  pthread_mutex_lock(&s->lock);
+  for (int i = 0; i < s->entries; i++) {
+    Entry* e = &s->entry[i];
+    if (current(e, path, st)) {
+      e->used = ++s->clock;
+      copy = ImageClone(e->img);
+      break;
+    }
+  }
+  pthread_mutex_unlock(&s->lock);
+  return copy;
+}
+
+// Keep a clone of image img, loaded from the file with status st, in the
+// cache.  Nothing is kept if it does not fit, or memory runs out.
+static void store(struct server* s, const char* path, const struct stat* st, Image img) {
+  size_t bytes = (size_t)ImageWidth(img)*ImageHeight(img);
+  if (bytes > s->limit) return;
+  Entry e = { strdup(path), ImageClone(img),
+              st->st_mtim, st->st_size, 0 };
+  pthread_mutex_lock(&s->lock);
+  // Replace an older image of the file, then the least recently used ones.
+  for (int i = 0; i < s->entries; i++) {
+    if (strcmp(s->entry[i].path, path) == 0) drop(s, i--);
+  }
+  while (s->bytes + bytes > s->limit) {
+    int lru = 0;
+    for (int i = 1; i < s->entries; i++) {
+      if (s->entry[i].used < s->entry[lru].used) lru = i;
+    }
+    drop(s, lru);
+  }
+  if (s->entries == s->maxEntries) {
+    int max = 2*s->maxEntries + 8;
+    Entry* entry = realloc(s->entry, max*sizeof(Entry));
+    if (entry != NULL) {
+      s->entry = entry;
+      s->maxEntries = max;
+    }
+  }
+  if (e.path != NULL && e.img != NULL && s->entries < s->maxEntries) {
+    e.used = ++s->clock;
+    s->entry[s->entries++] = e;
+    s->bytes += bytes;
+    e.path = NULL;
+    e.img = NULL;
+  }
+  pthread_mutex_unlock(&s->lock);
+  free(e.path);
+  ImageDestroy(&e.img);
+}
+
+// Pipeline loader: take file path from the cache, or load (and cache) it.
+static Image load(const char* path, void* arg) {
+  struct server* s = arg;
+  struct stat st;
+  if (s->limit == 0 || stat(path, &st) != 0) return ImageLoad(path);
+  Image img = lookup(s, path, &st);
+  if (img != NULL) {
+    fprintf(stderr, "Cached %s\n", path);
+    return img;
+  }
+  img = ImageLoad(path);
+  // Keep it, unless the file changed while it was loaded.
+  struct stat after;
+  if (img != NULL && stat(path, &after) == 0 &&
+      after.st_size == st.st_size && after.st_mtim.tv_sec == st.st_mtim.tv_sec &&
+      after.st_mtim.tv_nsec == st.st_mtim.tv_nsec) {
+    store(s, path, &st, img);
+  }
+  return img;
+}
+
+// Put socket fd in the queue, waiting for room.
+static void put(struct server* s, int fd) {
+  pthread_mutex_lock(&s->lock);
+  while (s->count == s->capacity) {
+    pthread_cond_wait(&s->changed, &s->lock);
+  }
+  s->conn[(s->head + s->count) % s->capacity] = fd;
+  s->count++;
+  pthread_cond_broadcast(&s->changed);
+  pthread_mutex_unlock(&s->lock);
+}
+
+// Get the next socket from the queue, waiting for one.
+// Returns -1 when the queue is closed and empty.
+static int get(struct server* s) {
+  pthread_mutex_lock(&s->lock);
+  while (s->count == 0 && !s->closed) {
+    pthread_cond_wait(&s->changed, &s->lock);
+  }
+  int fd = -1;
+  if (s->count > 0) {
+    fd = s->conn[s->head];
+    s->head = (s->head + 1) % s->capacity;
+    s->count--;
+    pthread_cond_broadcast(&s->changed);
+  }
+  pthread_mutex_unlock(&s->lock);
+  return fd;
+}
+
+// Send the n bytes of buf to socket fd.
+// (A client that went away gets an error, not a SIGPIPE to the server.)
+static int sendAll(int fd, const char* buf, size_t n) {
+  while (n > 0) {
+    ssize_t k = send(fd, buf, n, MSG_NOSIGNAL);
+    if (k < 0 && errno == EINTR) continue;
+    if (k <= 0) return 0;
+    buf += k;
+    n -= k;
+  }
+  return 1;
+}
+
+// Receive from socket fd until the end of stream, or max bytes.
+// Returns a new buffer with the *n bytes received, and a '\0' after them,
+// or NULL on failure.
+static char* recvAll(int fd, size_t max, size_t* n) {
+  size_t size = 4096;
+  char* buf = malloc(size);
+  *n = 0;
+  while (buf != NULL) {
+    if (*n + 1 == size) {
+      char* bigger = size > max ? NULL : realloc(buf, 2*size);
+      if (bigger == NULL) break;
+      buf = bigger;
+      size *= 2;
+    }
+    ssize_t k = recv(fd, buf + *n, size - 1 - *n, 0);
+    if (k < 0 && errno == EINTR) continue;
+    if (k < 0) break;
+    if (k == 0) {
+      buf[*n] = '\0';
+      return buf;
+    }
+    *n += k;
+  }
+  free(buf);
+  return NULL;
+}
+
+// Run the request on socket fd, and reply.
+static void serve(struct server* s, int fd) {
+  size_t n;
+  char* req = recvAll(fd, MAXREQUEST, &n);
+  if (req == NULL || n == 0 || req[n-1] != '\0') {
+    free(req);
+    return;   // not a request: no reply
+  }
+  // Split the request in words: the directory, then the pipeline.
+  int nwords = 0;
+  for (size_t i = 0; i < n; i++) nwords += req[i] == '\0';
+  char** words = malloc(nwords*sizeof(char*));
+  char* text = NULL;
+  size_t size = 0;
+  FILE* out = open_memstream(&text, &size);
+  int err = 4;
+  int errnum = errno;
+  const char* cause = "Out of memory";
+  if (words != NULL && out != NULL) {
+    char* w = req;
+    for (int i = 0; i < nwords; i++) {
+      words[i] = w;
+      w += strlen(w) + 1;
+    }
+    const char* dir = words[0];
+    int explain = nwords > 1 && strcmp(words[1], "--explain") == 0;
+    int first = 1 + explain;
+    Pipeline p = PipelineParseIn(dir, nwords - first, words + first, &err);
+    if (p != NULL) {
+      PipelineOptimize(p);
+      if (explain) {
+        PipelineExplain(p, out);
+      } else {
+        PipelineOutput(p, out);
+        PipelineLoader(p, load, s);
+        err = PipelineRun(p);
+      }
+      PipelineDestroy(&p);
+    }
+    errnum = err != 0 ? errno : 0;
+    cause = err == 4 ? ImageErrMsg() : "";
+  }
+  if (out != NULL) fclose(out);
+
+  char head[256];
+  int len = snprintf(head, sizeof(head), "%d %d %s\n", err, errnum, cause);
+  if (len >= (int)sizeof(head)) len = sizeof(head) - 1;
+  if (sendAll(fd, head, len) && text != NULL) sendAll(fd, text, size);
+  free(text);
+  free(words);
+  free(req);
+}
+
+// Worker thread: serve the connections in the queue.
+static void* worker(void* arg) {
+  struct server* s = arg;
+  InstrThreadBegin();
+  int fd;
+  while ((fd = get(s)) >= 0) {
+    serve(s, fd);
+    close(fd);
+  }
+  InstrThreadEnd();
+  return NULL;
+}
+
+// Fill addr with the address of the socket at path.
+// Returns 0 (with errno set) if path is too long.
+static int address(const char* path, struct sockaddr_un* addr) {
+  memset(addr, 0, sizeof(*addr));
+  addr->sun_family = AF_UNIX;
+  if (strlen(path) >= sizeof(addr->sun_path)) {
+    errno = ENAMETOOLONG;
+    return 0;
+  }
+  strcpy(addr->sun_path, path);
+  return 1;
+}
+
+/// Serve pipelines on the Unix domain socket at path.
+int ServerRun(const char* path, int workers, size_t cache, const char** cause) { ///
+  assert(path != NULL);
+  assert(workers > 0);
+  assert(cause != NULL);
+
+  struct sockaddr_un addr;
+  if (!address(path, &addr)) {
+    *cause = "Invalid socket path";
+    return 4;
+  }
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd < 0) {
+    *cause = "Creating socket failed";
+    return 4;
+  }
+  // A socket nobody accepts on is left by a server that stopped.
+  if (connect(fd, (struct sockaddr*)&addr, sizeof(addr)) == 0) {
+    close(fd);
+    errno = EADDRINUSE;
+    *cause = "Server already running";
+    return 4;
+  }
+  unlink(path);
+  if (bind(fd, (struct sockaddr*)&addr, sizeof(addr)) != 0 || listen(fd, 64) != 0) {
+    int errnum = errno;
+    close(fd);
+    errno = errnum;
+    *cause = "Binding socket failed";
+    return 4;
+  }
+
+  struct server s = {
+    .lock = PTHREAD_MUTEX_INITIALIZER, .changed = PTHREAD_COND_INITIALIZER,
+    .capacity = 2*workers, .limit = cache,
+  };
+  s.conn = malloc(s.capacity*sizeof(int));
+  pthread_t* thread = malloc(workers*sizeof(pthread_t));
+  int started = 0;
+  if (s.conn != NULL && thread != NULL) {
+    while (started < workers && pthread_create(&thread[started], NULL, worker, &s) == 0) {
+      started++;
+    }
+  }
+  fprintf(stderr, "Serving on %s, with %d workers\n", path, started);
+
+  // Accept connections until it fails (for a reason other than a signal).
+  int errnum = ENOMEM;
+  *cause = "Starting workers failed";
+  while (started > 0) {
+    int conn = accept(fd, NULL, NULL);
+    if (conn >= 0) {
+      put(&s, conn);
+    } else if (errno != EINTR && errno != ECONNABORTED) {
+      errnum = errno;
+      *cause = "Accepting connection failed";
+      break;
+    }
+  }
+
+  pthread_mutex_lock(&s.lock);
+  s.closed = 1;
+  pthread_cond_broadcast(&s.changed);
+  pthread_mutex_unlock(&s.lock);
+  for (int i = 0; i < started; i++) pthread_join(thread[i], NULL);
+  while (s.entries > 0) drop(&s, 0);
+  free(s.entry);
+  free(s.conn);
+  free(thread);
+  close(fd);
+  unlink(path);
+  errno = errnum;
+  return 4;
+}
+
+/// Send the ac words of a pipeline to the server at path.
+int ServerRequest(const char* path, int ac, char* const av[], const char** cause) { ///
+  assert(path != NULL);
+  assert(ac >= 0);
+  assert(cause != NULL);
+  static char reason[256];   // the error cause, from the reply
+
+  struct sockaddr_un addr;
+  char dir[PATH_MAX];
+  if (getcwd(dir, sizeof(dir)) == NULL) {
+    *cause = "Getting working directory failed";
+    return 4;
+  }
+  int fd = -1;
+  int ok = address(path, &addr) &&
+           (fd = socket(AF_UNIX, SOCK_STREAM, 0)) >= 0 &&
+           connect(fd, (struct sockaddr*)&addr, sizeof(addr)) == 0;
+  if (!ok) {
+    int errnum = errno;
+    if (fd >= 0) close(fd);
+    errno = errnum;
+    *cause = "Connecting to server failed";
+    return 4;
+  }
+  // The request: the words, each with its '\0'.
+  ok = sendAll(fd, dir, strlen(dir) + 1);
+  for (int i = 0; i < ac && ok; i++) ok = sendAll(fd, av[i], strlen(av[i]) + 1);
+  size_t n = 0;
+  char* reply = NULL;
+  if (ok && shutdown(fd, SHUT_WR) == 0) reply = recvAll(fd, SIZE_MAX/4, &n);
+  int errnum = errno;
+  close(fd);
+
+  int err, pos = 0;
+  char* eol = reply != NULL ? strchr(reply, '\n') : NULL;
+  if (eol != NULL) *eol = '\0';
+  if (eol == NULL || sscanf(reply, "%d %d %n", &err, &errnum, &pos) != 2) {
+    errnum = reply != NULL ? EPROTO : errnum;
+    free(reply);
+    errno = errnum;
+    *cause = "Request to server failed";
+    return 4;
+  }
+  snprintf(reason, sizeof(reason), "%s", reply + pos);
+  *cause = reason;
+  fwrite(eol + 1, 1, n - (eol + 1 - reply), stdout);
+  free(reply);
+  errno = errnum;
+  return err;
+}
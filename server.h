@@ -0,0 +1,41 @@
+/// server - Serve imageTool pipelines over a Unix domain socket.
+///
+/// Each imageTool run pays for starting a process and loading its input
+/// files, which may have been loaded seconds before by the previous run.
+/// A server keeps running instead: clients send it the words of a pipeline
+/// (as given to imageTool), and a pool of worker threads runs them, taking
+/// the files recently loaded from a cache of resident images.
+///
+/// This module is an extension of imageTool,
+/// a programming project for the course AED, DETI / UA.PT
+///
+/// You may freely use and modify this code, at your own risk,
+/// as long as you give proper credit to the original and subsequent authors.
+
+#ifndef SERVER_H
+#define SERVER_H
+
+#include <stddef.h>
+
+/// Serve pipelines on the Unix domain socket at path.
+///   workers : number of pipelines run at the same time.
+///   cache : bytes of pixels of the loaded images kept resident (0 = none).
+/// Each request runs as imageTool would run its words, but relative file
+/// names are relative to the directory of the client.  (Its progress
+/// messages go to the standard error of the server, and tic/toc measure
+/// all the requests running at the time.)
+/// A socket left at path by a server that stopped is replaced.
+/// Requires: workers > 0.
+/// Runs until it fails: then returns its error code (see PipelineErrMsg),
+/// with *cause set to the error cause, and errno set accordingly.
+int ServerRun(const char* path, int workers, size_t cache, const char** cause) ;
+
+/// Send the ac words av[0..ac-1] of a pipeline to the server at path, and
+/// copy the results (of info and locate) it returns to stdout.
+/// A first word --explain asks for the optimized plan instead.
+/// Returns 0 on success.  On failure of the pipeline, or of the request,
+/// returns its error code (see PipelineErrMsg), with *cause set to the
+/// error cause, and errno set accordingly.
+int ServerRequest(const char* path, int ac, char* const av[], const char** cause) ;
+
+#endif